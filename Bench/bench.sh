@@ -0,0 +1,69 @@
+#!/bin/bash
+# Encode/decode round-trip benchmark.
+# Usage: bench.sh <asmium> <muimsa> <seed> <num_of_files>
+#
+# 1. gen_corpus writes a randomized corpus and the expected mnemonics.
+# 2. asmium --hex encodes each file (one line of bytes per statement).
+# 3. muimsa decodes the concatenated bytes; every instruction must have the
+#    same bytes and the expected mnemonic.
+ASMIUM=$1
+MUIMSA=$2
+SEED=$3
+NUM_OF_FILES=$4
+DIR=corpus
+TIMEFORMAT=%R
+
+rm -rf $DIR && mkdir -p $DIR || exit 1
+./gen_corpus $SEED $NUM_OF_FILES $DIR/c > $DIR/expected.txt || exit 1
+: > $DIR/empty.s
+
+# Seconds for one asmium run of each file, minus the process start-up
+# (measured on an empty file) so that the numbers are per statement.
+encode_time=$( { time for i in $(seq 0 $((NUM_OF_FILES - 1))); do
+  $ASMIUM --hex -o $DIR/c${i}_hex.txt $DIR/c$i.s > /dev/null || exit 1
+done; } 2>&1 ) || { echo "FAIL: asmium"; exit 1; }
+startup_time=$( { time for i in $(seq 0 $((NUM_OF_FILES - 1))); do
+  $ASMIUM --hex -o $DIR/empty_hex.txt $DIR/empty.s > /dev/null
+done; } 2>&1 )
+
+for i in $(seq 0 $((NUM_OF_FILES - 1))); do
+  cat $DIR/c${i}_hex.txt
+done | sed 's/ $//' > $DIR/hex.txt
+xxd -r -p $DIR/hex.txt > $DIR/corpus.bin
+
+num_of_instrs=$(wc -l < $DIR/expected.txt | tr -d ' ')
+num_of_bytes=$(wc -c < $DIR/corpus.bin | tr -d ' ')
+num_of_src_bytes=$(cat $DIR/c*.s | wc -c | tr -d ' ')
+
+awk -v t=$encode_time -v s=$startup_time -v n=$num_of_instrs \
+    -v b=$num_of_bytes -v sb=$num_of_src_bytes -v f=$NUM_OF_FILES '
+BEGIN {
+  printf("corpus: %d files, %d instrs, %d bytes (%d bytes of source)\n",
+         f, n, b, sb);
+  net = t - s;
+  if (net <= 0) net = t;
+  printf("encode: %.3f s (%.3f s start-up), %.0f instrs/s, %.2f MB/s\n",
+         t, s, n / net, b / net / 1e6);
+}'
+
+# "<name>: <bytes> bytes, <instrs> instrs, <GB/s> GB/s, <ns> ns/instr"
+$MUIMSA --bench-lengths $DIR/corpus.bin | awk '
+/ns\/instr/ {
+  name = $1; sub(":", "", name);
+  printf("decode (%s): %.0f instrs/s, %.2f MB/s\n", name,
+         1e9 / $8, $2 / ($4 * $8) * 1e3);
+}'
+
+paste $DIR/hex.txt $DIR/expected.txt > $DIR/roundtrip_expected.txt
+$MUIMSA $DIR/corpus.bin | awk -F '\t' 'NF == 3 {
+  split($3, m, " ");
+  print $2 "\t" m[1];
+}' > $DIR/roundtrip.txt
+if diff -u $DIR/roundtrip_expected.txt $DIR/roundtrip.txt > $DIR/roundtrip.diff
+then
+  echo "round trip: PASS ($num_of_instrs instrs)"
+else
+  echo "round trip: FAIL (see $DIR/roundtrip.diff)"
+  head -20 $DIR/roundtrip.diff
+  exit 1
+fi
@@ -0,0 +1,225 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Generates a randomized asmium corpus covering every 64-bit form asmium can
+// encode (ParseOpAssign, ParseOpXor, ParseOpCmp and mnemonic_table).
+//
+// Usage: gen_corpus <seed> <num_of_files> <prefix>
+//   writes <prefix><i>.s and prints the expected mnemonic of each statement
+//   (as muimsa names it) to stdout, in the order of the files.
+//
+// The 16-bit only forms (reg16 = imm, reg8 = [si]) are not generated since
+// they do not round-trip in 64-bit mode.
+
+// Each file has to fit in the input limits of asmium (BUF_SIZE, MAX_TOKENS,
+// MAX_LABELS).
+#define MAX_SRC_SIZE 3800
+#define MAX_TOKENS 960
+#define MAX_LABELS 16
+
+#define JCC_REL8_MAX 127
+
+const char *reg64_name[] = {"rax", "rcx", "rdx", "rbx",
+                            "rsp", "rbp", "rsi", "rdi"};
+const char *reg64_low_name[] = {"r0", "r1", "r2", "r3",
+                                "r4", "r5", "r6", "r7"};
+const char *reg32_name[] = {"eax", "ecx", "edx", "ebx",
+                            "esp", "ebp", "esi", "edi"};
+const char *reg16_name[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+// cs can not be the destination of mov
+const char *sreg_name[] = {"es", "ss", "ds", "fs", "gs"};
+
+uint64_t rand_state;
+
+uint32_t Rand() {
+  // xorshift64*
+  rand_state ^= rand_state >> 12;
+  rand_state ^= rand_state << 25;
+  rand_state ^= rand_state >> 27;
+  return (rand_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+int RandRange(int n) { return Rand() % n; }
+
+typedef enum {
+  kFormMovR64R64,
+  kFormMovSRegR16,
+  kFormMovR64Imm,
+  kFormMovR32Imm,
+  kFormXorR32R32,
+  kFormCmpImm8R32,
+  kFormIncR32,
+  kFormJmpRel8,
+  kFormJneLabel,
+  kFormPush,
+  kFormPop,
+  kFormNop,
+  kFormRetq,
+  kFormSyscall,
+  kFormInt,
+  kFormHlt,
+  kNumOfForms,
+} Form;
+
+int labels_in_file;
+int last_label_ofs;
+
+// Appends one statement to src. retv: encoded size in bytes, or 0 if the
+// form can not be used here.
+int GenStatement(Form form, char *src, int ofs, int *num_of_tokens,
+                 const char **mnemonic) {
+  int r = RandRange(8);
+  int r2 = RandRange(8);
+  switch (form) {
+  case kFormMovR64R64:
+    sprintf(src, "%s = %s\n", reg64_name[r], reg64_name[r2]);
+    *num_of_tokens = 3;
+    *mnemonic = "MOV";
+    return 3;
+  case kFormMovSRegR16:
+    sprintf(src, "%s = %s\n", sreg_name[RandRange(5)], reg16_name[r]);
+    *num_of_tokens = 3;
+    *mnemonic = "MOV";
+    return 2;
+  case kFormMovR64Imm:
+    sprintf(src, "%s = 0x%X\n", reg64_name[r], Rand() & 0x7fffffff);
+    *num_of_tokens = 3;
+    *mnemonic = "MOV";
+    return 7;
+  case kFormMovR32Imm:
+    sprintf(src, "%s = %u\n", reg32_name[r], Rand());
+    *num_of_tokens = 3;
+    *mnemonic = "MOV";
+    return 6;
+  case kFormXorR32R32:
+    sprintf(src, "%s ^= %s\n", reg32_name[r], reg32_name[r2]);
+    *num_of_tokens = 3;
+    *mnemonic = "XOR";
+    return 2;
+  case kFormCmpImm8R32:
+    sprintf(src, "%d ? %s\n", RandRange(256), reg32_name[r]);
+    *num_of_tokens = 3;
+    *mnemonic = "CMP";
+    return 3;
+  case kFormIncR32:
+    sprintf(src, "++%s\n", reg32_name[r]);
+    *num_of_tokens = 2;
+    *mnemonic = "INC";
+    return 2;
+  case kFormJmpRel8: {
+    int rel = RandRange(256) - 128;
+    sprintf(src, rel < 0 ? "jmp - %d\n" : "jmp %d\n", rel < 0 ? -rel : rel);
+    *num_of_tokens = rel < 0 ? 3 : 2;
+    *mnemonic = "JMP";
+    return 2;
+  }
+  case kFormJneLabel:
+    // Only backward references to labels within rel8 are supported
+    if (!labels_in_file || ofs + 2 - last_label_ofs > JCC_REL8_MAX + 1) {
+      return 0;
+    }
+    sprintf(src, "jne :l%d\n", labels_in_file - 1);
+    *num_of_tokens = 2;
+    *mnemonic = "JNE";
+    return 2;
+  case kFormPush:
+  case kFormPop:
+    sprintf(src, "%s %s\n", form == kFormPush ? "push" : "pop",
+            RandRange(2) ? reg64_name[r] : reg64_low_name[r]);
+    *num_of_tokens = 2;
+    *mnemonic = form == kFormPush ? "PUSH" : "POP";
+    return 1;
+  case kFormNop:
+    sprintf(src, "nop\n");
+    *num_of_tokens = 1;
+    *mnemonic = "NOP";
+    return 1;
+  case kFormRetq:
+    sprintf(src, "retq\n");
+    *num_of_tokens = 1;
+    *mnemonic = "RET";
+    return 1;
+  case kFormSyscall:
+    sprintf(src, "syscall\n");
+    *num_of_tokens = 1;
+    *mnemonic = "SYSCALL";
+    return 2;
+  case kFormInt:
+    sprintf(src, "int 0x%02X\n", RandRange(256));
+    *num_of_tokens = 2;
+    *mnemonic = "INT";
+    return 2;
+  case kFormHlt:
+    sprintf(src, "hlt\n");
+    *num_of_tokens = 1;
+    *mnemonic = "HLT";
+    return 1;
+  default:
+    break;
+  }
+  return 0;
+}
+
+void GenFile(FILE *fp) {
+  char src[MAX_SRC_SIZE + 64];
+  int src_size = 0;
+  int num_of_tokens = 0;
+  int ofs = 0;
+  labels_in_file = 0;
+  last_label_ofs = 0;
+  for (;;) {
+    char line[64];
+    int line_tokens;
+    const char *mnemonic;
+    if (labels_in_file < MAX_LABELS && RandRange(16) == 0) {
+      sprintf(line, ":l%d\n", labels_in_file);
+      line_tokens = 1;
+      mnemonic = NULL;
+    } else {
+      Form form = RandRange(kNumOfForms);
+      int size = GenStatement(form, line, ofs, &line_tokens, &mnemonic);
+      if (!size) {
+        continue;
+      }
+      ofs += size;
+    }
+    int line_size = strlen(line);
+    if (src_size + line_size > MAX_SRC_SIZE ||
+        num_of_tokens + line_tokens > MAX_TOKENS) {
+      break;
+    }
+    memcpy(&src[src_size], line, line_size);
+    src_size += line_size;
+    num_of_tokens += line_tokens;
+    if (mnemonic) {
+      puts(mnemonic);
+    } else {
+      last_label_ofs = ofs;
+      labels_in_file++;
+    }
+  }
+  fwrite(src, 1, src_size, fp);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s <seed> <num_of_files> <prefix>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  rand_state = strtoull(argv[1], NULL, 0) * 0x9e3779b97f4a7c15ULL + 1;
+  int num_of_files = atoi(argv[2]);
+  for (int i = 0; i < num_of_files; i++) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s%d.s", argv[3], i);
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+      fprintf(stderr, "Failed to open %s\n", path);
+      return EXIT_FAILURE;
+    }
+    GenFile(fp);
+    fclose(fp);
+  }
+  return 0;
+}
@@ -0,0 +1,16 @@
+// Every error is reported in one run: the broken statements are skipped
+// up to the end of their line and the labels are checked at the end.
+.bits 64
+:main
+	edi = 0x
+	edi = 1
+	frob edi
+	jmp :nowhere
+	edi = 2
+.bits 33
+	retq
+:main
+	retq
+// a label too long for the symbol table
+:aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa
+	retq
@@ -0,0 +1,17 @@
+.bits 64
+// Only the .func labels are functions: :loop is a part of main, whose size
+// goes up to func.
+.global main
+.func main
+.func func
+:main
+	edi = 0
+:loop
+	++edi
+	10 ? edi
+	jne :loop
+	call :func
+	retq
+:func
+	rax = rdi
+	retq
@@ -0,0 +1,43 @@
+# Generates a source of n .global functions (11 bytes each), which call and
+# jump to other functions before and after them. With hex=1, the bytes it
+# assembles to (as in *_hex_expected.txt); with symbols=1, its symbols (as in
+# *_symbols_expected.txt).
+function rel32(v, s, k) {
+  if (v < 0) {
+    v += 4294967296
+  }
+  s = ""
+  for (k = 0; k < 4; k++) {
+    s = s sprintf(" %02X", v % 256)
+    v = int(v / 256)
+  }
+  return s
+}
+BEGIN {
+  if (symbols) {
+    for (i = 0; i < n; i++) {
+      print "f" i, 11, "FUNC", "GLOBAL"
+    }
+    exit
+  }
+  if (!hex) {
+    print ".bits 64"
+    for (i = 0; i < n; i++) {
+      print ".global f" i
+    }
+  }
+  for (i = 0; i < n; i++) {
+    c = (i * 7 + 3) % n
+    j = (i * 13 + 5) % n
+    if (hex) {
+      print "E8" rel32(11 * c - (11 * i + 5)) " "
+      print "E9" rel32(11 * j - (11 * i + 10)) " "
+      print "C3 "
+    } else {
+      print ":f" i
+      print "\tcall :f" c
+      print "\tjmp :f" j
+      print "\tretq"
+    }
+  }
+}
@@ -1,4 +1,5 @@
 .bits 16
+.org 0x7c00
 	jmp 0x4e
 	nop
 .asciinz	"HELLOIPL"
@@ -28,7 +29,7 @@
 	sp = 0x7c00
 	ds = ax
 	es = ax
-	si = 0x7c74
+	si = :msg
 	al = [ si ]
 #.data8x		8a 04
 .data8		0x83 0xc6 0x01
@@ -41,6 +42,7 @@
 	hlt
 	jmp -3
 
+:msg
 .data8		0x0a 0x0a
 .asciinz	"HELLO"
 .data8		0x20
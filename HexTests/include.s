@@ -0,0 +1,10 @@
+// include/add.s includes include/common.s (relative to itself), and the
+// second .include of each file is skipped by the include guard.
+.bits 64
+:main
+	eax = 41
+	call :add_one
+	retq
+.include "include/add.s"
+.include "include/add.s"
+.include "include/common.s"
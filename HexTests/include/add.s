@@ -0,0 +1,4 @@
+.include "common.s"
+:add_one
+	++eax
+	retq
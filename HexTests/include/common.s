@@ -0,0 +1,2 @@
+:common_ret
+	retq
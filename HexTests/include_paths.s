@@ -0,0 +1,12 @@
+// One file through different paths is included once, as is the source
+// itself: the include guard is keyed by the file, not by the path.
+.bits 64
+:main
+	eax = 41
+	call :add_one
+	retq
+.include "include/add.s"
+.include "include/../include/add.s"
+.include "./include/add.s"
+.include "include/common.s"
+.include "include_paths.s"
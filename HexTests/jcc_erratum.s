@@ -0,0 +1,18 @@
+.bits 64
+// The padding of :loop is reported as part of the function main.
+.func main
+.func func
+:main
+	edi = 0
+:loop
+	++edi
+.offset 0x1c
+	10 ? edi
+	jne :loop
+.offset 0x5f
+	retq
+:func
+	nop
+.offset 0x7e
+	jmp -2
+	retq
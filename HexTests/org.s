@@ -0,0 +1,22 @@
+.bits 16
+.org 0x7c00
+	call :print
+	jmp :halt
+:print
+	al = [ :msg ]
+	bx = [ :msg ]
+	si = :msg
+	retq
+:halt
+	hlt
+.bits 64
+	ecx = :table
+	eax = [ :table ]
+	rdx = [ :table ]
+	rsi = :table
+	retq
+:msg
+.asciinz "OK"
+.section .data
+:table
+.data64 :msg 0x1234
@@ -0,0 +1,17 @@
+.bits 64
+:main
+	edi = 0
+.section .rodata
+.data32 0x01020304 0x05060708
+.section .bss
+.zero 64
+.section .data
+.data8 0x11 0x22
+.section .text
+:loop
+	++edi
+	10 ? edi
+	jne :loop
+	retq
+.section .data
+.data16 0x3344
@@ -0,0 +1,7 @@
+.global main
+main:
+	call f
+	retq
+f:
+	movl $42, %eax
+	retq
@@ -0,0 +1,7 @@
+.global main
+:main
+	call :f
+	retq
+:f
+	eax = 42
+	retq
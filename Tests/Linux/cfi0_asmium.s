@@ -0,0 +1,16 @@
+.global main
+:main
+.cfi_startproc
+	push rbp
+.cfi_def_cfa_offset 16
+.cfi_offset rbp, -16
+	rbp = rsp
+.cfi_def_cfa_register rbp
+	call :f
+	pop rbp
+.cfi_def_cfa rsp, 8
+	retq
+.cfi_endproc
+:f
+	eax = 7
+	retq
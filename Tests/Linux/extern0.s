@@ -0,0 +1,11 @@
+.global main
+.section .rodata
+str:
+	.asciz "42"
+.text
+main:
+	pushq %rbp
+	leaq str(%rip), %rdi
+	call atoi
+	movq %rax, %rdi
+	call exit
@@ -0,0 +1,14 @@
+.global main
+.extern atoi
+.extern exit
+.section .rodata
+:str
+.asciinz "42"
+.data8 0
+.section .text
+:main
+	push rbp
+	rdi = :str
+	call :atoi
+	rdi = rax
+	call :exit
@@ -0,0 +1,475 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "asmium.h"
+
+//
+// Static loop analysis (--analyze)
+//
+// Each loop (a backward jump to a label) is estimated in cycles per
+// iteration, in the way of llvm-mca, from a table of the instruction forms
+// asmium encodes: the longest loop-carried dependency chain, the pressure on
+// the execution ports and the front-end limits. The largest one is the
+// bottleneck.
+//
+
+#define NUM_OF_PORTS 8
+#define NUM_OF_REGS 9 // GPRs by number (as asmium encodes them) and flags
+#define REG_FLAGS 8
+#define REG_SP 4
+#define REG_SI 6
+#define ANALYZE_ITERATIONS 16
+
+typedef enum {
+  kFormUnknown,
+  kFormNop,
+  kFormMovRegReg,
+  kFormMovRegImm,
+  kFormMovSregReg,
+  kFormLoad,
+  kFormLea,
+  kFormXorRegReg,
+  kFormZeroIdiom,
+  kFormCmpRegImm,
+  kFormIncReg,
+  kFormPush,
+  kFormPop,
+  kFormJcc,
+  kFormJmp,
+  kFormCall,
+  kFormRet,
+  kFormSyscall,
+  kFormInt,
+  kFormHlt,
+  kNumOfForms,
+} InstrForm;
+
+const char *form_names[kNumOfForms] = {
+    "?",          "nop",        "mov r, r",  "mov r, imm", "mov sreg, r",
+    "mov r, [m]", "lea r, [m]", "xor r, r",  "zero idiom", "cmp r, imm",
+    "inc r",      "push r",     "pop r",     "jcc",        "jmp",
+    "call",       "ret",        "syscall",   "int",        "hlt",
+};
+
+typedef struct {
+  uint8_t latency;     // cycles until the registers written are ready
+  uint8_t num_of_uops; // fused-domain uops (issue slots)
+  uint8_t ports[3];    // port mask of each unfused uop (0: none / no more)
+} FormTiming;
+
+struct CPU_MODEL {
+  const char *name;
+  int issue_width;  // fused uops per cycle
+  int fetch_bytes;  // bytes decoded per cycle (legacy decode)
+  int fuses_inc_jcc; // inc + jcc are macro-fused (as well as cmp + jcc)
+  FormTiming forms[kNumOfForms];
+};
+
+// Skylake: p0156 ALU, p06 branch, p23 load / store address, p4 store data,
+// p7 simple store address.
+#define SKL_P0156 0x63
+#define SKL_P06 0x41
+#define SKL_P15 0x22
+#define SKL_P23 0x0c
+#define SKL_P237 0x8c
+#define SKL_P4 0x10
+#define SKL_P6 0x40
+
+// Zen 2: p0-p3 ALU (p0 and p3 also branch), p4-p5 load, p6 store.
+#define ZN2_ALU 0x0f
+#define ZN2_BRANCH 0x09
+#define ZN2_LOAD 0x30
+#define ZN2_STORE 0x40
+
+// syscall, int and hlt are not modeled (no ports, no latency).
+const CpuModel cpu_models[] = {
+    {"skylake",
+     4,
+     16,
+     1,
+     {
+         [kFormUnknown] = {1, 1, {SKL_P0156}},
+         [kFormNop] = {0, 1, {0}},
+         [kFormMovRegReg] = {1, 1, {SKL_P0156}},
+         [kFormMovRegImm] = {1, 1, {SKL_P0156}},
+         [kFormMovSregReg] = {1, 1, {SKL_P0156}},
+         [kFormLoad] = {5, 1, {SKL_P23}},
+         [kFormLea] = {1, 1, {SKL_P15}},
+         [kFormXorRegReg] = {1, 1, {SKL_P0156}},
+         [kFormZeroIdiom] = {0, 1, {0}},
+         [kFormCmpRegImm] = {1, 1, {SKL_P0156}},
+         [kFormIncReg] = {1, 1, {SKL_P0156}},
+         [kFormPush] = {0, 1, {SKL_P237, SKL_P4}},
+         [kFormPop] = {5, 1, {SKL_P23}},
+         [kFormJcc] = {0, 1, {SKL_P06}},
+         [kFormJmp] = {0, 1, {SKL_P6}},
+         [kFormCall] = {0, 2, {SKL_P237, SKL_P4, SKL_P6}},
+         [kFormRet] = {0, 1, {SKL_P23, SKL_P6}},
+     }},
+    {"znver2",
+     5,
+     32,
+     0,
+     {
+         [kFormUnknown] = {1, 1, {ZN2_ALU}},
+         [kFormNop] = {0, 1, {0}},
+         [kFormMovRegReg] = {1, 1, {ZN2_ALU}},
+         [kFormMovRegImm] = {1, 1, {ZN2_ALU}},
+         [kFormMovSregReg] = {1, 1, {ZN2_ALU}},
+         [kFormLoad] = {4, 1, {ZN2_LOAD}},
+         [kFormLea] = {1, 1, {ZN2_ALU}},
+         [kFormXorRegReg] = {1, 1, {ZN2_ALU}},
+         [kFormZeroIdiom] = {0, 1, {0}},
+         [kFormCmpRegImm] = {1, 1, {ZN2_ALU}},
+         [kFormIncReg] = {1, 1, {ZN2_ALU}},
+         [kFormPush] = {0, 1, {ZN2_STORE}},
+         [kFormPop] = {4, 1, {ZN2_LOAD}},
+         [kFormJcc] = {0, 1, {ZN2_BRANCH}},
+         [kFormJmp] = {0, 1, {ZN2_BRANCH}},
+         [kFormCall] = {0, 2, {ZN2_STORE, ZN2_BRANCH}},
+         [kFormRet] = {0, 1, {ZN2_LOAD, ZN2_BRANCH}},
+     }},
+    {NULL}};
+
+const CpuModel *FindCpuModel(const char *name) {
+  for (const CpuModel *cpu = cpu_models; cpu->name; cpu++) {
+    if (strcmp(cpu->name, name) == 0) {
+      return cpu;
+    }
+  }
+  return NULL;
+}
+
+typedef struct {
+  InstrForm form;
+  uint32_t reads;  // bit n: register n (REG_FLAGS for the flags)
+  uint32_t writes;
+  int64_t target;  // of jcc / jmp, in .text
+  int fused;       // cmp / inc macro-fused with the next jcc
+} DecodedInstr;
+
+// Classifies an instruction of [begin, end) in text, as asmium encodes it.
+void DecodeInstr(DecodedInstr *d, const uint8_t *text, uint32_t begin,
+                 uint32_t end) {
+  const uint8_t *p = &text[begin];
+  int len = end - begin;
+  int i = 0;
+  memset(d, 0, sizeof(*d));
+  d->target = -1;
+  while (i < len && (p[i] == 0x66 || (p[i] & 0xf0) == 0x40)) {
+    i++; // operand size prefix, REX
+  }
+  if (i >= len) {
+    return;
+  }
+  uint8_t op = p[i];
+  uint8_t modrm = i + 1 < len ? p[i + 1] : 0;
+  int mod = modrm >> 6;
+  int reg = (modrm >> 3) & 7;
+  int rm = modrm & 7;
+  if (op == 0x90 || (op == 0x0f && modrm == 0x1f)) {
+    d->form = kFormNop;
+  } else if (op == 0x0f && modrm == 0x05) {
+    d->form = kFormSyscall;
+  } else if (op == 0x89 && mod == 3) {
+    d->form = kFormMovRegReg;
+    d->reads = 1 << reg;
+    d->writes = 1 << rm;
+  } else if ((op == 0x8a || op == 0x8b) && mod == 0) {
+    // [ :label ], or [si] (16bit)
+    d->form = kFormLoad;
+    d->reads = rm == 4 ? 1 << REG_SI : 0;
+    d->writes = 1 << reg;
+  } else if (op == 0x8d) {
+    d->form = kFormLea;
+    d->writes = 1 << reg;
+  } else if (op == 0x8e && mod == 3) {
+    d->form = kFormMovSregReg;
+    d->reads = 1 << rm;
+  } else if (op == 0xc7 && mod == 3) {
+    d->form = kFormMovRegImm;
+    d->writes = 1 << rm;
+  } else if ((op & 0xf8) == 0xb8) {
+    d->form = kFormMovRegImm;
+    d->writes = 1 << (op & 7);
+  } else if (op == 0x31 && mod == 3) {
+    // xor r, r of the same register does not depend on it
+    d->form = reg == rm ? kFormZeroIdiom : kFormXorRegReg;
+    d->reads = reg == rm ? 0 : (1 << reg) | (1 << rm);
+    d->writes = (1 << rm) | (1 << REG_FLAGS);
+  } else if (op == 0x83 && mod == 3 && reg == 7) {
+    d->form = kFormCmpRegImm;
+    d->reads = 1 << rm;
+    d->writes = 1 << REG_FLAGS;
+  } else if (op == 0xff && mod == 3 && reg == 0) {
+    d->form = kFormIncReg;
+    d->reads = 1 << rm;
+    d->writes = (1 << rm) | (1 << REG_FLAGS);
+  } else if ((op & 0xf8) == 0x50) {
+    d->form = kFormPush;
+    d->reads = (1 << (op & 7)) | (1 << REG_SP);
+    d->writes = 1 << REG_SP;
+  } else if ((op & 0xf8) == 0x58) {
+    d->form = kFormPop;
+    d->reads = 1 << REG_SP;
+    d->writes = (1 << (op & 7)) | (1 << REG_SP);
+  } else if ((op & 0xf0) == 0x70) {
+    d->form = kFormJcc;
+    d->reads = 1 << REG_FLAGS;
+    d->target = end + (int8_t)p[len - 1];
+  } else if (op == 0xeb) {
+    d->form = kFormJmp;
+    d->target = end + (int8_t)p[len - 1];
+  } else if (op == 0xe9) {
+    // rel16 (.bits 16) or rel32
+    d->form = kFormJmp;
+    d->target = end + (len - i - 1 == 2 ? (int16_t)(p[i + 1] | p[i + 2] << 8)
+                                        : (int32_t)(p[i + 1] | p[i + 2] << 8 |
+                                                    p[i + 3] << 16 |
+                                                    (uint32_t)p[i + 4] << 24));
+  } else if (op == 0xe8) {
+    d->form = kFormCall;
+    d->reads = 1 << REG_SP;
+    d->writes = 1 << REG_SP;
+  } else if (op == 0xc3) {
+    d->form = kFormRet;
+    d->reads = 1 << REG_SP;
+    d->writes = 1 << REG_SP;
+  } else if (op == 0xcd) {
+    d->form = kFormInt;
+  } else if (op == 0xf4) {
+    d->form = kFormHlt;
+  }
+}
+
+int IsStackForm(InstrForm form) {
+  // rsp is updated by the stack engine, out of the dependency chain.
+  return form == kFormPush || form == kFormPop || form == kFormCall ||
+         form == kFormRet;
+}
+
+int CountBits(uint32_t v) {
+  int n = 0;
+  for (; v; v &= v - 1) {
+    n++;
+  }
+  return n;
+}
+
+void PrintPorts(FILE *fp, uint32_t mask, int width) {
+  char s[NUM_OF_PORTS + 2] = "-";
+  if (mask) {
+    int n = 0;
+    s[n++] = 'p';
+    for (int port = 0; port < NUM_OF_PORTS; port++) {
+      if (mask & (1 << port)) {
+        s[n++] = '0' + port;
+      }
+    }
+    s[n] = 0;
+  }
+  fprintf(fp, "%-*s", width, s);
+}
+
+void PrintSourceLine(FILE *fp, const TextInstr *instr) {
+  // The line starts after the newline before it, in the file of the
+  // statement (an included file or the main source).
+  const SourceFile *file = source_files[instr->file];
+  if (!instr->file_line) {
+    return;
+  }
+  const char *src = file->text;
+  if (instr->file_line > 1) {
+    src += file->newline_offsets[instr->file_line - 2] + 1;
+  }
+  while (*src == ' ' || *src == '\t') {
+    src++;
+  }
+  int len = strcspn(src, "\r\n");
+  fprintf(fp, "%.*s", len, src);
+}
+
+const char *analyze_reg_names[NUM_OF_REGS] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "flags"};
+
+void AnalyzeLoop(FILE *fp, const CpuModel *cpu, const uint8_t *text,
+                 const TextInstr *instrs, const DecodedInstr *decoded,
+                 int first, int last) {
+  const TextInstr *head = &instrs[first];
+  const TextInstr *tail = &instrs[last];
+  uint32_t num_of_bytes = tail->end - head->begin;
+  fprintf(fp, "loop%s%s (lines %u-%u, .text 0x%x-0x%x, %u bytes) on %s:\n",
+          head->label ? " :" : "",
+          head->label ? TmpTokenCStr(head->label) : "", head->line, tail->line,
+          head->begin, tail->end, num_of_bytes, cpu->name);
+  fprintf(fp, "  %5s %4s %4s %-8s %-11s %s\n", "line", "uops", "lat", "ports",
+          "form", "source");
+
+  // Issue slots and the unfused uops (port masks) of an iteration
+  int num_of_uops = 0;
+  uint32_t *uop_ports =
+      ArenaAlloc(&assembly_arena, sizeof(uint32_t) * 3 * (last - first + 1));
+  int num_of_unfused_uops = 0;
+  int is_modeled = 1;
+  for (int i = first; i <= last; i++) {
+    const DecodedInstr *d = &decoded[i];
+    const FormTiming *timing = &cpu->forms[d->form];
+    if (d->form == kFormSyscall || d->form == kFormInt ||
+        d->form == kFormHlt || d->form == kFormUnknown) {
+      is_modeled = 0;
+    }
+    int is_fused_jcc = i > first && decoded[i - 1].fused;
+    if (!is_fused_jcc) {
+      num_of_uops += timing->num_of_uops;
+    }
+    // The fused pair is one uop on the ports of the jcc.
+    const FormTiming *port_timing =
+        d->fused ? &cpu->forms[kFormJcc] : is_fused_jcc ? NULL : timing;
+    uint32_t ports = 0;
+    for (int k = 0; port_timing && k < 3 && port_timing->ports[k]; k++) {
+      uop_ports[num_of_unfused_uops++] = port_timing->ports[k];
+      ports |= port_timing->ports[k];
+    }
+    fprintf(fp, "  %5u %4d %4d ", instrs[i].line,
+            is_fused_jcc ? 0 : timing->num_of_uops, timing->latency);
+    PrintPorts(fp, ports, 8);
+    fprintf(fp, " %-11s ", form_names[d->form]);
+    PrintSourceLine(fp, &instrs[i]);
+    fprintf(fp, "%s\n",
+            d->fused ? "  (macro-fused with the jcc)"
+                     : d->form == kFormUnknown ? "  (unknown, as 1 ALU uop)"
+                                               : "");
+  }
+
+  // Dependency chain: the growth of the ready time of the registers in
+  // steady state.
+  int ready[NUM_OF_REGS] = {0};
+  int ready_half[NUM_OF_REGS] = {0};
+  for (int iter = 0; iter < ANALYZE_ITERATIONS; iter++) {
+    if (iter == ANALYZE_ITERATIONS / 2) {
+      memcpy(ready_half, ready, sizeof(ready));
+    }
+    for (int i = first; i <= last; i++) {
+      const DecodedInstr *d = &decoded[i];
+      int start = 0;
+      for (int r = 0; r < NUM_OF_REGS; r++) {
+        if ((d->reads & (1 << r)) && ready[r] > start) {
+          start = ready[r];
+        }
+      }
+      for (int r = 0; r < NUM_OF_REGS; r++) {
+        if (d->writes & (1 << r)) {
+          int is_stack_engine = r == REG_SP && IsStackForm(d->form);
+          ready[r] =
+              is_stack_engine ? ready[r] : start + cpu->forms[d->form].latency;
+        }
+      }
+    }
+  }
+  int chain_reg = 0;
+  for (int r = 1; r < NUM_OF_REGS; r++) {
+    if (ready[r] - ready_half[r] > ready[chain_reg] - ready_half[chain_reg]) {
+      chain_reg = r;
+    }
+  }
+  double chain = (double)(ready[chain_reg] - ready_half[chain_reg]) /
+                 (ANALYZE_ITERATIONS - ANALYZE_ITERATIONS / 2);
+
+  // Port pressure: the uops which can only run on a set of ports share them,
+  // so the bound is the worst set.
+  double pressure = 0;
+  uint32_t pressure_ports = 0;
+  for (uint32_t set = 1; set < (1 << NUM_OF_PORTS); set++) {
+    int n = 0;
+    for (int i = 0; i < num_of_unfused_uops; i++) {
+      if ((uop_ports[i] & ~set) == 0) {
+        n++;
+      }
+    }
+    double cycles = (double)n / CountBits(set);
+    if (cycles > pressure ||
+        (cycles == pressure && pressure_ports &&
+         CountBits(set) < CountBits(pressure_ports))) {
+      pressure = cycles;
+      pressure_ports = set;
+    }
+  }
+
+  // Front end: issue width, legacy decode bandwidth and one taken branch
+  // (the back edge) per cycle.
+  double issue = (double)num_of_uops / cpu->issue_width;
+  double decode = (double)num_of_bytes / cpu->fetch_bytes;
+  double front_end = 1;
+  if (issue > front_end) {
+    front_end = issue;
+  }
+  if (decode > front_end) {
+    front_end = decode;
+  }
+
+  fprintf(fp, "  dependency chain: %.2f cycles/iter", chain);
+  if (chain > 0) {
+    fprintf(fp, " (%s)", analyze_reg_names[chain_reg]);
+  }
+  fprintf(fp, "\n  port pressure:    %.2f cycles/iter", pressure);
+  if (pressure > 0) {
+    fputs(" (", fp);
+    PrintPorts(fp, pressure_ports, 0);
+    fputc(')', fp);
+  }
+  fprintf(fp,
+          "\n  front end:        %.2f cycles/iter (issue %.2f, decode %.2f, "
+          "taken branch 1.00)\n",
+          front_end, issue, decode);
+  const char *bottleneck = "front end";
+  double estimate = front_end;
+  if (chain > estimate) {
+    bottleneck = "dependency chain";
+    estimate = chain;
+  }
+  if (pressure > estimate) {
+    bottleneck = "port pressure";
+    estimate = pressure;
+  }
+  fprintf(fp, "  estimate:         %.2f cycles/iter, bound by %s%s\n",
+          estimate, bottleneck,
+          is_modeled ? "" : " (syscall, int, hlt and unknown bytes are not "
+                            "modeled)");
+}
+
+void WriteLoopAnalysis(FILE *fp, const CpuModel *cpu, const uint8_t *text,
+                       const TextInstr *instrs, int num_of_instrs) {
+  DecodedInstr *decoded =
+      ArenaAlloc(&assembly_arena, sizeof(DecodedInstr) * num_of_instrs);
+  for (int i = 0; i < num_of_instrs; i++) {
+    DecodeInstr(&decoded[i], text, instrs[i].begin, instrs[i].end);
+  }
+  for (int i = 0; i + 1 < num_of_instrs; i++) {
+    InstrForm form = decoded[i].form;
+    decoded[i].fused =
+        decoded[i + 1].form == kFormJcc &&
+        (form == kFormCmpRegImm || (form == kFormIncReg && cpu->fuses_inc_jcc));
+  }
+  int num_of_loops = 0;
+  for (int last = 0; last < num_of_instrs; last++) {
+    int64_t target = decoded[last].target;
+    if (target < 0 || target > instrs[last].begin) {
+      continue;
+    }
+    int first = 0;
+    while (first < last && instrs[first].begin < target) {
+      first++;
+    }
+    if (instrs[first].begin != target) {
+      continue; // not to the start of an instruction
+    }
+    if (num_of_loops++) {
+      fputc('\n', fp);
+    }
+    AnalyzeLoop(fp, cpu, text, instrs, decoded, first, last);
+  }
+  if (!num_of_loops) {
+    fputs("No loops (backward jumps to a label) found\n", fp);
+  }
+}
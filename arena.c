@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asmium.h"
+
+//
+// Arena
+//
+// The data of an assembly (tokens, labels, section contents, symbols, ...)
+// is bump-allocated from chunks which are freed all at once by ArenaReset.
+// The chunks are kept, so the next assembly reuses the memory without
+// calling malloc again.
+//
+
+#define ARENA_CHUNK_SIZE (1 << 20)
+#define ARENA_ALIGN 16
+
+struct ARENA_CHUNK {
+  ArenaChunk *next;
+  size_t size;
+  uint8_t data[];
+};
+
+Arena assembly_arena;
+
+void *ArenaAlloc(Arena *arena, size_t size) {
+  size = AlignUp(size, ARENA_ALIGN);
+  while (!arena->current || arena->used + size > arena->current->size) {
+    // The next chunk (kept from a previous assembly), or a new one
+    ArenaChunk *next = arena->current ? arena->current->next : arena->first;
+    if (!next || next->size < size) {
+      size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+      ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+      if (!chunk) {
+        // not Error(): the diagnostics themselves live in the arena
+        fputs("No memory for the arena\n", stderr);
+        exit(EXIT_FAILURE);
+      }
+      chunk->size = chunk_size;
+      chunk->next = next;
+      if (arena->current) {
+        arena->current->next = chunk;
+      } else {
+        arena->first = chunk;
+      }
+      next = chunk;
+    }
+    arena->current = next;
+    arena->used = 0;
+  }
+  void *p = &arena->current->data[arena->used];
+  arena->used += size;
+  arena->last = p;
+  memset(p, 0, size);
+  return p;
+}
+
+void *ArenaGrow(Arena *arena, void *p, size_t old_size, size_t new_size) {
+  old_size = AlignUp(old_size, ARENA_ALIGN);
+  new_size = AlignUp(new_size, ARENA_ALIGN);
+  if (p && p == arena->last &&
+      arena->used - old_size + new_size <= arena->current->size) {
+    // The last allocation grows in place.
+    memset((uint8_t *)p + old_size, 0, new_size - old_size);
+    arena->used += new_size - old_size;
+    return p;
+  }
+  void *q = ArenaAlloc(arena, new_size);
+  if (p) {
+    memcpy(q, p, old_size);
+  }
+  return q;
+}
+
+void *ArenaReserve(Arena *arena, void *array, size_t *capacity,
+                   size_t needed, size_t elem_size) {
+  if (needed <= *capacity) {
+    return array;
+  }
+  size_t new_capacity = *capacity ? *capacity * 2 : 16;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+  array = ArenaGrow(arena, array, *capacity * elem_size,
+                    new_capacity * elem_size);
+  *capacity = new_capacity;
+  return array;
+}
+
+void PutSectionByte(OutputSection *section, uint8_t byte) {
+  if (section->size >= section->capacity) {
+    section->buf = ArenaReserve(&assembly_arena, section->buf,
+                                &section->capacity, section->size + 1, 1);
+  }
+  section->buf[section->size++] = byte;
+}
+
+void ArenaReset(Arena *arena) {
+  arena->current = NULL;
+  arena->used = 0;
+  arena->last = NULL;
+}
+
+void ArenaFree(Arena *arena) {
+  while (arena->first) {
+    ArenaChunk *next = arena->first->next;
+    free(arena->first);
+    arena->first = next;
+  }
+  ArenaReset(arena);
+}
@@ -1,19 +1,19 @@
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "asmium.h"
 
-#define BUF_SIZE 4096
-#define BIN_BUF_SIZE 8192
-#define MAX_TOKENS 1024
-#define MAX_LABELS 16
+#define HUGE_PAGE_SIZE 0x200000
+#define PAGE_SIZE 0x1000
 
 const char *mnemonic_name[] = {"push", "pop",     "xor", "mov", "nop",
                                "retq", "syscall", "inc", "cmp", "jne",
-                               "jmp",  "hlt",     "int", NULL};
+                               "jmp",  "hlt",     "int", "call", NULL};
 
 const char *op_name[] = {"=", "^=", NULL};
 
@@ -41,47 +41,104 @@ const char *register_name[] = {
 const char *segment_register_name[] = {"es", "cs", "ss", "ds",
                                        "fs", "gs", NULL};
 typedef struct {
-  int offset_in_binary;
+  const OutputSection *section;
+  int offset_in_binary;  // in section
   const TokenStr *token;
+  // The chars of token, which AddLabel and FindLabel compare with every label
+  const char *name;
+  int name_len;
+  int line; // in the main source (statement_line)
+  int jcc_padding_bytes;
+  int is_func; // IsFunctionLabel
 } Label;
 
-char buf[BUF_SIZE + 16];
-
-uint8_t bin_buf[BIN_BUF_SIZE];
-size_t bin_buf_size;
-
-uint8_t current_bits = 64;
-
-Label labels[MAX_LABELS];
+typedef struct {
+  const OutputSection *section;
+  int end;  // offset in section
+  int line; // of the statement in the source (-g)
+  uint8_t file;   // of the statement (TokenStr.file)
+  int file_line;  // of the statement in its file
+} InstrEnd;
+
+// The source (NUL-terminated)
+char *buf;
+
+// Selected by the .section directive. Alignments are the file / load
+// alignments in the ELF output (.text is 32-byte aligned so that
+// --mitigate-jcc-erratum boundaries hold after link). The contents grow
+// in assembly_arena.
+OutputSection sections[kNumOfSections] = {
+    {".text", NULL, 0, 32},
+    {".data", NULL, 0, 16},
+    {".rodata", NULL, 0, 16},
+    {".bss", NULL, 0, 16},
+};
+OutputSection *current_section;
+
+uint8_t current_bits;
+
+Label *labels;
 int labels_count;
+size_t labels_capacity;
+
+// where each statement ends (used for --hex output and -g line rows)
+InstrEnd *instr_end_list;
+int instr_end_list_used;
+size_t instr_end_list_capacity;
+int statement_line;
+int include_line; // of the outermost .include being parsed, or 0
+// Index of the first newline after the statement in its file, which moves
+// forward along the tokens (see TokenLineFrom).
+int newline_cursor;
+uint8_t statement_file;
+int statement_file_line;
+
+// Sets statement_line (in the main source) for the statement at ts.
+void SetStatementLine(const TokenStr *ts) {
+  statement_file = TokenFileIndex(ts);
+  statement_file_line = TokenLineFrom(ts, &newline_cursor);
+  statement_line = include_line ? include_line : statement_file_line;
+}
+
+// retv: whether ts is on the line of the statement
+int IsOnStatementLine(const TokenStr *ts) {
+  return IsTokenBeforeNewline(ts, newline_cursor);
+}
 
 FILE *dst_fp = NULL;
 int is_hex_mode = 0;
+// address of the first byte of --binary / --hex output (.org)
+uint64_t org_address = 0;
+int is_org_specified = 0;
+int is_jcc_erratum_mitigation_mode = 0;
+int jcc_padding_bytes_before_labels;
 
 //
 // TokenStr
 //
 
-TokenStr token_str_list[MAX_TOKENS];
-int token_str_list_used = 0;
+TokenStr *token_str_list;
+int token_str_list_used;
 
 int IsEqualTokenStr(const TokenStr *ts, const char *s) {
   int s_len = strlen(s);
-  if (s_len != ts->len)
+  if (s_len != TokenLen(ts))
     return 0;
-  return strncmp(ts->str, s, s_len) == 0;
+  return strncmp(TokenChars(ts), s, s_len) == 0;
 }
 int IsEqualTokenStrs(const TokenStr *tsa, const TokenStr *tsb) {
-  return (tsa->len == tsb->len && strncmp(tsa->str, tsb->str, tsa->len) == 0);
+  int len = TokenLen(tsa);
+  return (len == TokenLen(tsb) &&
+          strncmp(TokenChars(tsa), TokenChars(tsb), len) == 0);
 }
 
 void CopyTokenStr(char *dst, const TokenStr *ts, int size) {
-  if (!(ts->len < size)) {
-    fprintf(stderr, "Not enough dst.\n");
-    exit(EXIT_FAILURE);
+  int len = TokenLen(ts);
+  if (!(len < size)) {
+    ErrorWithLine(ts, "Too long name");
   }
-  strncpy(dst, ts->str, ts->len);
-  dst[ts->len] = 0;
+  strncpy(dst, TokenChars(ts), len);
+  dst[len] = 0;
 }
 
 #define TmpTokenCStr_tmpstrsize (64 + 1)
@@ -93,60 +150,175 @@ const char *TmpTokenCStr(const TokenStr *ts) {
 
 void ExpectTokenStrType(const TokenStr *ts, TokenStrType type) {
   if (ts->type != type) {
-    fprintf(stderr, "line %d: Expected type %d, got %d\n", ts->line, type,
-            ts->type);
-    exit(EXIT_FAILURE);
+    ErrorWithLine(ts, "Expected type %d, got %d", type, ts->type);
   }
 }
 
-#define GetIntegerFromTokenStr_tmpstrsize (64 + 1)
 int64_t GetIntegerFromTokenStr(const TokenStr *ts) {
+  // decoded (and checked) by Tokenize
   ExpectTokenStrType(ts, kInteger);
-  char tmpstr[GetIntegerFromTokenStr_tmpstrsize];
-  CopyTokenStr(tmpstr, ts, GetIntegerFromTokenStr_tmpstrsize);
-  char *p;
-  int64_t value = strtoll(tmpstr, &p, 0);
-  if (!(tmpstr[0] != '\0' && *p == '\0')) {
-    fprintf(stderr, "line %d: Not valid integer. '%s'\n", ts->line, tmpstr);
-    exit(EXIT_FAILURE);
+  return TokenInteger(ts);
+}
+
+//
+// Diagnostics
+//
+// Errors are recorded in diagnostics and printed together when the
+// assembly ends, so that a run reports all of them. Error() unwinds to
+// error_recovery: Parse sets it for each statement (the rest of the line is
+// skipped) and main for the whole assembly (which fails).
+//
+
+int max_errors = 20; // --max-errors (0: no limit)
+int num_of_errors;
+char *diagnostics;
+int diagnostics_used;
+size_t diagnostics_capacity;
+jmp_buf *error_recovery;
+jmp_buf *assembly_recovery;
+
+void AddDiagnosticV(const char *path, int line, const char *fmt,
+                    va_list ap) {
+  char message[256];
+  int len = 0;
+  if (path) {
+    len = snprintf(message, sizeof(message), "%s line %d: ", path, line);
+  } else if (line) {
+    len = snprintf(message, sizeof(message), "line %d: ", line);
+  }
+  vsnprintf(&message[len], sizeof(message) - len, fmt, ap);
+  len = strlen(message);
+  diagnostics = ArenaReserve(&assembly_arena, diagnostics,
+                             &diagnostics_capacity, diagnostics_used + len + 2,
+                             1);
+  memcpy(&diagnostics[diagnostics_used], message, len);
+  diagnostics_used += len;
+  diagnostics[diagnostics_used++] = '\n';
+  diagnostics[diagnostics_used] = 0;
+}
+
+void AddDiagnostic(int line, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  AddDiagnosticV(NULL, line, fmt, ap);
+  va_end(ap);
+}
+
+// Prints the diagnostics of the assembly. retv: exit status of a failure.
+int PrintDiagnostics(FILE *fp) {
+  fflush(stdout);
+  if (diagnostics) {
+    fputs(diagnostics, fp);
+  }
+  fprintf(fp, "%d error%s\n", num_of_errors, num_of_errors == 1 ? "" : "s");
+  return EXIT_FAILURE;
+}
+
+void StopAssembly() {
+  if (!assembly_recovery) {
+    exit(PrintDiagnostics(stderr));
+  }
+  longjmp(*assembly_recovery, 1);
+}
+
+void CountError(const char *path, int line, const char *fmt, va_list ap) {
+  AddDiagnosticV(path, line, fmt, ap);
+  num_of_errors++;
+  if (max_errors && num_of_errors >= max_errors) {
+    AddDiagnostic(0, "Too many errors, stopping (--max-errors %d)",
+                  max_errors);
+    StopAssembly();
+  }
+}
+
+void ReportError(int line, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  CountError(NULL, line, fmt, ap);
+  va_end(ap);
+}
+
+void ReportErrorIn(const char *path, int line, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  CountError(path, line, fmt, ap);
+  va_end(ap);
+}
+
+void ReportErrorWithLine(const TokenStr *ts, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  CountError(TokenPath(ts), TokenLine(ts), fmt, ap);
+  va_end(ap);
+}
+
+void ErrorAtV(const char *path, int line, const char *fmt, va_list ap) {
+  CountError(path, line, fmt, ap);
+  if (!error_recovery) {
+    StopAssembly();
   }
-  // entire token is valid
-  return value;
+  longjmp(*error_recovery, 1);
+}
+
+void ErrorAt(int line, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  ErrorAtV(NULL, line, fmt, ap);
 }
 
 void Error(const char *s) {
-  fputs(s, stderr);
-  putchar('\n');
-  exit(EXIT_FAILURE);
+  ErrorAt(0, "%s", s);
 }
 
 void ErrorWithLine(const TokenStr *ts, const char *fmt, ...) {
-  fprintf(stderr, "line %d: ", ts->line);
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
-  va_end(ap);
-  fputc('\n', stderr);
-  exit(EXIT_FAILURE);
+  ErrorAtV(TokenPath(ts), TokenLine(ts), fmt, ap);
+}
+
+// Fails the assembly if errors were reported so far.
+void StopIfErrors() {
+  if (num_of_errors) {
+    StopAssembly();
+  }
+}
+
+int IsLabelName(const Label *label, const char *name, int name_len) {
+  return label->name_len == name_len &&
+         strncmp(label->name, name, name_len) == 0;
 }
 
 void AddLabel(const TokenStr *token, int offset_in_binary) {
-  if (labels_count >= MAX_LABELS) {
-    Error("Label table exceeded");
+  RESERVE_ONE(labels, labels_count, labels_capacity);
+  const char *name = TokenChars(token);
+  int name_len = TokenLen(token);
+  printf("Label[%d] definition %.*s at ofs +%d\n", labels_count, name_len,
+         name, offset_in_binary);
+  if (name_len > MAX_SYMBOL_NAME_LEN) {
+    ReportErrorWithLine(token, "Too long name");
+  }
+  for (int i = 0; i < labels_count; i++) {
+    if (IsLabelName(&labels[i], name, name_len)) {
+      ReportErrorWithLine(token, "Duplicate label %.*s", name_len, name);
+      break;
+    }
   }
-  printf("Label[%d] definition %s at ofs +%d\n", labels_count,
-         TmpTokenCStr(token), offset_in_binary);
-  // TODO: Add label duplication check
+  labels[labels_count].section = current_section;
   labels[labels_count].offset_in_binary = offset_in_binary;
   labels[labels_count].token = token;
+  labels[labels_count].name = name;
+  labels[labels_count].name_len = name_len;
+  labels[labels_count].line = statement_line;
   labels_count++;
 }
 
 int FindLabel(const TokenStr *token) {
-  printf("Search LabelName %s\n", TmpTokenCStr(token));
+  const char *name = TokenChars(token);
+  int name_len = TokenLen(token);
+  printf("Search LabelName %.*s\n", name_len, name);
   for (int i = 0; i < labels_count; i++) {
-    printf("LabelName[%d] = %s\n", i, TmpTokenCStr(labels[i].token));
-    if (IsEqualTokenStrs(labels[i].token, token))
+    printf("LabelName[%d] = %.*s\n", i, labels[i].name_len, labels[i].name);
+    if (IsLabelName(&labels[i], name, name_len))
       return i;
   }
   return -1;
@@ -157,15 +329,691 @@ uint8_t ModRM(uint8_t mod, uint8_t r, uint8_t r_m) {
 }
 
 void PutByte(uint8_t byte) {
-  bin_buf[bin_buf_size++] = byte;
-  printf("%02X ", byte);
-  if (dst_fp && is_hex_mode) {
-    fprintf(dst_fp, "%02X ", byte);
+  if (!current_section->buf) {
+    if (byte) {
+      Error("Only zeros can be put in .bss");
+    }
+    current_section->size++;
+  } else {
+    PutSectionByte(current_section, byte);
   }
+  printf("%02X ", byte);
 }
 void PutEndOfInstr() {
-  if (dst_fp && is_hex_mode) {
-    fprintf(dst_fp, "\n");
+  RESERVE_ONE(instr_end_list, instr_end_list_used, instr_end_list_capacity);
+  instr_end_list[instr_end_list_used].section = current_section;
+  instr_end_list[instr_end_list_used].end = current_section->size;
+  instr_end_list[instr_end_list_used].line = statement_line;
+  instr_end_list[instr_end_list_used].file = statement_file;
+  instr_end_list[instr_end_list_used].file_line = statement_file_line;
+  instr_end_list_used++;
+}
+
+// --binary / --hex: the sections are placed one after another from
+// org_address, each aligned to its alignment (.bss last, not written).
+// retv: the address of the end of the image.
+uint64_t LayoutFlatImage(uint64_t *section_addr) {
+  uint64_t addr = org_address;
+  uint64_t end = org_address;
+  for (int s = 0; s < kNumOfSections; s++) {
+    if (s != kSectionText && sections[s].size) {
+      addr = AlignUp(addr, sections[s].align);
+    }
+    section_addr[s] = addr;
+    addr += sections[s].size;
+    if (sections[s].buf) {
+      end = addr;
+    }
+  }
+  return end;
+}
+
+void WriteHexFile(FILE *fp, const uint64_t *section_addr) {
+  // One line per statement, and one for the padding between sections.
+  uint64_t addr = org_address;
+  for (int s = 0; s < kNumOfSections; s++) {
+    const OutputSection *section = &sections[s];
+    if (!section->buf || !section->size) {
+      continue;
+    }
+    if (addr < section_addr[s]) {
+      for (; addr < section_addr[s]; addr++) {
+        fputs("00 ", fp);
+      }
+      fputc('\n', fp);
+    }
+    addr += section->size;
+    int ofs = 0;
+    for (int i = 0; i < instr_end_list_used; i++) {
+      if (instr_end_list[i].section != section) {
+        continue;
+      }
+      for (; ofs < instr_end_list[i].end; ofs++) {
+        fprintf(fp, "%02X ", section->buf[ofs]);
+      }
+      fputc('\n', fp);
+    }
+  }
+}
+
+void WriteBinaryFile(FILE *fp, const uint64_t *section_addr,
+                     uint64_t end_addr) {
+  // Raw bytes, exactly as they are placed in memory from org_address.
+  uint64_t size = end_addr - org_address;
+  if (!sections[kSectionData].size && !sections[kSectionRodata].size) {
+    fwrite(sections[kSectionText].buf, 1, size, fp);
+    return;
+  }
+  uint8_t *flat_image_buf = ArenaAlloc(&assembly_arena, size);
+  for (int s = 0; s < kNumOfSections; s++) {
+    if (sections[s].buf) {
+      memcpy(&flat_image_buf[section_addr[s] - org_address], sections[s].buf,
+             sections[s].size);
+    }
+  }
+  fwrite(flat_image_buf, 1, size, fp);
+}
+
+//
+// Listing (-l)
+//
+// Each source line with the section offsets and the bytes of its
+// statements, and a summary at each label. It is made from the statement
+// records (instr_end_list) after the fixups are resolved, one row at a time.
+//
+
+#define LISTING_BYTES_PER_ROW 8
+#define CACHE_LINE_SIZE 64
+
+void PutListingRow(FILE *fp, const char *line, int line_len, int line_number,
+                   const OutputSection *section, int begin, int end) {
+  static const char hex_digits[] = "0123456789ABCDEF";
+  char row[128];
+  int n = line_number ? snprintf(row, sizeof(row), "%5d  ", line_number)
+                      : snprintf(row, sizeof(row), "%5s  ", "");
+  if (section) {
+    n += snprintf(&row[n], sizeof(row) - n, "%-7s %06X  ", section->name,
+                  begin);
+  } else {
+    n += snprintf(&row[n], sizeof(row) - n, "%-7s %6s  ", "", "");
+  }
+  int col = n;
+  if (section && !section->buf && end > begin) {
+    n += snprintf(&row[n], sizeof(row) - n, "(%d bytes)", end - begin);
+  } else {
+    for (int i = begin; i < end; i++) {
+      row[n++] = hex_digits[section->buf[i] >> 4];
+      row[n++] = hex_digits[section->buf[i] & 0xf];
+      row[n++] = ' ';
+    }
+  }
+  for (; n < col + LISTING_BYTES_PER_ROW * 3 + 1; n++) {
+    row[n] = ' ';
+  }
+  row[n] = 0;
+  fputs(row, fp);
+  fwrite(line, 1, line_len, fp);
+  fputc('\n', fp);
+}
+
+void PutListingLabelSummary(FILE *fp, const Label *label, int end) {
+  const OutputSection *section = label->section;
+  int begin = label->offset_in_binary;
+  int num_of_cache_lines =
+      end > begin ? (end - 1) / CACHE_LINE_SIZE - begin / CACHE_LINE_SIZE + 1
+                  : 0;
+  fprintf(fp,
+          "%23s; :%s: %d bytes (%s 0x%X-0x%X, cumulative %d), "
+          "%d cache line%s\n",
+          "", TmpTokenCStr(label->token), end - begin, section->name, begin,
+          end, end, num_of_cache_lines, num_of_cache_lines == 1 ? "" : "s");
+}
+
+// Orders of label indexes for qsort (ties in definition order)
+int CompareLabelLines(const void *a, const void *b) {
+  int ia = *(const int *)a;
+  int ib = *(const int *)b;
+  if (labels[ia].line != labels[ib].line) {
+    return labels[ia].line < labels[ib].line ? -1 : 1;
+  }
+  return ia < ib ? -1 : ia > ib;
+}
+
+int CompareLabelOffsets(const void *a, const void *b) {
+  const Label *la = &labels[*(const int *)a];
+  const Label *lb = &labels[*(const int *)b];
+  if (la->section != lb->section) {
+    return la->section < lb->section ? -1 : 1;
+  }
+  return la->offset_in_binary < lb->offset_in_binary
+             ? -1
+             : la->offset_in_binary > lb->offset_in_binary;
+}
+
+void WriteListingFile(const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) {
+    Error("Failed to open the listing file");
+  }
+  setvbuf(fp, NULL, _IOFBF, 1 << 16);
+  // The routine of a label extends to the next label in the section (in
+  // the order of the offsets), and its summary is put before its line (in
+  // the order of the lines).
+  int *label_order = ArenaAlloc(&assembly_arena, sizeof(int) * labels_count);
+  int *label_end = ArenaAlloc(&assembly_arena, sizeof(int) * labels_count);
+  for (int i = 0; i < labels_count; i++) {
+    label_order[i] = i;
+  }
+  qsort(label_order, labels_count, sizeof(int), CompareLabelOffsets);
+  for (int i = labels_count - 1; i >= 0; i--) {
+    const Label *label = &labels[label_order[i]];
+    int end = label->section->size;
+    if (i + 1 < labels_count) {
+      const Label *next = &labels[label_order[i + 1]];
+      if (next->section == label->section) {
+        end = next->offset_in_binary > label->offset_in_binary
+                  ? next->offset_in_binary
+                  : label_end[label_order[i + 1]];
+      }
+    }
+    label_end[label_order[i]] = end;
+  }
+  qsort(label_order, labels_count, sizeof(int), CompareLabelLines);
+  fprintf(fp, "%5s  %-7s %6s  %-*s source\n", "line", "section", "offset",
+          LISTING_BYTES_PER_ROW * 3, "bytes");
+  int section_ofs[kNumOfSections] = {0};
+  int record = 0;
+  int label = 0;
+  const char *line = buf;
+  for (int line_number = 1; *line; line_number++) {
+    int line_len = strcspn(line, "\n");
+    for (; label < labels_count &&
+           labels[label_order[label]].line <= line_number;
+         label++) {
+      int i = label_order[label];
+      if (labels[i].line == line_number) {
+        PutListingLabelSummary(fp, &labels[i], label_end[i]);
+      }
+    }
+    // The statements of the line (and any before it, such as padding)
+    int is_line_put = 0;
+    for (; record < instr_end_list_used &&
+           instr_end_list[record].line <= line_number;
+         record++) {
+      const InstrEnd *instr_end = &instr_end_list[record];
+      const OutputSection *section = instr_end->section;
+      int *ofs = &section_ofs[section - sections];
+      if (is_line_put && *ofs == instr_end->end) {
+        continue; // no bytes (e.g. a label in an included file)
+      }
+      do {
+        int end = *ofs + LISTING_BYTES_PER_ROW < instr_end->end && section->buf
+                      ? *ofs + LISTING_BYTES_PER_ROW
+                      : instr_end->end;
+        if (is_line_put) {
+          PutListingRow(fp, "", 0, 0, section, *ofs, end);
+        } else {
+          PutListingRow(fp, line, line_len, line_number, section, *ofs, end);
+          is_line_put = 1;
+        }
+        *ofs = end;
+      } while (*ofs < instr_end->end);
+    }
+    if (!is_line_put) {
+      PutListingRow(fp, line, line_len, line_number, NULL, 0, 0);
+    }
+    line += line_len;
+    if (*line == '\n') {
+      line++;
+    }
+  }
+  fclose(fp);
+}
+
+LineRow *line_rows;
+int line_rows_used;
+
+void BuildLineRows() {
+  // A row for each statement with code in .text, merging the statements
+  // which continue the same line.
+  line_rows =
+      ArenaAlloc(&assembly_arena, sizeof(LineRow) * instr_end_list_used);
+  int ofs = 0;
+  for (int i = 0; i < instr_end_list_used; i++) {
+    const InstrEnd *instr_end = &instr_end_list[i];
+    if (instr_end->section != &sections[kSectionText]) {
+      continue;
+    }
+    if (instr_end->end > ofs &&
+        (!line_rows_used ||
+         line_rows[line_rows_used - 1].line != instr_end->line)) {
+      line_rows[line_rows_used].offset = ofs;
+      line_rows[line_rows_used].line = instr_end->line;
+      line_rows_used++;
+    }
+    ofs = instr_end->end;
+  }
+}
+
+//
+// Fixup
+//
+// References to labels are emitted as zeros and patched after the whole
+// source is parsed, so that labels can be used before their definition.
+// References which can not be resolved in this object (.extern names,
+// labels in other sections, absolute addresses) become relocations.
+//
+
+typedef enum {
+  kFixupRel8,      // jcc rel8
+  kFixupRel16,     // jmp / call rel16 (.bits 16)
+  kFixupRel32,     // jmp rel32
+  kFixupRel32Call, // call rel32
+  kFixupRIPRel32,  // [rip + disp32]
+  kFixupAbs16,     // reg16 = :label, [ :label ] (.bits 16)
+  kFixupAbs32,     // reg32 = :label
+  kFixupAbs64,     // .data64
+} FixupType;
+
+typedef struct {
+  const TokenStr *label;
+  OutputSection *section;
+  int offset; // of the field in section. PC-relative fields end the instr.
+  FixupType type;
+} Fixup;
+
+Fixup *fixup_list;
+int fixup_list_used;
+size_t fixup_list_capacity;
+
+// names given to .global / .extern
+const TokenStr **global_list;
+int global_list_used;
+size_t global_list_capacity;
+const TokenStr **extern_list;
+int extern_list_used;
+size_t extern_list_capacity;
+// labels given to .func (if none, every label in .text is a function)
+const TokenStr **func_list;
+int func_list_used;
+size_t func_list_capacity;
+
+Symbol *global_symbols;
+int global_symbols_used;
+// functions which are not .global
+Symbol *func_symbols;
+int func_symbols_used;
+
+Relocation *relocations;
+int relocations_used;
+size_t relocations_capacity;
+
+int GetFixupSize(FixupType type) {
+  switch (type) {
+  case kFixupRel8:
+    return 1;
+  case kFixupRel16:
+  case kFixupAbs16:
+    return 2;
+  case kFixupAbs64:
+    return 8;
+  default:
+    return 4;
+  }
+}
+
+int IsAbsFixup(FixupType type) {
+  return type == kFixupAbs16 || type == kFixupAbs32 || type == kFixupAbs64;
+}
+
+RelocationType GetRelocationType(FixupType type) {
+  switch (type) {
+  case kFixupRel16:
+    return kRelocPC16;
+  case kFixupAbs16:
+    return kRelocAbs16;
+  case kFixupAbs32:
+    return kRelocAbs32;
+  case kFixupAbs64:
+    return kRelocAbs64;
+  default:
+    return kRelocPC32;
+  }
+}
+
+void PutFixup(const TokenStr *label, FixupType type) {
+  if (!current_section->buf) {
+    ErrorWithLine(label, "Label references can not be put in .bss");
+  }
+  RESERVE_ONE(fixup_list, fixup_list_used, fixup_list_capacity);
+  fixup_list[fixup_list_used].label = label;
+  fixup_list[fixup_list_used].section = current_section;
+  fixup_list[fixup_list_used].offset = current_section->size;
+  fixup_list[fixup_list_used].type = type;
+  fixup_list_used++;
+  for (int i = 0; i < GetFixupSize(type); i++) {
+    PutByte(0x00);
+  }
+}
+
+void AddNameToList(const TokenStr ***list, int *used, size_t *capacity,
+                   const TokenStr *token) {
+  if (token->type != kLabel && token->type != kIdentifier) {
+    ErrorWithLine(token, "Expected name, got %s", TmpTokenCStr(token));
+  }
+  *list = ArenaReserve(&assembly_arena, *list, capacity, *used + 1,
+                       sizeof(**list));
+  (*list)[(*used)++] = token;
+}
+
+int FindGlobalSymbol(const TokenStr *token) {
+  for (int i = 0; i < global_symbols_used; i++) {
+    if (IsEqualTokenStr(token, global_symbols[i].name))
+      return i;
+  }
+  return -1;
+}
+
+int IsFuncName(const TokenStr *token) {
+  for (int i = 0; i < func_list_used; i++) {
+    if (IsEqualTokenStrs(func_list[i], token))
+      return 1;
+  }
+  return 0;
+}
+
+void MarkFunctionLabels() {
+  // Labels in .text, or only the .func ones if there are any. Marked once,
+  // since the sizes of the functions look at every label.
+  for (int i = 0; i < labels_count; i++) {
+    Label *label = &labels[i];
+    label->is_func = label->section == &sections[kSectionText] &&
+                     (!func_list_used || IsFuncName(label->token));
+  }
+}
+
+int IsFunctionLabel(const Label *label) {
+  // valid after BuildGlobalSymbols
+  return label->is_func;
+}
+
+uint64_t GetFunctionSize(uint64_t offset) {
+  // up to the next function label in .text or the end of .text
+  uint64_t end = sections[kSectionText].size;
+  for (int i = 0; i < labels_count; i++) {
+    if (IsFunctionLabel(&labels[i]) && offset < labels[i].offset_in_binary &&
+        labels[i].offset_in_binary < end) {
+      end = labels[i].offset_in_binary;
+    }
+  }
+  return end - offset;
+}
+
+void SetSymbolToLabel(Symbol *symbol, const Label *label) {
+  // Too long names were reported by AddLabel, so the assembly fails anyway.
+  snprintf(symbol->name, sizeof(symbol->name), "%.*s", TokenLen(label->token),
+           TokenChars(label->token));
+  symbol->section = label->section - sections;
+  symbol->value = label->offset_in_binary;
+  symbol->is_func = IsFunctionLabel(label);
+  symbol->size = symbol->is_func ? GetFunctionSize(symbol->value) : 0;
+}
+
+void BuildGlobalSymbols() {
+  global_symbols = ArenaAlloc(
+      &assembly_arena,
+      sizeof(Symbol) * (1 + global_list_used + extern_list_used));
+  func_symbols = ArenaAlloc(&assembly_arena, sizeof(Symbol) * labels_count);
+  MarkFunctionLabels();
+  // Without .global, "main" at the start of .text is exported as before.
+  if (!global_list_used) {
+    strcpy(global_symbols[0].name, "main");
+    global_symbols[0].section = kSectionText;
+    global_symbols[0].value = 0;
+    global_symbols[0].is_func = 1;
+    global_symbols[0].size = GetFunctionSize(0);
+    global_symbols_used = 1;
+  }
+  for (int i = 0; i < func_list_used; i++) {
+    int label_index = FindLabel(func_list[i]);
+    if (label_index == -1 ||
+        labels[label_index].section != &sections[kSectionText]) {
+      ReportErrorWithLine(func_list[i],
+                          "Label %s is .func but not defined in .text",
+                          TmpTokenCStr(func_list[i]));
+    }
+  }
+  for (int i = 0; i < global_list_used; i++) {
+    int label_index = FindLabel(global_list[i]);
+    if (label_index == -1) {
+      ReportErrorWithLine(global_list[i],
+                          "Label %s is .global but not defined",
+                          TmpTokenCStr(global_list[i]));
+      continue;
+    }
+    SetSymbolToLabel(&global_symbols[global_symbols_used++],
+                     &labels[label_index]);
+  }
+  for (int i = 0; i < labels_count; i++) {
+    if (!IsFunctionLabel(&labels[i]) ||
+        FindGlobalSymbol(labels[i].token) != -1) {
+      continue;
+    }
+    SetSymbolToLabel(&func_symbols[func_symbols_used++], &labels[i]);
+  }
+  for (int i = 0; i < extern_list_used; i++) {
+    if (FindLabel(extern_list[i]) != -1) {
+      ReportErrorWithLine(extern_list[i], "Label %s is .extern but defined",
+                          TmpTokenCStr(extern_list[i]));
+      continue;
+    }
+    Symbol *symbol = &global_symbols[global_symbols_used++];
+    CopyTokenStr(symbol->name, extern_list[i], sizeof(symbol->name));
+    symbol->section = -1;
+    symbol->value = 0;
+    symbol->is_func = 0;
+    symbol->size = 0;
+  }
+}
+
+void AddRelocation(const Fixup *fixup, RelocationType type, int symbol,
+                   int target_section, int64_t addend) {
+  RESERVE_ONE(relocations, relocations_used, relocations_capacity);
+  Relocation *reloc = &relocations[relocations_used++];
+  reloc->section = fixup->section - sections;
+  reloc->offset = fixup->offset;
+  reloc->type = type;
+  reloc->symbol = symbol;
+  reloc->target_section = target_section;
+  reloc->addend = addend;
+}
+
+void ResolveFixups() {
+  for (int i = 0; i < fixup_list_used; i++) {
+    const Fixup *fixup = &fixup_list[i];
+    int size = GetFixupSize(fixup->type);
+    int label_index = FindLabel(fixup->label);
+    const Label *label = label_index == -1 ? NULL : &labels[label_index];
+    int64_t value = 0;
+    if (label && label->section == fixup->section &&
+        !IsAbsFixup(fixup->type)) {
+      value = label->offset_in_binary - (fixup->offset + size);
+      if ((fixup->type == kFixupRel8 && value != (int8_t)value) ||
+          (fixup->type == kFixupRel16 && value != (int16_t)value)) {
+        ReportErrorWithLine(fixup->label, "Label %s is out of rel%d range",
+                            TmpTokenCStr(fixup->label), size * 8);
+        continue;
+      }
+    } else if (fixup->type == kFixupRel8) {
+      ReportErrorWithLine(fixup->label,
+                          label ? "Label %s is not in this section"
+                                : "Label %s not found",
+                          TmpTokenCStr(fixup->label));
+      continue;
+    } else {
+      // PC-relative values are relative to the end of the field.
+      // Absolute addresses are not known until the sections are placed.
+      int64_t addend = IsAbsFixup(fixup->type) ? 0 : -size;
+      RelocationType type = GetRelocationType(fixup->type);
+      if (label) {
+        AddRelocation(fixup, type, -1, label->section - sections,
+                      addend + label->offset_in_binary);
+      } else {
+        int symbol = FindGlobalSymbol(fixup->label);
+        if (symbol == -1) {
+          ReportErrorWithLine(fixup->label, "Label %s not found",
+                              TmpTokenCStr(fixup->label));
+          continue;
+        }
+        // calls and jumps to other objects may go through the PLT
+        if (fixup->type == kFixupRel32 || fixup->type == kFixupRel32Call) {
+          type = kRelocPLT32;
+        }
+        AddRelocation(fixup, type, symbol, -1, addend);
+      }
+    }
+    for (int bi = 0; bi < size; bi++) {
+      fixup->section->buf[fixup->offset + bi] = (value >> (8 * bi)) & 0xff;
+    }
+  }
+}
+
+//
+// CFI
+//
+// .cfi_* directives add rules to the FDE opened by .cfi_startproc. With
+// --auto-cfi, push / pop and rbp = rsp / rsp = rbp are recorded instead,
+// and an FDE is inferred for each function label from them.
+//
+
+CfiOp *cfi_ops;
+int cfi_ops_used;
+size_t cfi_ops_capacity;
+Fde *fdes;
+int fdes_used;
+size_t fdes_capacity;
+Fde *current_fde; // between .cfi_startproc and .cfi_endproc
+int is_auto_cfi_mode = 0;
+
+typedef enum {
+  kFramePush,
+  kFramePop,
+  kFrameSetFramePointer,     // rbp = rsp
+  kFrameRestoreStackPointer, // rsp = rbp
+} FrameEventType;
+
+typedef struct {
+  uint32_t offset; // in .text, after the instruction
+  FrameEventType type;
+  int reg;
+} FrameEvent;
+
+// Not rolled back by the JCC erratum mitigation since only branches (and
+// cmp before them) are re-encoded.
+FrameEvent *frame_events;
+int frame_events_used;
+size_t frame_events_capacity;
+
+// DWARF register numbers of rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi
+const int dwarf_reg_number[8] = {0, 2, 1, 3, 7, 6, 4, 5};
+#define DWARF_REG_RSP 7
+#define DWARF_REG_RBP 6
+
+void AddCfiOp(uint32_t offset, CfiOpType type, int reg, int64_t value) {
+  RESERVE_ONE(cfi_ops, cfi_ops_used, cfi_ops_capacity);
+  CfiOp *op = &cfi_ops[cfi_ops_used++];
+  op->offset = offset;
+  op->type = type;
+  op->reg = reg;
+  op->value = value;
+}
+
+Fde *AddFde(uint32_t start) {
+  RESERVE_ONE(fdes, fdes_used, fdes_capacity);
+  Fde *fde = &fdes[fdes_used++];
+  fde->start = start;
+  fde->end = start;
+  fde->first_op = cfi_ops_used;
+  fde->num_of_ops = 0;
+  return fde;
+}
+
+void AddFrameEvent(FrameEventType type, int reg) {
+  if (!is_auto_cfi_mode || current_section != &sections[kSectionText]) {
+    return;
+  }
+  RESERVE_ONE(frame_events, frame_events_used, frame_events_capacity);
+  frame_events[frame_events_used].offset = current_section->size;
+  frame_events[frame_events_used].type = type;
+  frame_events[frame_events_used].reg = reg;
+  frame_events_used++;
+}
+
+void InferFde(Fde *fde) {
+  // CFA - rsp, and the CFA register (rsp, or rbp after rbp = rsp)
+  int64_t sp_ofs = 8;
+  int64_t frame_sp_ofs = 0;
+  int cfa_reg = DWARF_REG_RSP;
+  for (int i = 0; i < frame_events_used; i++) {
+    const FrameEvent *event = &frame_events[i];
+    if (event->offset <= fde->start || fde->end <= event->offset) {
+      continue;
+    }
+    int reg = dwarf_reg_number[event->reg];
+    switch (event->type) {
+    case kFramePush:
+      sp_ofs += 8;
+      if (cfa_reg == DWARF_REG_RSP) {
+        AddCfiOp(event->offset, kCfiDefCfaOffset, 0, sp_ofs);
+      }
+      if (reg == DWARF_REG_RBP) {
+        AddCfiOp(event->offset, kCfiOffset, reg, -sp_ofs);
+      }
+      break;
+    case kFramePop:
+      sp_ofs -= 8;
+      if (reg == DWARF_REG_RBP && cfa_reg == DWARF_REG_RBP) {
+        cfa_reg = DWARF_REG_RSP;
+        AddCfiOp(event->offset, kCfiDefCfa, cfa_reg, sp_ofs);
+      } else if (cfa_reg == DWARF_REG_RSP) {
+        AddCfiOp(event->offset, kCfiDefCfaOffset, 0, sp_ofs);
+      }
+      if (reg == DWARF_REG_RBP) {
+        AddCfiOp(event->offset, kCfiRestore, reg, 0);
+      }
+      break;
+    case kFrameSetFramePointer:
+      cfa_reg = DWARF_REG_RBP;
+      frame_sp_ofs = sp_ofs;
+      AddCfiOp(event->offset, kCfiDefCfaRegister, cfa_reg, 0);
+      break;
+    case kFrameRestoreStackPointer:
+      if (cfa_reg == DWARF_REG_RBP) {
+        sp_ofs = frame_sp_ofs;
+      }
+      break;
+    }
+  }
+  fde->num_of_ops = cfi_ops_used - fde->first_op;
+}
+
+void BuildAutoCfi() {
+  // The code before the first function label is the implicit main.
+  uint64_t start = 0;
+  for (int i = -1; i < labels_count; i++) {
+    if (i >= 0) {
+      if (!IsFunctionLabel(&labels[i]) ||
+          labels[i].offset_in_binary <= start) {
+        continue;
+      }
+      start = labels[i].offset_in_binary;
+    }
+    uint64_t size = GetFunctionSize(start);
+    if (size) {
+      Fde *fde = AddFde(start);
+      fde->end = start + size;
+      InferFde(fde);
+    }
   }
 }
 
@@ -178,10 +1026,14 @@ void PutEndOfInstr() {
 #define OP_Immediate_Grp1_Ev_Ib 0x83
 #define OP_MOV_Ev_Gv 0x89
 #define OP_MOV_Gb_Eb 0x8a
+#define OP_MOV_Gv_Ev 0x8b
+#define OP_LEA_Gv_M 0x8d
 #define OP_MOV_Ev_Iz 0xc7
 #define OP_INC_DEC_Grp5 0xff
 #define OP_POP_GReg 0x58 /* 0101 1rrr*/
 
+#define OP_CALL_Jz 0xe8
+#define OP_JMP_Jz 0xe9
 #define OP_Jcc_BASE 0x70
 #define COND_Jcc_NE 0x05
 
@@ -227,8 +1079,14 @@ Operand *ReadOperand(const TokenStr *tokens, int num_of_tokens, int *index,
     return ope;
   case kMemOfsBegin:
     ope->type = kMem;
+    ope->token = NULL;
     (*index)++;
-    if (ReadRegisterToken(tokens, num_of_tokens, *index, &ope->reg_index)) {
+    if (*index < num_of_tokens && tokens[*index].type == kLabel) {
+      // [ :label ] (absolute, or RIP-relative in 64bit mode)
+      ope->token = &tokens[*index];
+      (*index)++;
+    } else if (~ReadRegisterToken(tokens, num_of_tokens, *index,
+                                  &ope->reg_index)) {
       printf("Index Reg found: %s\n", TmpTokenCStr(&tokens[*index]));
       (*index)++;
     }
@@ -268,6 +1126,13 @@ int ParseOpAssign(const Operand *left, const Operand *right) {
       PutByte(PREFIX_REX | PREFIX_REX_BITS_W);
       PutByte(OP_MOV_Ev_Gv);
       PutByte(ModRM(3, right->reg_info.number, left->reg_info.number));
+      if (left->reg_info.number == REG_rBP &&
+          right->reg_info.number == REG_rSP) {
+        AddFrameEvent(kFrameSetFramePointer, REG_rBP);
+      } else if (left->reg_info.number == REG_rSP &&
+                 right->reg_info.number == REG_rBP) {
+        AddFrameEvent(kFrameRestoreStackPointer, REG_rSP);
+      }
     } else if (left->reg_info.category == kSegReg &&
                right->reg_info.category == kReg16) {
       // sreg = greg16
@@ -306,23 +1171,70 @@ int ParseOpAssign(const Operand *left, const Operand *right) {
     default:
       break;
     }
-  } else if (left->type == kReg && right->type == kMem) {
-    // reg = [mem location]
-    if (left->reg_info.category == kReg8) {
-      // 2.1.5 Table 2-1. 16-Bit Addressing Forms with the ModR/M Byte
-      if (right->reg_index.number == REG_rSI) {
-        PutByte(OP_MOV_Gb_Eb);
-        PutByte(ModRM(0, left->reg_info.number, 4));
-        return 0;
-      }
-    }
-  }
-  Error("Not implemented");
-  return 1;
-}
-
-int ParseOpXor(const Operand *left, const Operand *right) {
-  if (left->type == kReg && right->type == kReg) {
+  } else if (left->type == kReg && right->type == kLabelName) {
+    switch (left->reg_info.category) {
+    case kReg64Legacy:
+      // greg64 = :label (address of the label, lea greg64, [rip + label])
+      PutByte(PREFIX_REX | PREFIX_REX_BITS_W);
+      PutByte(OP_LEA_Gv_M);
+      PutByte(ModRM(0, left->reg_info.number, 5));
+      PutFixup(right->token, kFixupRIPRel32);
+      return 0;
+    case kReg32:
+      // greg32 = :label (absolute address as imm32)
+      PutByte(OP_MOV_Ev_Iz);
+      PutByte(ModRM(3, 0, left->reg_info.number));
+      PutFixup(right->token, kFixupAbs32);
+      return 0;
+    case kReg16:
+      // greg16 = :label (absolute address as imm16)
+      PutByte(0xb8 | left->reg_info.number);
+      PutFixup(right->token, kFixupAbs16);
+      return 0;
+    default:
+      break;
+    }
+  } else if (left->type == kReg && right->type == kMem && right->token) {
+    // reg = [ :label ]
+    uint8_t op = left->reg_info.category == kReg8 ? OP_MOV_Gb_Eb
+                                                  : OP_MOV_Gv_Ev;
+    if (current_bits == 16 && (left->reg_info.category == kReg8 ||
+                               left->reg_info.category == kReg16)) {
+      // mod=00 r/m=110: [disp16]
+      PutByte(op);
+      PutByte(ModRM(0, left->reg_info.number, 6));
+      PutFixup(right->token, kFixupAbs16);
+      return 0;
+    }
+    if (current_bits == 64 && (left->reg_info.category == kReg8 ||
+                               left->reg_info.category == kReg32 ||
+                               left->reg_info.category == kReg64Legacy)) {
+      // mod=00 r/m=101: [rip + disp32]
+      if (left->reg_info.category == kReg64Legacy) {
+        PutByte(PREFIX_REX | PREFIX_REX_BITS_W);
+      }
+      PutByte(op);
+      PutByte(ModRM(0, left->reg_info.number, 5));
+      PutFixup(right->token, kFixupRIPRel32);
+      return 0;
+    }
+  } else if (left->type == kReg && right->type == kMem) {
+    // reg = [mem location]
+    if (left->reg_info.category == kReg8) {
+      // 2.1.5 Table 2-1. 16-Bit Addressing Forms with the ModR/M Byte
+      if (right->reg_index.number == REG_rSI) {
+        PutByte(OP_MOV_Gb_Eb);
+        PutByte(ModRM(0, left->reg_info.number, 4));
+        return 0;
+      }
+    }
+  }
+  Error("Not implemented");
+  return 1;
+}
+
+int ParseOpXor(const Operand *left, const Operand *right) {
+  if (left->type == kReg && right->type == kReg) {
     PutByte(0x31);
     PutByte(ModRM(3 /* 0b11 */, right->reg_info.number & 7,
                   left->reg_info.number & 7));
@@ -365,8 +1277,10 @@ int ParseOpCmp(const Operand *left, const Operand *right) {
   return 1;
 }
 
-const OpEntry op_table[] = {
-    {"=", ParseOpAssign}, {"^=", ParseOpXor}, {"?", ParseOpCmp}, {NULL, NULL}};
+const OpEntry op_table[] = {{"=", ParseOpAssign, 0},
+                            {"^=", ParseOpXor, 0},
+                            {"?", ParseOpCmp, kOpFlagMacroFusible},
+                            {NULL, NULL, 0}};
 
 const OpEntry *FindOp(const TokenStr *tokenstr) {
   const OpEntry *op;
@@ -396,12 +1310,31 @@ int ParseMnemonicJMP(const TokenStr *tokens, int num_of_tokens, int index) {
     }
     PutByte(0xeb);
     PutByte(rel_offset & 0xff);
+  } else if (jmp_target.type == kLabelName) {
+    PutByte(OP_JMP_Jz);
+    PutFixup(jmp_target.token, current_bits == 16 ? kFixupRel16 : kFixupRel32);
   } else {
     ErrorWithLine(&tokens[index], "Unexpected type of operand");
   }
   return index;
 }
 
+int ParseMnemonicCALL(const TokenStr *tokens, int num_of_tokens, int index) {
+  int mn_index = index;
+  index++; // skip mnemonic
+  Operand ope;
+  if (!ReadOperand(tokens, num_of_tokens, &index, &ope)) {
+    ErrorWithLine(&tokens[index], "Unexpected token %s",
+                  TmpTokenCStr(&tokens[index]));
+  }
+  if (ope.type != kLabelName) {
+    ErrorWithLine(&tokens[mn_index], "Not implemented call target");
+  }
+  PutByte(OP_CALL_Jz);
+  PutFixup(ope.token, current_bits == 16 ? kFixupRel16 : kFixupRel32Call);
+  return index;
+}
+
 int ParseMnemonicINT(const TokenStr *tokens, int num_of_tokens, int index) {
   index++; // skip mnemonic
   if (tokens[index].type == kInteger) {
@@ -473,6 +1406,7 @@ int ParseMnemonicPUSH(const TokenStr *tokens, int num_of_tokens, int index) {
         ope.reg_info.category == kReg64Low) {
       if (current_bits == 64) {
         PutByte(0x50 + ope.reg_info.number);
+        AddFrameEvent(kFramePush, ope.reg_info.number);
       } else {
         ErrorWithLine(&tokens[mn_index], "Not implemented in current bits");
       }
@@ -495,6 +1429,7 @@ int ParseMnemonicPOP(const TokenStr *tokens, int num_of_tokens, int index) {
         ope.reg_info.category == kReg64Low) {
       if (current_bits == 64) {
         PutByte(0x58 + ope.reg_info.number);
+        AddFrameEvent(kFramePop, ope.reg_info.number);
       } else {
         ErrorWithLine(&tokens[mn_index], "Not implemented in current bits");
       }
@@ -514,20 +1449,8 @@ int ParseMnemonicJNE(const TokenStr *tokens, int num_of_tokens, int index) {
   Operand ope;
   if (ReadOperand(tokens, num_of_tokens, &index, &ope)) {
     if (ope.type == kLabelName) {
-      int label_index = FindLabel(ope.token);
-      if (label_index == -1) {
-        Error("Label not found (not implemented yet)");
-      }
-      printf("Label[%d] %s found (ofs=%d)\n", label_index,
-             TmpTokenCStr(labels[label_index].token),
-             labels[label_index].offset_in_binary);
-      int32_t rel_offset =
-          labels[label_index].offset_in_binary - (bin_buf_size + 2);
-      if ((rel_offset & ~127) && ~(rel_offset | 127)) {
-        Error("Offset out of bound (not impleented yet)");
-      }
       PutByte(OP_Jcc_BASE | COND_Jcc_NE);
-      PutByte(rel_offset & 0xff);
+      PutFixup(ope.token, kFixupRel8);
     } else {
       ErrorWithLine(&tokens[mn_index], "Not implemented jmp target");
     }
@@ -538,17 +1461,19 @@ int ParseMnemonicJNE(const TokenStr *tokens, int num_of_tokens, int index) {
   return index;
 }
 
-const MnemonicEntry mnemonic_table[] = {{"jmp", ParseMnemonicJMP},
-                                        {"nop", ParseMnemonicNOP},
-                                        {"push", ParseMnemonicPUSH},
-                                        {"pop", ParseMnemonicPOP},
-                                        {"retq", ParseMnemonicRETQ},
-                                        {"syscall", ParseMnemonicSYSCALL},
-                                        {"++", ParseMnemonicINC},
-                                        {"jne", ParseMnemonicJNE},
-                                        {"int", ParseMnemonicINT},
-                                        {"hlt", ParseMnemonicHLT},
-                                        {NULL, NULL}};
+const MnemonicEntry mnemonic_table[] = {
+    {"jmp", ParseMnemonicJMP, kOpFlagBranch},
+    {"call", ParseMnemonicCALL, kOpFlagBranch},
+    {"nop", ParseMnemonicNOP, 0},
+    {"push", ParseMnemonicPUSH, 0},
+    {"pop", ParseMnemonicPOP, 0},
+    {"retq", ParseMnemonicRETQ, kOpFlagBranch},
+    {"syscall", ParseMnemonicSYSCALL, 0},
+    {"++", ParseMnemonicINC, kOpFlagMacroFusible},
+    {"jne", ParseMnemonicJNE, kOpFlagBranch | kOpFlagCondBranch},
+    {"int", ParseMnemonicINT, 0},
+    {"hlt", ParseMnemonicHLT, 0},
+    {NULL, NULL, 0}};
 
 const MnemonicEntry *FindMnemonic(const TokenStr *tokenstr) {
   const MnemonicEntry *mne;
@@ -560,179 +1485,1032 @@ const MnemonicEntry *FindMnemonic(const TokenStr *tokenstr) {
 }
 
 //
-// Parser
+// Statement
 //
 
-int Parse(const TokenStr *tokens, int num_of_tokens, int index) {
+// Reads "<reg64>," of a .cfi_* directive. retv: DWARF register number
+int ReadCfiRegister(const TokenStr *tokens, int num_of_tokens, int *index) {
+  RegisterInfo reg_info;
+  if (ReadRegisterToken(tokens, num_of_tokens, *index, &reg_info) == -1 ||
+      reg_info.category != kReg64Legacy) {
+    ErrorWithLine(&tokens[*index], "Expected 64bit register, got %s",
+                  TmpTokenCStr(&tokens[*index]));
+  }
+  (*index)++;
+  if (*index < num_of_tokens && IsEqualTokenStr(&tokens[*index], ",")) {
+    (*index)++;
+  }
+  return dwarf_reg_number[reg_info.number];
+}
+
+//
+// .include "<path>"
+//
+// The statements of an included file are parsed in place of the directive,
+// at most once per assembly (an implicit include guard). Their code is
+// attributed to the line of the outermost .include for the line table and
+// the listing. The tokens of included files are cached by LoadIncludeFile.
+//
+
+SourceFile main_source;
+uint8_t is_included[MAX_SOURCE_FILES];
+
+int IsSourceFileUsed(int index) {
+  return is_included[index] && source_files[index];
+}
+
+int Parse(const TokenStr *tokens, int num_of_tokens, int index);
+
+void IncludeSourceFile(const TokenStr *path_token) {
+  // Relative paths are relative to the directory of the including file.
+  const char *includer = TokenPath(path_token);
+  if (!includer) {
+    includer = src_path;
+  }
+  const char *slash = strrchr(includer, '/');
+  int dir_len = TokenChars(path_token)[0] == '/' || !slash
+                    ? 0
+                    : slash - includer + 1;
+  char path[4096];
+  if (dir_len + TokenLen(path_token) >= (int)sizeof(path)) {
+    ErrorWithLine(path_token, "Too long path");
+  }
+  memcpy(path, includer, dir_len);
+  memcpy(&path[dir_len], TokenChars(path_token), TokenLen(path_token));
+  path[dir_len + TokenLen(path_token)] = 0;
+  int file_index = LoadIncludeFile(path);
+  if (file_index < 0) {
+    ErrorWithLine(path_token, "Failed to read %s", path);
+  }
+  if (is_included[file_index]) {
+    return;
+  }
+  is_included[file_index] = 1;
+  const SourceFile *file = source_files[file_index];
+  int outer_include_line = include_line;
+  int outer_newline_cursor = newline_cursor;
+  include_line = statement_line;
+  newline_cursor = 0;
+  Parse(file->tokens, file->num_of_tokens, 0);
+  include_line = outer_include_line;
+  newline_cursor = outer_newline_cursor;
+}
+
+// Reads "[-]<integer>" of a .cfi_* directive.
+int64_t ReadCfiInteger(const TokenStr *tokens, int num_of_tokens, int *index) {
+  int is_negative = 0;
+  if (*index < num_of_tokens && IsEqualTokenStr(&tokens[*index], "-")) {
+    is_negative = 1;
+    (*index)++;
+  }
+  int64_t v = GetIntegerFromTokenStr(&tokens[(*index)++]);
+  return is_negative ? -v : v;
+}
+
+int ParseStatement(const TokenStr *tokens, int num_of_tokens, int index,
+                   int *flags) {
+  // retv: Next index. *flags is set to OpFlags of the parsed statement.
   const MnemonicEntry *mne;
-  while (index < num_of_tokens) {
-    if (tokens[index].type == kLabel) {
-      AddLabel(&tokens[index++], bin_buf_size);
-    } else if (IsEqualTokenStr(&tokens[index], ".")) {
-      // directive
+  *flags = 0;
+  if (IsEqualTokenStr(&tokens[index], ".")) {
+    // directive
+    index++;
+    if (IsEqualTokenStr(&tokens[index], "bits")) {
       index++;
-      if (IsEqualTokenStr(&tokens[index], "bits")) {
-        index++;
-        int64_t bits = GetIntegerFromTokenStr(&tokens[index]);
-        if (bits == 64) {
-          puts(".bits 64");
-          current_bits = 64;
-        } else if (bits == 16) {
-          puts(".bits 16");
-          current_bits = 16;
-        } else {
-          ErrorWithLine(&tokens[index], "Invalid bits for .bits");
-        }
-        index++;
-      } else if (IsEqualTokenStr(&tokens[index], "asciinz")) {
-        index++;
-        const TokenStr *string_token = &tokens[index++];
-        ExpectTokenStrType(string_token, kString);
-        for (int i = 0; i < string_token->len; i++) {
-          PutByte(string_token->str[i]);
-        }
-      } else if (IsEqualTokenStr(&tokens[index], "data32")) {
-        index++;
-        const TokenStr *int_token;
-        for (int_token = &tokens[index];
-             int_token && int_token->type == kInteger;
-             int_token = &tokens[++index]) {
-          int64_t v = GetIntegerFromTokenStr(int_token);
-          PutByte(v & 0xff);
-          PutByte((v >> 8) & 0xff);
-          PutByte((v >> 16) & 0xff);
-          PutByte((v >> 24) & 0xff);
-        }
-      } else if (IsEqualTokenStr(&tokens[index], "data16")) {
-        index++;
-        const TokenStr *int_token;
-        for (int_token = &tokens[index];
-             int_token && int_token->type == kInteger;
-             int_token = &tokens[++index]) {
-          int64_t v = GetIntegerFromTokenStr(int_token);
-          PutByte(v & 0xff);
-          PutByte((v >> 8) & 0xff);
-        }
-      } else if (IsEqualTokenStr(&tokens[index], "data8")) {
-        index++;
-        const TokenStr *int_token;
-        for (int_token = &tokens[index];
-             int_token && int_token->type == kInteger;
-             int_token = &tokens[++index]) {
-          int64_t v = GetIntegerFromTokenStr(int_token);
-          PutByte(v & 0xff);
+      int64_t bits = GetIntegerFromTokenStr(&tokens[index]);
+      if (bits == 64) {
+        puts(".bits 64");
+        current_bits = 64;
+      } else if (bits == 16) {
+        puts(".bits 16");
+        current_bits = 16;
+      } else {
+        ErrorWithLine(&tokens[index], "Invalid bits for .bits");
+      }
+      index++;
+    } else if (IsEqualTokenStr(&tokens[index], "asciinz")) {
+      index++;
+      const TokenStr *string_token = &tokens[index++];
+      ExpectTokenStrType(string_token, kString);
+      const char *chars = TokenChars(string_token);
+      int len = TokenLen(string_token);
+      for (int i = 0; i < len; i++) {
+        PutByte(chars[i]);
+      }
+    } else if (IsEqualTokenStr(&tokens[index], "data64")) {
+      // .data64 (<integer> | <label>)...  on the same line
+      index++;
+      for (; index < num_of_tokens && IsOnStatementLine(&tokens[index]);
+           index++) {
+        if (tokens[index].type == kLabel) {
+          PutFixup(&tokens[index], kFixupAbs64);
+          continue;
         }
-      } else if (IsEqualTokenStr(&tokens[index], "offset")) {
-        index++;
-        const TokenStr *ofs_token = &tokens[index++];
-        int64_t ofs = GetIntegerFromTokenStr(ofs_token);
-        if (bin_buf_size > ofs) {
-          ErrorWithLine(&tokens[index],
-                        "Current offset is greater than %s (%d)",
-                        TmpTokenCStr(ofs_token), bin_buf_size);
+        int64_t v = GetIntegerFromTokenStr(&tokens[index]);
+        for (int bi = 0; bi < 8; bi++) {
+          PutByte((v >> (8 * bi)) & 0xff);
         }
-        while (bin_buf_size < ofs) {
-          PutByte(0x00);
+      }
+    } else if (IsEqualTokenStr(&tokens[index], "global")) {
+      index++;
+      AddNameToList(&global_list, &global_list_used, &global_list_capacity,
+                    &tokens[index++]);
+    } else if (IsEqualTokenStr(&tokens[index], "extern")) {
+      index++;
+      AddNameToList(&extern_list, &extern_list_used, &extern_list_capacity,
+                    &tokens[index++]);
+    } else if (IsEqualTokenStr(&tokens[index], "cfi_startproc")) {
+      index++;
+      if (current_fde) {
+        ErrorWithLine(&tokens[index - 1], "Missing .cfi_endproc");
+      }
+      if (current_section != &sections[kSectionText]) {
+        ErrorWithLine(&tokens[index - 1], "CFI is only for .text");
+      }
+      current_fde = AddFde(current_section->size);
+    } else if (IsEqualTokenStr(&tokens[index], "cfi_endproc")) {
+      index++;
+      if (!current_fde) {
+        ErrorWithLine(&tokens[index - 1], "Missing .cfi_startproc");
+      }
+      current_fde->end = current_section->size;
+      current_fde->num_of_ops = cfi_ops_used - current_fde->first_op;
+      current_fde = NULL;
+    } else if (IsEqualTokenStr(&tokens[index], "cfi_def_cfa") ||
+               IsEqualTokenStr(&tokens[index], "cfi_def_cfa_register") ||
+               IsEqualTokenStr(&tokens[index], "cfi_def_cfa_offset") ||
+               IsEqualTokenStr(&tokens[index], "cfi_offset") ||
+               IsEqualTokenStr(&tokens[index], "cfi_restore")) {
+      // .cfi_def_cfa <reg>, <ofs>  .cfi_def_cfa_register <reg>
+      // .cfi_def_cfa_offset <ofs>  .cfi_offset <reg>, <ofs>
+      // .cfi_restore <reg>
+      const TokenStr *directive = &tokens[index++];
+      if (!current_fde) {
+        ErrorWithLine(directive, "Missing .cfi_startproc");
+      }
+      CfiOpType type = kCfiDefCfaOffset;
+      int reg = 0;
+      int64_t value = 0;
+      if (IsEqualTokenStr(directive, "cfi_def_cfa")) {
+        type = kCfiDefCfa;
+        reg = ReadCfiRegister(tokens, num_of_tokens, &index);
+        value = ReadCfiInteger(tokens, num_of_tokens, &index);
+      } else if (IsEqualTokenStr(directive, "cfi_def_cfa_register")) {
+        type = kCfiDefCfaRegister;
+        reg = ReadCfiRegister(tokens, num_of_tokens, &index);
+      } else if (IsEqualTokenStr(directive, "cfi_def_cfa_offset")) {
+        value = ReadCfiInteger(tokens, num_of_tokens, &index);
+      } else if (IsEqualTokenStr(directive, "cfi_offset")) {
+        type = kCfiOffset;
+        reg = ReadCfiRegister(tokens, num_of_tokens, &index);
+        value = ReadCfiInteger(tokens, num_of_tokens, &index);
+        if (value % 8) {
+          ErrorWithLine(directive, "Offset should be a multiple of 8");
         }
-        printf("@+0x%zX\n", bin_buf_size);
       } else {
-        ErrorWithLine(&tokens[index], "No directive named %s found.",
-                      TmpTokenCStr(&tokens[index]));
+        type = kCfiRestore;
+        reg = ReadCfiRegister(tokens, num_of_tokens, &index);
       }
-      PutEndOfInstr();
-    } else if ((mne = FindMnemonic(&tokens[index]))) {
-      printf("MN_EXPR\n");
-      index = mne->parse(tokens, num_of_tokens, index);
-      PutEndOfInstr();
-    } else {
-      printf("BIN_EXPR\n");
-      // <op_sentence> = <operand> <operator> <operand>
-      // <operand> = <register> | <immediate> | <memory_location>
-      // <memory_location> = <sib> | <segment_register><sib>
-      // <sib> =  [ <scale> * <index> + <base> ] |
-      //          [ <index> + <base> ] |
-      //          [ <base> ]
-      // <scale> = 1 | 2 | 4 | 8
-      Operand left_ope;
-      if (!ReadOperand(tokens, num_of_tokens, &index, &left_ope)) {
-        ErrorWithLine(&tokens[index], "Expected operand, got %s",
-                      TmpTokenCStr(&tokens[index]));
+      AddCfiOp(current_section->size, type, reg, value);
+    } else if (IsEqualTokenStr(&tokens[index], "include")) {
+      index++;
+      const TokenStr *path_token = &tokens[index++];
+      ExpectTokenStrType(path_token, kString);
+      IncludeSourceFile(path_token);
+    } else if (IsEqualTokenStr(&tokens[index], "func")) {
+      index++;
+      AddNameToList(&func_list, &func_list_used, &func_list_capacity,
+                    &tokens[index++]);
+    } else if (IsEqualTokenStr(&tokens[index], "data32")) {
+      index++;
+      const TokenStr *int_token;
+      for (int_token = &tokens[index];
+           int_token && int_token->type == kInteger;
+           int_token = &tokens[++index]) {
+        int64_t v = GetIntegerFromTokenStr(int_token);
+        PutByte(v & 0xff);
+        PutByte((v >> 8) & 0xff);
+        PutByte((v >> 16) & 0xff);
+        PutByte((v >> 24) & 0xff);
       }
-
-      const OpEntry *op;
-      if (!(op = FindOp(&tokens[index]))) {
-        ErrorWithLine(&tokens[index], "Expected operator, got %s",
+    } else if (IsEqualTokenStr(&tokens[index], "data16")) {
+      index++;
+      const TokenStr *int_token;
+      for (int_token = &tokens[index];
+           int_token && int_token->type == kInteger;
+           int_token = &tokens[++index]) {
+        int64_t v = GetIntegerFromTokenStr(int_token);
+        PutByte(v & 0xff);
+        PutByte((v >> 8) & 0xff);
+      }
+    } else if (IsEqualTokenStr(&tokens[index], "data8")) {
+      index++;
+      const TokenStr *int_token;
+      for (int_token = &tokens[index];
+           int_token && int_token->type == kInteger;
+           int_token = &tokens[++index]) {
+        int64_t v = GetIntegerFromTokenStr(int_token);
+        PutByte(v & 0xff);
+      }
+    } else if (IsEqualTokenStr(&tokens[index], "offset")) {
+      index++;
+      const TokenStr *ofs_token = &tokens[index++];
+      int64_t ofs = GetIntegerFromTokenStr(ofs_token);
+      if (current_section->size > ofs) {
+        ErrorWithLine(&tokens[index],
+                      "Current offset is greater than %s (%d)",
+                      TmpTokenCStr(ofs_token), current_section->size);
+      }
+      while (current_section->size < ofs) {
+        PutByte(0x00);
+      }
+      printf("@+0x%zX\n", current_section->size);
+    } else if (IsEqualTokenStr(&tokens[index], "org")) {
+      // .org <address>: the address where the output is loaded, so that
+      // labels can be used as absolute addresses (--binary / --hex)
+      index++;
+      const TokenStr *addr_token = &tokens[index++];
+      for (int s = 0; s < kNumOfSections; s++) {
+        if (sections[s].size) {
+          ErrorWithLine(addr_token, ".org should precede any output");
+        }
+      }
+      org_address = GetIntegerFromTokenStr(addr_token);
+      is_org_specified = 1;
+      printf(".org 0x%llX\n", (unsigned long long)org_address);
+    } else if (IsEqualTokenStr(&tokens[index], "zero")) {
+      // .zero <size>: reserves zero-filled bytes (the way to fill .bss)
+      index++;
+      const TokenStr *size_token = &tokens[index++];
+      int64_t size = GetIntegerFromTokenStr(size_token);
+      if (size < 0) {
+        ErrorWithLine(size_token, "Invalid size for .zero");
+      }
+      for (int64_t i = 0; i < size; i++) {
+        PutByte(0x00);
+      }
+    } else if (IsEqualTokenStr(&tokens[index], "section")) {
+      // .section .text | .data | .rodata | .bss
+      index++;
+      if (!IsEqualTokenStr(&tokens[index], ".")) {
+        ErrorWithLine(&tokens[index], "Expected section name, got %s",
                       TmpTokenCStr(&tokens[index]));
       }
-      int op_index = index;
       index++;
+      const TokenStr *name_token = &tokens[index++];
+      int s;
+      for (s = 0; s < kNumOfSections; s++) {
+        if (IsEqualTokenStr(name_token, &sections[s].name[1])) {
+          break;
+        }
+      }
+      if (s == kNumOfSections) {
+        ErrorWithLine(name_token, "No section named .%s",
+                      TmpTokenCStr(name_token));
+      }
+      current_section = &sections[s];
+      printf(".section %s\n", current_section->name);
+    } else {
+      ErrorWithLine(&tokens[index], "No directive named %s found.",
+                    TmpTokenCStr(&tokens[index]));
+    }
+    PutEndOfInstr();
+  } else if ((mne = FindMnemonic(&tokens[index]))) {
+    printf("MN_EXPR\n");
+    index = mne->parse(tokens, num_of_tokens, index);
+    *flags = mne->flags;
+    PutEndOfInstr();
+  } else {
+    printf("BIN_EXPR\n");
+    // <op_sentence> = <operand> <operator> <operand>
+    // <operand> = <register> | <immediate> | <memory_location>
+    // <memory_location> = <sib> | <segment_register><sib>
+    // <sib> =  [ <scale> * <index> + <base> ] |
+    //          [ <index> + <base> ] |
+    //          [ <base> ]
+    // <scale> = 1 | 2 | 4 | 8
+    Operand left_ope;
+    if (!ReadOperand(tokens, num_of_tokens, &index, &left_ope)) {
+      ErrorWithLine(&tokens[index], "Expected operand, got %s",
+                    TmpTokenCStr(&tokens[index]));
+    }
 
-      Operand right_ope;
-      if (!ReadOperand(tokens, num_of_tokens, &index, &right_ope)) {
-        ErrorWithLine(&tokens[index], "Expected operand, got %s",
-                      TmpTokenCStr(&tokens[index]));
+    const OpEntry *op;
+    if (!(op = FindOp(&tokens[index]))) {
+      ErrorWithLine(&tokens[index], "Expected operator, got %s",
+                    TmpTokenCStr(&tokens[index]));
+    }
+    int op_index = index;
+    index++;
+
+    Operand right_ope;
+    if (!ReadOperand(tokens, num_of_tokens, &index, &right_ope)) {
+      ErrorWithLine(&tokens[index], "Expected operand, got %s",
+                    TmpTokenCStr(&tokens[index]));
+    }
+    if (op->parse(&left_ope, &right_ope)) {
+      ErrorWithLine(&tokens[op_index], "Failed to parse operator %s",
+                    TmpTokenCStr(&tokens[op_index]));
+    }
+    *flags = op->flags;
+    PutEndOfInstr();
+  }
+  return index;
+}
+
+//
+// JCC erratum mitigation
+//
+// On Skylake-derived cores, a jump (or a macro-fused cmp+jcc pair) which
+// crosses or ends on a 32-byte boundary is not cached in the decoded icache.
+// Such branches are moved to the next boundary by inserting NOPs in front of
+// them. Fused pairs are moved together.
+//
+
+#define JCC_ERRATUM_BOUNDARY 32
+
+int IsCrossingJccErratumBoundary(int begin, int end) {
+  // [begin, end) crosses or ends on a boundary
+  return (begin / JCC_ERRATUM_BOUNDARY) != (end / JCC_ERRATUM_BOUNDARY);
+}
+
+void PutNOPs(int size) {
+  // Recommended multi-byte NOP sequences (Intel SDM Vol.2B NOP).
+  static const uint8_t nops[9][9] = {
+      {0x90},
+      {0x66, 0x90},
+      {0x0f, 0x1f, 0x00},
+      {0x0f, 0x1f, 0x40, 0x00},
+      {0x0f, 0x1f, 0x44, 0x00, 0x00},
+      {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+      {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+      {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+      {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+  };
+  while (size > 0) {
+    // 0f 1f /0 has different ModRM forms in 16bit mode, so use 0x90 there.
+    int len = current_bits == 16 ? 1 : (size < 9 ? size : 9);
+    for (int i = 0; i < len; i++) {
+      PutByte(nops[len - 1][i]);
+    }
+    PutEndOfInstr();
+    size -= len;
+  }
+}
+
+void AddJccPadding(int ofs, int size) {
+  // Labels pointing at the padded op are moved behind the padding, so that
+  // jumps to them skip the NOPs.
+  for (int i = 0; i < labels_count; i++) {
+    if (labels[i].section == current_section &&
+        labels[i].offset_in_binary == ofs) {
+      labels[i].offset_in_binary += size;
+    }
+  }
+  // The padding is accounted to the last label before it, and to its
+  // function in PrintJccPaddingReport.
+  int func_index = -1;
+  for (int i = 0; i < labels_count; i++) {
+    if (labels[i].section == current_section &&
+        labels[i].offset_in_binary <= ofs) {
+      func_index = i;
+    }
+  }
+  if (func_index == -1) {
+    jcc_padding_bytes_before_labels += size;
+  } else {
+    labels[func_index].jcc_padding_bytes += size;
+  }
+  PutNOPs(size);
+}
+
+TextInstr *text_instrs;
+int text_instrs_used;
+
+void BuildTextInstrs() {
+  // The statements with code in .text, and the labels at their start.
+  text_instrs =
+      ArenaAlloc(&assembly_arena, sizeof(TextInstr) * instr_end_list_used);
+  int ofs = 0;
+  for (int i = 0; i < instr_end_list_used; i++) {
+    const InstrEnd *instr_end = &instr_end_list[i];
+    if (instr_end->section != &sections[kSectionText] ||
+        instr_end->end == ofs) {
+      continue;
+    }
+    TextInstr *instr = &text_instrs[text_instrs_used++];
+    instr->begin = ofs;
+    instr->end = instr_end->end;
+    instr->line = instr_end->line;
+    instr->file = instr_end->file;
+    instr->file_line = instr_end->file_line;
+    instr->label = NULL;
+    for (int k = 0; k < labels_count; k++) {
+      if (labels[k].section == &sections[kSectionText] &&
+          labels[k].offset_in_binary == ofs) {
+        instr->label = labels[k].token;
       }
-      if (op->parse(&left_ope, &right_ope)) {
-        ErrorWithLine(&tokens[op_index], "Failed to parse operator %s",
-                      TmpTokenCStr(&tokens[op_index]));
+    }
+    ofs = instr_end->end;
+  }
+}
+
+void PrintJccPaddingReport() {
+  // The padding of each label goes to the function label (IsFunctionLabel,
+  // which honors .func) at or before it. Labels in .text are defined in the
+  // order of their offsets, so one pass finds the enclosing functions.
+  int *func_bytes = ArenaAlloc(&assembly_arena, sizeof(int) * labels_count);
+  int outside_bytes = jcc_padding_bytes_before_labels;
+  int func_index = -1;
+  for (int i = 0; i < labels_count; i++) {
+    func_bytes[i] = 0;
+    if (IsFunctionLabel(&labels[i])) {
+      func_index = i;
+    }
+    if (labels[i].section != &sections[kSectionText] || func_index == -1) {
+      outside_bytes += labels[i].jcc_padding_bytes;
+    } else {
+      func_bytes[func_index] += labels[i].jcc_padding_bytes;
+    }
+  }
+  int total = outside_bytes;
+  puts("JCC erratum mitigation padding:");
+  if (outside_bytes) {
+    printf("  (no function): %d bytes\n", outside_bytes);
+  }
+  for (int i = 0; i < labels_count; i++) {
+    if (IsFunctionLabel(&labels[i])) {
+      printf("  %.*s: %d bytes\n", TokenLen(labels[i].token),
+             TokenChars(labels[i].token), func_bytes[i]);
+      total += func_bytes[i];
+    }
+  }
+  printf("  total: %d bytes\n", total);
+}
+
+//
+// Parser
+//
+
+int Parse(const TokenStr *tokens, int num_of_tokens, int index) {
+  // Previous statement, which can be the first half of a fused pair.
+  int prev_valid = 0;
+  int prev_index = 0;
+  int prev_ofs = 0;
+  int prev_instr_count = 0;
+  int prev_fixup_count = 0;
+  int prev_flags = 0;
+  jmp_buf recovery;
+  jmp_buf *outer_recovery = error_recovery;
+  error_recovery = &recovery;
+  while (index < num_of_tokens) {
+    // The recovery point is set for every statement, labels included, so
+    // that an error never unwinds to the frame of a previous one.
+    int begin_index = index;
+    if (setjmp(recovery)) {
+      // Skip the rest of the line of the broken statement.
+      SetStatementLine(&tokens[begin_index]);
+      index = begin_index + 1;
+      while (index < num_of_tokens && IsOnStatementLine(&tokens[index])) {
+        index++;
       }
-      PutEndOfInstr();
+      prev_valid = 0;
+      continue;
     }
+    SetStatementLine(&tokens[index]);
+    if (tokens[index].type == kLabel) {
+      AddLabel(&tokens[index++], current_section->size);
+      // A label between cmp and jcc is a jump target, so do not move them
+      // as a pair.
+      prev_valid = 0;
+      continue;
+    }
+    int begin_ofs = current_section->size;
+    int begin_instr_count = instr_end_list_used;
+    int begin_fixup_count = fixup_list_used;
+    int flags;
+    index = ParseStatement(tokens, num_of_tokens, index, &flags);
+    if (is_jcc_erratum_mitigation_mode && (flags & kOpFlagBranch)) {
+      int is_fused = (flags & kOpFlagCondBranch) && prev_valid &&
+                     (prev_flags & kOpFlagMacroFusible);
+      int pad_index = is_fused ? prev_index : begin_index;
+      int pad_ofs = is_fused ? prev_ofs : begin_ofs;
+      int pad_instr_count = is_fused ? prev_instr_count : begin_instr_count;
+      int pad_fixup_count = is_fused ? prev_fixup_count : begin_fixup_count;
+      if (IsCrossingJccErratumBoundary(pad_ofs, current_section->size)) {
+        // Roll back and re-encode after the padding so that relative
+        // offsets are recalculated.
+        current_section->size = pad_ofs;
+        instr_end_list_used = pad_instr_count;
+        fixup_list_used = pad_fixup_count;
+        SetStatementLine(&tokens[pad_index]); // NOPs: op
+        AddJccPadding(pad_ofs, JCC_ERRATUM_BOUNDARY -
+                                   (pad_ofs % JCC_ERRATUM_BOUNDARY));
+        int re_index = pad_index;
+        while (re_index < index) {
+          SetStatementLine(&tokens[re_index]);
+          re_index = ParseStatement(tokens, num_of_tokens, re_index, &flags);
+        }
+      }
+    }
+    prev_valid = 1;
+    prev_index = begin_index;
+    prev_ofs = begin_ofs;
+    prev_instr_count = begin_instr_count;
+    prev_fixup_count = begin_fixup_count;
+    prev_flags = flags;
   }
+  error_recovery = outer_recovery;
   return 0;
 }
 
-int main(int argc, char *argv[]) {
-  int src_path_index = 0;
-  int dst_path_index = 0;
-  enum {
-    kOutFormatELF,
-    kOutFormatMachO,
-  } output_format = kOutFormatMachO;
+// Frees everything of the previous assembly (O(1), the memory is kept in
+// assembly_arena) and starts a new one.
+void ResetAssembly() {
+  ArenaReset(&assembly_arena);
+  for (int s = 0; s < kNumOfSections; s++) {
+    sections[s].buf = NULL;
+    sections[s].size = 0;
+    sections[s].capacity = 0;
+    if (s != kSectionBss) {
+      // non-NULL: .bss is the only section without contents
+      sections[s].buf = ArenaReserve(&assembly_arena, NULL,
+                                     &sections[s].capacity, 256, 1);
+    }
+  }
+  current_section = &sections[kSectionText];
+  current_bits = 64;
+  org_address = 0;
+  is_org_specified = 0;
+  jcc_padding_bytes_before_labels = 0;
+  buf = NULL;
+  token_str_list = NULL;
+  token_str_list_used = 0;
+  labels = NULL;
+  labels_count = labels_capacity = 0;
+  instr_end_list = NULL;
+  instr_end_list_used = instr_end_list_capacity = 0;
+  fixup_list = NULL;
+  fixup_list_used = fixup_list_capacity = 0;
+  global_list = extern_list = func_list = NULL;
+  global_list_used = global_list_capacity = 0;
+  extern_list_used = extern_list_capacity = 0;
+  func_list_used = func_list_capacity = 0;
+  global_symbols = func_symbols = NULL;
+  global_symbols_used = func_symbols_used = 0;
+  relocations = NULL;
+  relocations_used = relocations_capacity = 0;
+  cfi_ops = NULL;
+  cfi_ops_used = cfi_ops_capacity = 0;
+  fdes = NULL;
+  fdes_used = fdes_capacity = 0;
+  current_fde = NULL;
+  frame_events = NULL;
+  frame_events_used = frame_events_capacity = 0;
+  line_rows = NULL;
+  line_rows_used = 0;
+  text_instrs = NULL;
+  text_instrs_used = 0;
+  memset(&main_source, 0, sizeof(main_source));
+  ResetSourceFiles(&main_source);
+  memset(is_included, 0, sizeof(is_included));
+  is_included[0] = 1; // the main source
+  include_line = 0;
+  newline_cursor = 0;
+  statement_line = statement_file_line = statement_file = 0;
+  num_of_errors = 0;
+  error_recovery = assembly_recovery = NULL;
+  diagnostics = NULL;
+  diagnostics_used = diagnostics_capacity = 0;
+}
+
+char *ReadSource(FILE *fp, Arena *arena) {
+  size_t capacity = 0;
+  size_t size = 0;
+  char *src = NULL;
+  for (;;) {
+    src = ArenaReserve(arena, src, &capacity, size + 4096, 1);
+    size_t n = fread(&src[size], 1, capacity - size - 1, fp);
+    size += n;
+    if (!n) {
+      break;
+    }
+  }
+  src[size] = 0;
+  return src;
+}
+
+void FindEntry(const char *entry_name, int *section, uint64_t *offset) {
+  // The entry is the label (":main" by default, or the start of .text if
+  // there is no such label).
+  if (entry_name[0] == ':') {
+    entry_name++;
+  }
+  int entry_index = -1;
+  for (int i = 0; i < labels_count; i++) {
+    if (IsEqualTokenStr(labels[i].token, entry_name)) {
+      entry_index = i;
+    }
+  }
+  if (entry_index == -1 && strcmp(entry_name, "main") != 0) {
+    ErrorAt(0, "Entry label %s not found", entry_name);
+  }
+  *section = entry_index == -1 ? kSectionText
+                               : labels[entry_index].section - sections;
+  *offset = entry_index == -1 ? 0 : labels[entry_index].offset_in_binary;
+}
+
+// Functions of the source (global ones first).
+int CollectFunctionSymbols(Symbol *symbols) {
+  int used = 0;
+  for (int i = 0; i < global_symbols_used; i++) {
+    if (global_symbols[i].is_func) {
+      symbols[used++] = global_symbols[i];
+    }
+  }
+  for (int i = 0; i < func_symbols_used; i++) {
+    symbols[used++] = func_symbols[i];
+  }
+  return used;
+}
+
+int is_perf_map_mode = 0;
+int is_jitdump_mode = 0;
+int is_bench_mode = 0;
+int bench_iterations = 10000;  // --bench: calls measured
+const char *listing_path = NULL;    // -l
+const CpuModel *analyze_cpu = NULL; // --analyze
+
+int RunInProcess(const char *entry_name, const char *src_path) {
+  JitImage image;
+  LoadJitImage(&image, sections, global_symbols, relocations,
+               relocations_used);
+  Symbol *symbols =
+      ArenaAlloc(&assembly_arena,
+                 sizeof(Symbol) * (global_symbols_used + func_symbols_used));
+  int num_of_symbols = CollectFunctionSymbols(symbols);
+  if (is_perf_map_mode) {
+    WritePerfMap(&image, symbols, num_of_symbols);
+  }
+  if (is_jitdump_mode) {
+    BuildLineRows();
+    WriteJitDump(&image, sections, symbols, num_of_symbols, src_path,
+                 line_rows, line_rows_used);
+  }
+  int entry_section;
+  uint64_t entry_offset;
+  FindEntry(entry_name, &entry_section, &entry_offset);
+  int (*entry)(void) =
+      (int (*)(void))(uintptr_t)(image.section_addr[entry_section] +
+                                 entry_offset);
+  fflush(stdout);
+  int status = 0;
+  if (is_bench_mode) {
+    BenchJitEntry(entry, entry_name, bench_iterations);
+  } else {
+    status = entry();
+  }
+  UnloadJitImage(&image);
+  return status;
+}
+
+// Options (ParseArgs)
+typedef enum {
+  kOutFormatELF,
+  kOutFormatELFExec,
+  kOutFormatMachO,
+  kOutFormatBinary,
+  kOutFormatRun,
+} OutputFormat;
+const char *src_path;
+const char *dst_path;
+const char *entry_name;
+int is_debug_line_mode;
+uint64_t segment_align;
+OutputFormat output_format;
+int is_watch_mode;
+const char *daemon_socket_path;
+
+void ResetOptions() {
+  src_path = NULL;
+  dst_path = NULL;
+  entry_name = "main";
+  is_debug_line_mode = 0;
+  segment_align = PAGE_SIZE;
+#ifdef __APPLE__
+  output_format = kOutFormatMachO;
+#else
+  output_format = kOutFormatELF;
+#endif
+  is_hex_mode = 0;
+  is_jcc_erratum_mitigation_mode = 0;
+  is_auto_cfi_mode = 0;
+  is_perf_map_mode = 0;
+  is_jitdump_mode = 0;
+  is_bench_mode = 0;
+  bench_iterations = 10000;
+  listing_path = NULL;
+  analyze_cpu = NULL;
+  max_errors = 20;
+  is_watch_mode = 0;
+  daemon_socket_path = NULL;
+}
+
+void PrintUsage(FILE *fp, const char *name) {
+  fputs("asmium: Human readable assembler\n", fp);
+  fprintf(fp,
+          "Usage: %s [--hex | --binary | --elf | --macho | --exec "
+          "[--entry <label>] [--hugepage-align]] [--mitigate-jcc-erratum] "
+          "[-g] [--auto-cfi] [-l <listing>] [--max-errors <n>] [--watch] "
+          "-o <dst> <src>\n"
+          "       %s --run [--entry <label>] [--perf-map] [--jitdump] "
+          "[--watch] <src>\n"
+          "       %s --bench [--iterations <n>] [--entry <label>] [--watch] "
+          "<src>\n"
+          "       %s --analyze [--cpu skylake | znver2] [--watch] <src>\n"
+          "       %s --daemon <socket>\n"
+          "       %s --connect <socket> <options> <src>\n",
+          name, name, name, name, name, name);
+}
+
+// Sets the options from the arguments (after ResetOptions).
+// retv: 0, or 1 if they are invalid (reported to err_fp).
+int ParseArgs(int argc, char *argv[], FILE *err_fp) {
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "-o") == 0) {
       i++;
       if (i < argc) {
-        dst_path_index = i;
+        dst_path = argv[i];
+      }
+      continue;
+    } else if (strcmp(argv[i], "-l") == 0) {
+      i++;
+      if (i < argc) {
+        listing_path = argv[i];
       }
       continue;
     } else if (strcmp(argv[i], "--hex") == 0) {
       is_hex_mode = 1;
+      continue;
+    } else if (strcmp(argv[i], "--binary") == 0) {
+      output_format = kOutFormatBinary;
+      continue;
+    } else if (strcmp(argv[i], "--elf") == 0) {
+      output_format = kOutFormatELF;
+      continue;
+    } else if (strcmp(argv[i], "--macho") == 0) {
+      output_format = kOutFormatMachO;
+      continue;
+    } else if (strcmp(argv[i], "--exec") == 0) {
+      output_format = kOutFormatELFExec;
+      continue;
+    } else if (strcmp(argv[i], "--entry") == 0) {
+      i++;
+      if (i < argc) {
+        entry_name = argv[i];
+      }
+      continue;
+    } else if (strcmp(argv[i], "--hugepage-align") == 0) {
+      segment_align = HUGE_PAGE_SIZE;
+      continue;
+    } else if (strcmp(argv[i], "--mitigate-jcc-erratum") == 0) {
+      is_jcc_erratum_mitigation_mode = 1;
+      continue;
+    } else if (strcmp(argv[i], "-g") == 0) {
+      is_debug_line_mode = 1;
+      continue;
+    } else if (strcmp(argv[i], "--auto-cfi") == 0) {
+      is_auto_cfi_mode = 1;
+      continue;
+    } else if (strcmp(argv[i], "--run") == 0) {
+      output_format = kOutFormatRun;
+      continue;
+    } else if (strcmp(argv[i], "--perf-map") == 0) {
+      is_perf_map_mode = 1;
+      continue;
+    } else if (strcmp(argv[i], "--jitdump") == 0) {
+      is_jitdump_mode = 1;
+      continue;
+    } else if (strcmp(argv[i], "--analyze") == 0) {
+      if (!analyze_cpu) {
+        analyze_cpu = FindCpuModel("skylake");
+      }
+      continue;
+    } else if (strcmp(argv[i], "--cpu") == 0) {
+      i++;
+      if (i >= argc || !(analyze_cpu = FindCpuModel(argv[i]))) {
+        fputs("--cpu needs skylake or znver2\n", err_fp);
+        return 1;
+      }
+      continue;
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      output_format = kOutFormatRun;
+      is_bench_mode = 1;
+      continue;
+    } else if (strcmp(argv[i], "--max-errors") == 0) {
+      i++;
+      if (i >= argc || (max_errors = strtol(argv[i], NULL, 0)) < 0) {
+        fputs("--max-errors needs a number (0: no limit)\n", err_fp);
+        return 1;
+      }
+      continue;
+    } else if (strcmp(argv[i], "--watch") == 0) {
+      is_watch_mode = 1;
+      continue;
+    } else if (strcmp(argv[i], "--daemon") == 0) {
+      i++;
+      if (i < argc) {
+        daemon_socket_path = argv[i];
+      }
+      continue;
+    } else if (strcmp(argv[i], "--iterations") == 0) {
+      i++;
+      if (i < argc) {
+        bench_iterations = strtol(argv[i], NULL, 0);
+      }
+      if (bench_iterations <= 0) {
+        fputs("--iterations needs a positive number\n", err_fp);
+        return 1;
+      }
+      continue;
     }
-    src_path_index = i;
+    src_path = argv[i];
   }
-  if (!dst_path_index || !src_path_index) {
-    puts("asmium: Human readable assembler");
-    printf("Usage: %s -o <dst> <src>\n", argv[0]);
+  if (daemon_socket_path) {
+    return 0;
+  }
+  if ((!dst_path && output_format != kOutFormatRun && !analyze_cpu) ||
+      !src_path) {
+    PrintUsage(err_fp, argv[0]);
     return 1;
   }
+  return 0;
+}
 
-  // printf("src: %s\ndst: %s\n", argv[src_path_index], argv[dst_path_index]);
-  FILE *src_fp = fopen(argv[src_path_index], "rb");
-  dst_fp = fopen(argv[dst_path_index], "wb");
+// retv: 1 if the options run code or do not return (not for --daemon).
+int NeedsOwnProcess() {
+  return output_format == kOutFormatRun || is_watch_mode ||
+         daemon_socket_path;
+}
 
-  if (!src_fp || !dst_fp)
-    return 0;
+// With is_atomic_output (--watch and --daemon), the output is written to
+// <dst>.tmp and renamed to dst when it is complete, so that readers never
+// see a partial file.
+int is_atomic_output;
+char dst_tmp_path[4096];
+
+void OpenOutput() {
+  dst_tmp_path[0] = 0;
+  if (!dst_path) {
+    dst_fp = stdout;
+    return;
+  }
+  const char *path = dst_path;
+  struct stat st;
+  if (is_atomic_output && (stat(dst_path, &st) || S_ISREG(st.st_mode))) {
+    // not for /dev/null and such
+    snprintf(dst_tmp_path, sizeof(dst_tmp_path), "%s.tmp", dst_path);
+    path = dst_tmp_path;
+  }
+  dst_fp = fopen(path, "wb");
+  if (!dst_fp) {
+    ErrorAt(0, "Failed to open %s", path);
+  }
+}
+
+// is_complete: 1 to keep (rename) the output, 0 to discard the temporary.
+void CloseOutput(int is_complete) {
+  if (!dst_fp || dst_fp == stdout) {
+    dst_fp = NULL;
+    return;
+  }
+  fclose(dst_fp);
+  dst_fp = NULL;
+  if (!dst_tmp_path[0]) {
+    return;
+  }
+  if (!is_complete) {
+    remove(dst_tmp_path);
+  } else if (rename(dst_tmp_path, dst_path)) {
+    ErrorAt(0, "Failed to replace %s", dst_path);
+  }
+}
 
-  int size = fread(buf, 1, BUF_SIZE, src_fp);
-  if (size >= BUF_SIZE) {
-    fputs("Too large input. Abort.", stderr);
-    exit(EXIT_FAILURE);
+int AssembleAndWrite() {
+  ResetAssembly();
+  jmp_buf recovery;
+  if (setjmp(recovery)) {
+    CloseOutput(0);
+    return EXIT_FAILURE;
+  }
+  error_recovery = assembly_recovery = &recovery;
+  FILE *src_fp = fopen(src_path, "rb");
+  if (!src_fp) {
+    ErrorAt(0, "Failed to open %s", src_path);
   }
-  buf[size] = 0;
+  SetMainSourceFile(src_fp);
+  buf = ReadSource(src_fp, &assembly_arena);
+  fclose(src_fp);
+  OpenOutput();
 
-  Tokenize(token_str_list, MAX_TOKENS, &token_str_list_used, buf);
-  DebugPrintTokens(token_str_list, token_str_list_used);
+  main_source.text = buf;
+  Tokenize(&main_source, &assembly_arena);
+  token_str_list = main_source.tokens;
+  token_str_list_used = main_source.num_of_tokens;
+  DebugPrintTokens(&main_source);
 
   Parse(token_str_list, token_str_list_used, 0);
+  if (current_fde) {
+    ReportError(0, "Missing .cfi_endproc");
+  }
+  BuildGlobalSymbols();
+  ResolveFixups();
+  StopIfErrors();
+  if (is_auto_cfi_mode) {
+    if (fdes_used) {
+      Error("--auto-cfi can not be used with .cfi_startproc");
+    }
+    BuildAutoCfi();
+  }
 
-  if (!is_hex_mode) {
-    if (output_format == kOutFormatMachO)
-      WriteObjFileForMachO(dst_fp, bin_buf, bin_buf_size);
-    else if (output_format == kOutFormatELF)
-      WriteObjFileForELF64(dst_fp, bin_buf, bin_buf_size);
+  if (is_jcc_erratum_mitigation_mode) {
+    PrintJccPaddingReport();
+  }
+  if (analyze_cpu) {
+    BuildTextInstrs();
+    WriteLoopAnalysis(stdout, analyze_cpu, sections[kSectionText].buf,
+                      text_instrs, text_instrs_used);
+    if (!dst_path && output_format != kOutFormatRun) {
+      CloseOutput(1);
+      return 0;
+    }
   }
 
+  int is_flat = is_hex_mode || output_format == kOutFormatBinary;
+  if (is_org_specified && !is_flat) {
+    Error(".org can only be used with --binary or --hex");
+  }
+  if (is_debug_line_mode && (is_flat || output_format != kOutFormatELF)) {
+    Error("-g can only be used with ELF object output");
+  }
+  if (relocations_used && output_format == kOutFormatMachO && !is_hex_mode) {
+    Error("Unresolved references need ELF output (relocations)");
+  }
+  if (output_format == kOutFormatRun) {
+    if (listing_path) {
+      WriteListingFile(listing_path);
+    }
+    CloseOutput(1);
+    return RunInProcess(entry_name, src_path);
+  }
+  if (is_flat) {
+    // Everything is placed at known addresses, so link in place.
+    uint64_t section_addr[kNumOfSections];
+    uint64_t end_addr = LayoutFlatImage(section_addr);
+    for (int i = 0; i < relocations_used; i++) {
+      ApplyRelocation(sections, section_addr, global_symbols, &relocations[i]);
+    }
+    if (is_hex_mode) {
+      WriteHexFile(dst_fp, section_addr);
+    } else {
+      WriteBinaryFile(dst_fp, section_addr, end_addr);
+    }
+  } else {
+    if (output_format == kOutFormatMachO) {
+      for (int s = 0; s < kNumOfSections; s++) {
+        if (s != kSectionText && sections[s].size) {
+          Error("Only .text is supported for Mach-O (not implemented yet)");
+        }
+      }
+      WriteObjFileForMachO(dst_fp, sections[kSectionText].buf,
+                           sections[kSectionText].size);
+    } else if (output_format == kOutFormatELF) {
+      DebugInfo debug_info = {NULL, line_rows, 0, fdes, fdes_used, cfi_ops};
+      if (is_debug_line_mode) {
+        BuildLineRows();
+        debug_info.src_path = src_path;
+        debug_info.line_rows = line_rows;
+        debug_info.num_of_line_rows = line_rows_used;
+      }
+      WriteObjFileForELF64(dst_fp, sections, func_symbols, func_symbols_used,
+                           global_symbols, global_symbols_used, relocations,
+                           relocations_used, &debug_info);
+    } else if (output_format == kOutFormatELFExec) {
+      int entry_section;
+      uint64_t entry_offset;
+      FindEntry(entry_name, &entry_section, &entry_offset);
+      WriteExecFileForELF64(dst_fp, sections, func_symbols, func_symbols_used,
+                            global_symbols, global_symbols_used, relocations,
+                            relocations_used, entry_section, entry_offset,
+                            segment_align);
+      fchmod(fileno(dst_fp), 0755);
+    }
+  }
+  // After the output so that the relocations applied to it are listed.
+  if (listing_path) {
+    WriteListingFile(listing_path);
+  }
+  CloseOutput(1);
   return 0;
   // <label>
   // <operator> (<reg> | <imm> | <label>)* <option>*
@@ -818,3 +2596,31 @@ int main(int argc, char *argv[]) {
   return 0;
 #endif
 }
+
+int Assemble() {
+  int status = AssembleAndWrite();
+  // the recovery points were in the frame of AssembleAndWrite
+  error_recovery = assembly_recovery = NULL;
+  return status;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc >= 3 && strcmp(argv[1], "--connect") == 0) {
+    return RunClient(argv[2], argc - 3, &argv[3]);
+  }
+  ResetOptions();
+  if (ParseArgs(argc, argv, stderr)) {
+    return 1;
+  }
+  if (daemon_socket_path) {
+    return RunDaemon(daemon_socket_path);
+  }
+  if (is_watch_mode) {
+    return WatchAndAssemble();
+  }
+  int status = Assemble();
+  if (num_of_errors) {
+    PrintDiagnostics(stderr);
+  }
+  return status;
+}
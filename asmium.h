@@ -8,12 +8,15 @@ typedef enum {
   kMemOfsEnd,
 } TokenStrType;
 
+// A token is an element of the array of kinds of its file
+// (SourceFile.tokens). Its offset, length and value are in the parallel
+// arrays of the file at the same index, which TokenChars, TokenLen and
+// TokenInteger read. The values of integers are decoded once by Tokenize
+// and lines are looked up from the offset only when they are needed
+// (TokenLine).
 typedef struct TOKEN_STR TokenStr;
 struct TOKEN_STR {
-  int len;
-  int line;
-  TokenStrType type;
-  const char *str;
+  uint8_t type; // TokenStrType
 };
 
 typedef enum {
@@ -44,33 +47,327 @@ typedef enum {
 
 typedef struct {
   OperandType type;
-  const TokenStr *token;  // kLabelName
+  const TokenStr *token;  // kLabelName, kMem ([ :label ], NULL for [ reg ])
   RegisterInfo reg_info;  // kReg
   int64_t imm;  // kImm
   RegisterInfo reg_index;  // kMem
 } Operand;
 
+typedef enum {
+  kOpFlagBranch = 1,        // jmp, jcc, ret
+  kOpFlagCondBranch = 2,    // jcc (can be macro-fused with the previous op)
+  kOpFlagMacroFusible = 4,  // cmp, inc, ... (can be fused with next jcc)
+} OpFlags;
+
 typedef struct {
   const char *name;
   int (*parse)(const Operand *left, const Operand *right);
+  int flags;
 } OpEntry;
 
 typedef struct {
   const char *mnemonic;
   int (*parse)(const TokenStr *tokens, int num_of_tokens, int index);
+  int flags;
 } MnemonicEntry;
 
 typedef struct {
   const char *name;
 } FormatWriter;
 
+typedef enum {
+  kSectionText,
+  kSectionData,
+  kSectionRodata,
+  kSectionBss,
+  kNumOfSections,
+} SectionIndex;
+
+typedef struct {
+  const char *name;
+  uint8_t *buf;  // NULL for .bss, which has a size but no contents
+  size_t size;
+  uint32_t align;
+  size_t capacity; // of buf (PutSectionByte)
+} OutputSection;
+
+#define MAX_SYMBOL_NAME_LEN 64
+
+// A global symbol (a label named by .global, or a name declared by .extern
+// with section == -1), or a local function symbol.
+typedef struct {
+  char name[MAX_SYMBOL_NAME_LEN + 1];
+  int section;  // SectionIndex, or -1 if undefined
+  uint64_t value;
+  int is_func;  // STT_FUNC (a label in .text) of size bytes
+  uint64_t size;
+} Symbol;
+
+typedef enum {
+  kRelocAbs64 = 1,  // R_X86_64_64
+  kRelocPC32 = 2,   // R_X86_64_PC32
+  kRelocPLT32 = 4,  // R_X86_64_PLT32
+  kRelocAbs32 = 10, // R_X86_64_32
+  kRelocAbs16 = 12, // R_X86_64_16
+  kRelocPC16 = 13,  // R_X86_64_PC16
+} RelocationType;
 
+// A reference that could not be resolved in this object. The target is
+// global_symbols[symbol] or, if symbol is -1, the start of target_section.
+typedef struct {
+  int section;  // SectionIndex of the field to patch
+  uint64_t offset;
+  RelocationType type;
+  int symbol;
+  int target_section;
+  int64_t addend;
+} Relocation;
+
+// A row of the line number table (-g): the code in .text from offset up to
+// the next row comes from line of the source.
+typedef struct {
+  uint32_t offset;
+  uint32_t line;
+} LineRow;
+
+// Call frame information (.cfi_* directives or --auto-cfi) for .eh_frame.
+typedef enum {
+  kCfiDefCfa,         // CFA = reg + value
+  kCfiDefCfaRegister, // CFA = reg + (current offset)
+  kCfiDefCfaOffset,   // CFA = (current reg) + value
+  kCfiOffset,         // reg is saved at CFA + value
+  kCfiRestore,        // reg has the value at the entry of the function
+} CfiOpType;
+
+typedef struct {
+  uint32_t offset; // in .text, from where the rule applies
+  CfiOpType type;
+  int reg; // DWARF register number
+  int64_t value;
+} CfiOp;
+
+// A frame description entry: [start, end) of .text described by
+// cfi_ops[first_op] ... cfi_ops[first_op + num_of_ops - 1].
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+  int first_op;
+  int num_of_ops;
+} Fde;
+
+
+// Sections which are only in the ELF object follow the sections: .eh_frame
+// if there are FDEs (or -g), and .debug_* with -g.
+typedef enum {
+  kEhFrame = kNumOfSections,
+  kDebugAbbrev,
+  kDebugInfo,
+  kDebugLine,
+  kNumOfObjSections,
+} ObjSectionIndex;
+
+// Optional contents of the ELF object for debuggers and profilers.
+typedef struct {
+  const char *src_path; // -g: .debug_* for line_rows (NULL without -g)
+  const LineRow *line_rows;
+  int num_of_line_rows;
+  const Fde *fdes; // .eh_frame
+  int num_of_fdes;
+  const CfiOp *cfi_ops;
+} DebugInfo;
+
+// @arena.c
+// A bump-pointer arena. Allocations are zero-filled, and live until
+// ArenaReset frees all of them at once (the memory is kept for reuse).
+typedef struct ARENA_CHUNK ArenaChunk;
+typedef struct {
+  ArenaChunk *first;
+  ArenaChunk *current;
+  size_t used; // in current
+  void *last;  // the last allocation, which ArenaGrow extends in place
+} Arena;
+// Everything of the assembly in progress is allocated from this.
+extern Arena assembly_arena;
+void *ArenaAlloc(Arena *arena, size_t size);
+void *ArenaGrow(Arena *arena, void *p, size_t old_size, size_t new_size);
+// retv: array with room for needed elements (capacity is updated).
+void *ArenaReserve(Arena *arena, void *array, size_t *capacity,
+                   size_t needed, size_t elem_size);
+void ArenaReset(Arena *arena);
+// Frees the memory of the arena (ArenaReset keeps it).
+void ArenaFree(Arena *arena);
+// Appends a byte to the contents of a section, growing them in the arena.
+void PutSectionByte(OutputSection *section, uint8_t byte);
+// Makes room for array[used] in an array growing in assembly_arena.
+#define RESERVE_ONE(array, used, capacity)                                     \
+  ((array) = ArenaReserve(&assembly_arena, (array), &(capacity), (used) + 1,   \
+                          sizeof(*(array))))
+
+// @asmium.c
+// Errors are recorded with their line (0 if none) and printed together at
+// the end of the assembly. ReportError goes on, while Error and ErrorAt
+// unwind to the current recovery point (the statement being parsed, which
+// is skipped, or the whole assembly, which fails).
+void ReportError(int line, const char *fmt, ...);
+// path: of an included file, or NULL for the main source.
+void ReportErrorIn(const char *path, int line, const char *fmt, ...);
+void ErrorAt(int line, const char *fmt, ...);
 void Error(const char *s);
-void DebugPrintTokens(const TokenStr *toke_str_list, int used);
-void Tokenize(TokenStr *toke_str_list, int size, int *used, const char *s);
+// at the line (and the included file) of the token
+void ErrorWithLine(const TokenStr *ts, const char *fmt, ...);
+extern int num_of_errors;
+// Prints the diagnostics of the assembly. retv: exit status of a failure.
+int PrintDiagnostics(FILE *fp);
+// Options of an assembly, set by ParseArgs after ResetOptions.
+extern const char *src_path;
+extern int is_atomic_output;
+void ResetOptions();
+int ParseArgs(int argc, char *argv[], FILE *err_fp);
+int NeedsOwnProcess();
+// retv: whether source_files[index] was included by the last assembly (0
+// is the main source).
+int IsSourceFileUsed(int index);
+// Assembles src_path with the options into a new arena generation.
+// retv: exit status (of the entry with --run). On failure, the diagnostics
+// are kept until the next assembly.
+int Assemble();
+// retv: the whole contents of fp (NUL-terminated) in arena.
+char *ReadSource(FILE *fp, Arena *arena);
+const char *TmpTokenCStr(const TokenStr *ts);
+// @tokenizer.c
+#define MAX_SOURCE_FILES 256
+// A source and its tokens, with the tables of TokenLine and TokenInteger.
+// The tokens are parallel arrays of num_of_tokens elements.
+typedef struct {
+  const char *path; // of an included file (NULL for the main source)
+  const char *text;
+  TokenStr *tokens;        // kinds
+  uint32_t *token_offsets; // in text
+  uint16_t *token_lens;
+  uint32_t *token_values; // kInteger: index in integers
+  int num_of_tokens;
+  size_t tokens_capacity;
+  uint32_t *newline_offsets;
+  int num_of_newlines;
+  size_t newline_offsets_capacity;
+  int64_t *integers;
+  int num_of_integers;
+  size_t integers_capacity;
+} SourceFile;
+extern SourceFile *source_files[MAX_SOURCE_FILES];
+void DebugPrintTokens(const SourceFile *file);
+// Tokenizes file->text into the tables of file (allocated from arena).
+void Tokenize(SourceFile *file, Arena *arena);
+// retv: index in source_files of the file of the token
+int TokenFileIndex(const TokenStr *ts);
+const char *TokenChars(const TokenStr *ts);
+int TokenLen(const TokenStr *ts);
+int TokenLine(const TokenStr *ts);
+// TokenLine with a cursor: *newline is the index of the first newline after
+// the token in its file, kept from the previous call on the same file.
+int TokenLineFrom(const TokenStr *ts, int *newline);
+// retv: whether the token is before the newline at index newline in its file
+int IsTokenBeforeNewline(const TokenStr *ts, int newline);
+int64_t TokenInteger(const TokenStr *ts);
+// retv: path of the included file of the token, or NULL (main source)
+const char *TokenPath(const TokenStr *ts);
+// Starts an assembly of main_source (source_files[0]).
+void ResetSourceFiles(SourceFile *main_source);
+// Records the identity of the main source, which is opened as fp.
+void SetMainSourceFile(FILE *fp);
+// Tokenizes the file at path, or reuses its tokens if it is unchanged since
+// it was included last in this process. retv: index in source_files (0 for
+// the main source), or -1 if it can not be read.
+int LoadIncludeFile(const char *path);
 
 // @gen_elf64.c
-void WriteObjFileForELF64(FILE *fp, uint8_t *bin_buf, uint32_t bin_size);
+uint64_t AlignUp(uint64_t v, uint64_t align);
+// Patches a relocation with the final addresses of the sections.
+void ApplyRelocation(OutputSection *sections, const uint64_t *section_addr,
+                     const Symbol *global_symbols,
+                     const Relocation *reloc);
+void WriteObjFileForELF64(FILE *fp, const OutputSection *sections,
+                          const Symbol *func_symbols,
+                          int num_of_func_symbols,
+                          const Symbol *global_symbols,
+                          int num_of_global_symbols,
+                          const Relocation *relocations,
+                          int num_of_relocations,
+                          const DebugInfo *debug_info);
+// func_symbols are the local STT_FUNC symbols (labels in .text which are
+// not .global).
+// Writes a static ET_EXEC. Relocations are applied to sections (so .extern
+// names are not allowed) and every PT_LOAD is aligned to segment_align.
+void WriteExecFileForELF64(FILE *fp, OutputSection *sections,
+                           const Symbol *func_symbols,
+                           int num_of_func_symbols,
+                           const Symbol *global_symbols,
+                           int num_of_global_symbols,
+                           const Relocation *relocations,
+                           int num_of_relocations, int entry_section,
+                           uint64_t entry_offset, uint64_t segment_align);
+
+// @gen_dwarf.c
+// Builds .debug_abbrev, .debug_info and .debug_line (DWARF v5) for the
+// line rows of .text into debug_sections[kDebugXXX - kDebugAbbrev], and
+// puts the relocations they need. retv: number of relocations put.
+int BuildDebugSections(OutputSection *debug_sections, Relocation *relocations,
+                       const char *src_path, uint64_t text_size,
+                       const LineRow *line_rows, int num_of_line_rows);
+// Builds .eh_frame (one CIE and the FDEs). retv: number of relocations put
+// (one per FDE).
+int BuildEhFrame(OutputSection *eh_frame, Relocation *relocations,
+                 const Fde *fdes, int num_of_fdes, const CfiOp *cfi_ops);
+
+// @jit.c
+// The sections placed in memory of this process.
+typedef struct {
+  uint8_t *base;
+  size_t size;
+  uint64_t section_addr[kNumOfSections];
+} JitImage;
+void LoadJitImage(JitImage *image, OutputSection *sections,
+                  const Symbol *global_symbols, const Relocation *relocations,
+                  int num_of_relocations);
+void UnloadJitImage(JitImage *image);
+// Appends "<addr> <size> <name>" of each function to /tmp/perf-<pid>.map.
+void WritePerfMap(const JitImage *image, const Symbol *symbols,
+                  int num_of_symbols);
+// Writes jit-<pid>.dump with the lines and the code of each function.
+void WriteJitDump(const JitImage *image, const OutputSection *sections,
+                  const Symbol *symbols, int num_of_symbols,
+                  const char *src_path, const LineRow *line_rows,
+                  int num_of_line_rows);
+// Calls entry iterations times (after some warmup calls) and prints the
+// min / median cycles and the hardware counters per call.
+void BenchJitEntry(int (*entry)(void), const char *entry_name,
+                   int iterations);
+
+// @analyze.c
+// An instruction (statement with code) in .text.
+typedef struct {
+  uint32_t begin;
+  uint32_t end;
+  uint32_t line;
+  uint8_t file;       // of the statement (TokenFileIndex)
+  uint32_t file_line; // of the statement in its file
+  const TokenStr *label; // at begin, or NULL
+} TextInstr;
+typedef struct CPU_MODEL CpuModel;
+// retv: NULL if there is no table for the microarchitecture name.
+const CpuModel *FindCpuModel(const char *name);
+// Prints the estimated cycles per iteration and the bottleneck of each
+// loop (a backward jump to an instruction) in .text.
+void WriteLoopAnalysis(FILE *fp, const CpuModel *cpu, const uint8_t *text,
+                       const TextInstr *instrs, int num_of_instrs);
+
+// @watch.c
+// --watch: assembles again whenever the source is written.
+int WatchAndAssemble();
+// --daemon: assembles the requests of --connect clients on a Unix socket.
+int RunDaemon(const char *socket_path);
+// --connect: sends the arguments to the daemon. retv: its exit status.
+int RunClient(const char *socket_path, int argc, char *argv[]);
 
 // @gen_macho.c
 void WriteObjFileForMachO(FILE *fp, uint8_t *bin_buf, uint32_t bin_size);
@@ -0,0 +1,377 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "asmium.h"
+
+//
+// DWARF v5 line number information (-g)
+//
+// Only one compile unit without children is emitted, which is enough for
+// gdb, perf annotate and addr2line to map addresses in .text to the lines
+// of the source.
+//
+// Call frame information (.eh_frame)
+//
+// The unwind tables of the x86-64 psABI, which perf --call-graph dwarf and
+// debuggers use to walk the stack through functions without frame
+// pointers or in the middle of their prologues.
+//
+
+// Line number program parameters (DWARF v5 6.2.5.1). The rows advance by a
+// few bytes and lines at a time, so most of them fit in one special opcode.
+#define LINE_BASE -5
+#define LINE_RANGE 14
+#define OPCODE_BASE 13
+
+#define DW_TAG_compile_unit 0x11
+#define DW_CHILDREN_no 0x00
+#define DW_AT_name 0x03
+#define DW_AT_stmt_list 0x10
+#define DW_AT_low_pc 0x11
+#define DW_AT_high_pc 0x12
+#define DW_AT_language 0x13
+#define DW_AT_comp_dir 0x1b
+#define DW_AT_producer 0x25
+#define DW_FORM_addr 0x01
+#define DW_FORM_data2 0x05
+#define DW_FORM_data8 0x07
+#define DW_FORM_string 0x08
+#define DW_FORM_udata 0x0f
+#define DW_FORM_sec_offset 0x17
+#define DW_LANG_Mips_Assembler 0x8001
+#define DW_UT_compile 0x01
+#define DW_LNCT_path 0x1
+#define DW_LNCT_directory_index 0x2
+#define DW_LNS_copy 0x01
+#define DW_LNS_advance_pc 0x02
+#define DW_LNS_advance_line 0x03
+#define DW_LNE_end_sequence 0x01
+#define DW_LNE_set_address 0x02
+#define DW_EH_PE_sdata4 0x0b
+#define DW_EH_PE_pcrel 0x10
+#define DW_CFA_nop 0x00
+#define DW_CFA_advance_loc1 0x02
+#define DW_CFA_advance_loc2 0x03
+#define DW_CFA_advance_loc4 0x04
+#define DW_CFA_offset_extended_sf 0x11
+#define DW_CFA_def_cfa 0x0c
+#define DW_CFA_def_cfa_register 0x0d
+#define DW_CFA_def_cfa_offset 0x0e
+#define DW_CFA_advance_loc 0x40
+#define DW_CFA_offset 0x80
+#define DW_CFA_restore 0xc0
+
+// DWARF register numbers of x86-64
+#define DWARF_REG_RSP 7
+#define DWARF_REG_RA 16
+#define CFI_DATA_ALIGN -8
+
+void PutDebugByte(OutputSection *section, uint8_t byte) {
+  PutSectionByte(section, byte);
+}
+
+void PutDebugValue(OutputSection *section, uint64_t v, int size) {
+  for (int i = 0; i < size; i++) {
+    PutDebugByte(section, (v >> (8 * i)) & 0xff);
+  }
+}
+
+void PutDebugULEB128(OutputSection *section, uint64_t v) {
+  do {
+    uint8_t byte = v & 0x7f;
+    v >>= 7;
+    PutDebugByte(section, v ? byte | 0x80 : byte);
+  } while (v);
+}
+
+void PutDebugSLEB128(OutputSection *section, int64_t v) {
+  for (;;) {
+    uint8_t byte = v & 0x7f;
+    v >>= 7;
+    if ((v == 0 && !(byte & 0x40)) || (v == -1 && (byte & 0x40))) {
+      PutDebugByte(section, byte);
+      return;
+    }
+    PutDebugByte(section, byte | 0x80);
+  }
+}
+
+void PutDebugString(OutputSection *section, const char *s) {
+  do {
+    PutDebugByte(section, *s);
+  } while (*s++);
+}
+
+// Puts a 32bit length to be filled by EndDebugUnit. retv: its offset.
+size_t BeginDebugUnit(OutputSection *section) {
+  size_t ofs = section->size;
+  PutDebugValue(section, 0, 4);
+  return ofs;
+}
+
+void EndDebugUnit(OutputSection *section, size_t length_ofs) {
+  uint32_t length = section->size - (length_ofs + 4);
+  for (int i = 0; i < 4; i++) {
+    section->buf[length_ofs + i] = (length >> (8 * i)) & 0xff;
+  }
+}
+
+// Puts a field patched by the linker: the start of target (a SectionIndex
+// or ObjSectionIndex), which is 0 in this object.
+void PutDebugReloc(OutputSection *section, int section_index,
+                   RelocationType type, int target, Relocation *reloc) {
+  reloc->section = section_index;
+  reloc->offset = section->size;
+  reloc->type = type;
+  reloc->symbol = -1;
+  reloc->target_section = target;
+  reloc->addend = 0;
+  PutDebugValue(section, 0, type == kRelocAbs64 ? 8 : 4);
+}
+
+void PutDebugAbbrev(OutputSection *abbrev) {
+  PutDebugULEB128(abbrev, 1); // abbrev code
+  PutDebugULEB128(abbrev, DW_TAG_compile_unit);
+  PutDebugByte(abbrev, DW_CHILDREN_no);
+  static const uint8_t attrs[][2] = {
+      {DW_AT_name, DW_FORM_string},
+      {DW_AT_comp_dir, DW_FORM_string},
+      {DW_AT_producer, DW_FORM_string},
+      {DW_AT_language, DW_FORM_data2},
+      {DW_AT_stmt_list, DW_FORM_sec_offset},
+      {DW_AT_low_pc, DW_FORM_addr},
+      {DW_AT_high_pc, DW_FORM_data8},
+      {0, 0},
+  };
+  for (int i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+    PutDebugULEB128(abbrev, attrs[i][0]);
+    PutDebugULEB128(abbrev, attrs[i][1]);
+  }
+  PutDebugByte(abbrev, 0); // end of abbrevs
+}
+
+void PutLineProgram(OutputSection *line, const char *src_path,
+                    const char *comp_dir, uint64_t text_size,
+                    const LineRow *line_rows, int num_of_line_rows,
+                    Relocation *set_address_reloc) {
+  static const uint8_t standard_opcode_lengths[OPCODE_BASE - 1] = {
+      0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1};
+  size_t unit_ofs = BeginDebugUnit(line);
+  PutDebugValue(line, 5, 2); // version
+  PutDebugByte(line, 8);     // address_size
+  PutDebugByte(line, 0);     // segment_selector_size
+  size_t header_length_ofs = BeginDebugUnit(line);
+  PutDebugByte(line, 1); // minimum_instruction_length
+  PutDebugByte(line, 1); // maximum_operations_per_instruction
+  PutDebugByte(line, 1); // default_is_stmt
+  PutDebugByte(line, (uint8_t)LINE_BASE);
+  PutDebugByte(line, LINE_RANGE);
+  PutDebugByte(line, OPCODE_BASE);
+  for (int i = 0; i < OPCODE_BASE - 1; i++) {
+    PutDebugByte(line, standard_opcode_lengths[i]);
+  }
+  // directories: 0 is the compilation directory
+  PutDebugByte(line, 1);
+  PutDebugULEB128(line, DW_LNCT_path);
+  PutDebugULEB128(line, DW_FORM_string);
+  PutDebugULEB128(line, 1);
+  PutDebugString(line, comp_dir);
+  // files: 0 is the primary source, and 1 (the initial file register) is
+  // the same file for consumers of DWARF v4 and earlier.
+  PutDebugByte(line, 2);
+  PutDebugULEB128(line, DW_LNCT_path);
+  PutDebugULEB128(line, DW_FORM_string);
+  PutDebugULEB128(line, DW_LNCT_directory_index);
+  PutDebugULEB128(line, DW_FORM_udata);
+  PutDebugULEB128(line, 2);
+  for (int i = 0; i < 2; i++) {
+    PutDebugString(line, src_path);
+    PutDebugULEB128(line, 0);
+  }
+  EndDebugUnit(line, header_length_ofs);
+
+  // Rows are delta-encoded from the previous one.
+  PutDebugByte(line, 0);
+  PutDebugULEB128(line, 9);
+  PutDebugByte(line, DW_LNE_set_address);
+  PutDebugReloc(line, kDebugLine, kRelocAbs64, kSectionText,
+                set_address_reloc);
+  uint64_t address = 0;
+  int64_t line_number = 1;
+  for (int i = 0; i < num_of_line_rows; i++) {
+    uint64_t address_delta = line_rows[i].offset - address;
+    int64_t line_delta = (int64_t)line_rows[i].line - line_number;
+    uint64_t special_opcode =
+        (line_delta - LINE_BASE) + LINE_RANGE * address_delta + OPCODE_BASE;
+    if (LINE_BASE <= line_delta && line_delta < LINE_BASE + LINE_RANGE &&
+        special_opcode <= 0xff) {
+      PutDebugByte(line, special_opcode);
+    } else {
+      if (line_delta) {
+        PutDebugByte(line, DW_LNS_advance_line);
+        PutDebugSLEB128(line, line_delta);
+      }
+      if (address_delta) {
+        PutDebugByte(line, DW_LNS_advance_pc);
+        PutDebugULEB128(line, address_delta);
+      }
+      PutDebugByte(line, DW_LNS_copy);
+    }
+    address = line_rows[i].offset;
+    line_number = line_rows[i].line;
+  }
+  PutDebugByte(line, DW_LNS_advance_pc);
+  PutDebugULEB128(line, text_size - address);
+  PutDebugByte(line, 0);
+  PutDebugULEB128(line, 1);
+  PutDebugByte(line, DW_LNE_end_sequence);
+  EndDebugUnit(line, unit_ofs);
+}
+
+int BuildDebugSections(OutputSection *debug_sections, Relocation *relocations,
+                       const char *src_path, uint64_t text_size,
+                       const LineRow *line_rows, int num_of_line_rows) {
+  static const char *names[kNumOfObjSections - kDebugAbbrev] = {
+      ".debug_abbrev", ".debug_info", ".debug_line"};
+  for (int i = 0; i < kNumOfObjSections - kDebugAbbrev; i++) {
+    debug_sections[i].name = names[i];
+    debug_sections[i].buf = NULL; // allocated by the first PutDebugByte
+    debug_sections[i].size = 0;
+    debug_sections[i].capacity = 0;
+    debug_sections[i].align = 1;
+  }
+  OutputSection *abbrev = &debug_sections[kDebugAbbrev - kDebugAbbrev];
+  OutputSection *info = &debug_sections[kDebugInfo - kDebugAbbrev];
+  OutputSection *line = &debug_sections[kDebugLine - kDebugAbbrev];
+  char comp_dir[256];
+  if (!getcwd(comp_dir, sizeof(comp_dir))) {
+    strcpy(comp_dir, ".");
+  }
+
+  PutDebugAbbrev(abbrev);
+
+  size_t unit_ofs = BeginDebugUnit(info);
+  PutDebugValue(info, 5, 2); // version
+  PutDebugByte(info, DW_UT_compile);
+  PutDebugByte(info, 8); // address_size
+  PutDebugReloc(info, kDebugInfo, kRelocAbs32, kDebugAbbrev, &relocations[0]);
+  PutDebugULEB128(info, 1); // abbrev code
+  PutDebugString(info, src_path);
+  PutDebugString(info, comp_dir);
+  PutDebugString(info, "asmium");
+  PutDebugValue(info, DW_LANG_Mips_Assembler, 2);
+  PutDebugReloc(info, kDebugInfo, kRelocAbs32, kDebugLine, &relocations[1]);
+  PutDebugReloc(info, kDebugInfo, kRelocAbs64, kSectionText, &relocations[2]);
+  PutDebugValue(info, text_size, 8); // high_pc (length)
+  EndDebugUnit(info, unit_ofs);
+
+  PutLineProgram(line, src_path, comp_dir, text_size, line_rows,
+                 num_of_line_rows, &relocations[3]);
+  return 4;
+}
+
+// Pads a CIE / FDE starting at unit_ofs to a multiple of the address size.
+void PadCfiUnit(OutputSection *eh_frame, size_t unit_ofs) {
+  while ((eh_frame->size - unit_ofs) % 8) {
+    PutDebugByte(eh_frame, DW_CFA_nop);
+  }
+}
+
+void PutCfiAdvance(OutputSection *eh_frame, uint32_t delta) {
+  if (delta < 0x40) {
+    PutDebugByte(eh_frame, DW_CFA_advance_loc | delta);
+  } else if (delta <= 0xff) {
+    PutDebugByte(eh_frame, DW_CFA_advance_loc1);
+    PutDebugValue(eh_frame, delta, 1);
+  } else if (delta <= 0xffff) {
+    PutDebugByte(eh_frame, DW_CFA_advance_loc2);
+    PutDebugValue(eh_frame, delta, 2);
+  } else {
+    PutDebugByte(eh_frame, DW_CFA_advance_loc4);
+    PutDebugValue(eh_frame, delta, 4);
+  }
+}
+
+void PutCfiOp(OutputSection *eh_frame, const CfiOp *op) {
+  switch (op->type) {
+  case kCfiDefCfa:
+    PutDebugByte(eh_frame, DW_CFA_def_cfa);
+    PutDebugULEB128(eh_frame, op->reg);
+    PutDebugULEB128(eh_frame, op->value);
+    break;
+  case kCfiDefCfaRegister:
+    PutDebugByte(eh_frame, DW_CFA_def_cfa_register);
+    PutDebugULEB128(eh_frame, op->reg);
+    break;
+  case kCfiDefCfaOffset:
+    PutDebugByte(eh_frame, DW_CFA_def_cfa_offset);
+    PutDebugULEB128(eh_frame, op->value);
+    break;
+  case kCfiOffset:
+    // offsets are factored by the data alignment
+    if (op->value <= 0) {
+      PutDebugByte(eh_frame, DW_CFA_offset | op->reg);
+      PutDebugULEB128(eh_frame, op->value / CFI_DATA_ALIGN);
+    } else {
+      PutDebugByte(eh_frame, DW_CFA_offset_extended_sf);
+      PutDebugULEB128(eh_frame, op->reg);
+      PutDebugSLEB128(eh_frame, op->value / CFI_DATA_ALIGN);
+    }
+    break;
+  case kCfiRestore:
+    PutDebugByte(eh_frame, DW_CFA_restore | op->reg);
+    break;
+  }
+}
+
+int BuildEhFrame(OutputSection *eh_frame, Relocation *relocations,
+                 const Fde *fdes, int num_of_fdes, const CfiOp *cfi_ops) {
+  eh_frame->name = ".eh_frame";
+  eh_frame->buf = NULL;
+  eh_frame->size = 0;
+  eh_frame->capacity = 0;
+  eh_frame->align = 8;
+
+  // CIE: CFA = rsp + 8 and the return address at CFA - 8 on entry
+  size_t cie_ofs = BeginDebugUnit(eh_frame);
+  PutDebugValue(eh_frame, 0, 4); // CIE id
+  PutDebugByte(eh_frame, 1);     // version
+  PutDebugString(eh_frame, "zR");
+  PutDebugULEB128(eh_frame, 1); // code_alignment_factor
+  PutDebugSLEB128(eh_frame, CFI_DATA_ALIGN);
+  PutDebugULEB128(eh_frame, DWARF_REG_RA);
+  PutDebugULEB128(eh_frame, 1); // augmentation data length
+  PutDebugByte(eh_frame, DW_EH_PE_pcrel | DW_EH_PE_sdata4);
+  PutDebugByte(eh_frame, DW_CFA_def_cfa);
+  PutDebugULEB128(eh_frame, DWARF_REG_RSP);
+  PutDebugULEB128(eh_frame, 8);
+  PutDebugByte(eh_frame, DW_CFA_offset | DWARF_REG_RA);
+  PutDebugULEB128(eh_frame, 1);
+  PadCfiUnit(eh_frame, cie_ofs);
+  EndDebugUnit(eh_frame, cie_ofs);
+
+  for (int i = 0; i < num_of_fdes; i++) {
+    const Fde *fde = &fdes[i];
+    size_t fde_ofs = BeginDebugUnit(eh_frame);
+    PutDebugValue(eh_frame, eh_frame->size - cie_ofs, 4); // CIE pointer
+    PutDebugReloc(eh_frame, kEhFrame, kRelocPC32, kSectionText,
+                  &relocations[i]); // pc_begin
+    relocations[i].addend = fde->start;
+    PutDebugValue(eh_frame, fde->end - fde->start, 4); // pc_range
+    PutDebugULEB128(eh_frame, 0); // augmentation data length
+    uint32_t loc = fde->start;
+    for (int k = 0; k < fde->num_of_ops; k++) {
+      const CfiOp *op = &cfi_ops[fde->first_op + k];
+      if (op->offset > loc) {
+        PutCfiAdvance(eh_frame, op->offset - loc);
+        loc = op->offset;
+      }
+      PutCfiOp(eh_frame, op);
+    }
+    PadCfiUnit(eh_frame, fde_ofs);
+    EndDebugUnit(eh_frame, fde_ofs);
+  }
+  return num_of_fdes;
+}
@@ -24,29 +24,40 @@ void Put64(uint64_t v, FILE *fp) {
 
 typedef enum {
   kLocalNoType = 0x00,
+  kLocalFunc = 0x02,
   kLocalSection = 0x03,
   kGlobalNoType = 0x10,
+  kGlobalFunc = 0x12,
 } SymbolType;
 
 typedef struct {
   uint32_t name_idx; // Ofs in .strtab
   uint16_t type;
   uint16_t index; // Index of Shdr
-  uint64_t size;  // ofs?
-  uint64_t value; // ofs?
+  uint64_t value; // Ofs in the section
+  uint64_t size;
 } SymbolTableEntry;
 
+typedef struct {
+  uint64_t offset; // Ofs in the section to patch
+  uint64_t info;   // (index of symbol << 32) | type
+  int64_t addend;
+} RelocationEntry;
+
 typedef enum {
   kProgBits = 1,
   kSymTable = 2,
   kStrTable = 3,
+  kRela = 4,
   kNoBits = 8,
+  kX86_64Unwind = 0x70000001,
 } SectionType;
 
 typedef enum {
   kWritable = 1,
   kAllocated = 2,
   kExecutable = 4,
+  kInfoLink = 0x40,
 } SectionFlags;
 
 typedef struct {
@@ -55,12 +66,39 @@ typedef struct {
   uint64_t flags;
   uint64_t addr;
   uint64_t offset;
-  uint64_t size_in_file;
-  uint64_t size_in_mem;
+  uint64_t size;
+  uint32_t link;
+  uint32_t info;
   uint64_t align;
   uint64_t entsize;
 } SectionHeaderEntry;
 
+typedef enum {
+  kRelocatable = 1,
+  kExecutableFile = 2,
+} ELFType;
+
+typedef enum {
+  kLoad = 1,
+} SegmentType;
+
+typedef enum {
+  kSegmentExecutable = 1,
+  kSegmentWritable = 2,
+  kSegmentReadable = 4,
+} SegmentFlags;
+
+typedef struct {
+  uint32_t type;
+  uint32_t flags;
+  uint64_t offset;
+  uint64_t vaddr;
+  uint64_t paddr;
+  uint64_t size_in_file;
+  uint64_t size_in_mem;
+  uint64_t align;
+} ProgramHeaderEntry;
+
 void PutSectionHeaderEntry(const SectionHeaderEntry *shdr, FILE *fp) {
   const uint8_t *data = (const uint8_t *)shdr;
   for (int i = 0; i < sizeof(SectionHeaderEntry); i++) {
@@ -68,56 +106,80 @@ void PutSectionHeaderEntry(const SectionHeaderEntry *shdr, FILE *fp) {
   }
 }
 
-void PutSymbolTableEntry(const SymbolTableEntry *symbol, FILE *fp) {
-  const uint8_t *data = (const uint8_t *)symbol;
-  for (int i = 0; i < sizeof(SymbolTableEntry); i++) {
-    fputc(data[i], fp);
+// The tables below grow in assembly_arena and are cleared by
+// ResetObjWriter at the start of each Write function.
+char *shstrtab_buf;
+int shstrtab_buf_used;
+size_t shstrtab_buf_capacity;
+
+#define MAX_SHDRS 24
+SectionHeaderEntry shdr_list[MAX_SHDRS];
+const void *shdr_data_list[MAX_SHDRS]; // contents of each section in the file
+int shdr_list_used;
+
+char *strtab_buf;
+int strtab_buf_used;
+size_t strtab_buf_capacity;
+
+SymbolTableEntry *symbol_list;
+int symbol_list_used;
+size_t symbol_list_capacity;
+
+RelocationEntry *rela_list[kNumOfObjSections];
+int rela_list_used[kNumOfObjSections];
+size_t rela_list_capacity[kNumOfObjSections];
+
+void ResetObjWriter() {
+  shstrtab_buf = strtab_buf = NULL;
+  shstrtab_buf_used = strtab_buf_used = 0;
+  shstrtab_buf_capacity = strtab_buf_capacity = 0;
+  shdr_list_used = 0;
+  symbol_list = NULL;
+  symbol_list_used = 0;
+  symbol_list_capacity = 0;
+  for (int i = 0; i < kNumOfObjSections; i++) {
+    rela_list[i] = NULL;
+    rela_list_used[i] = 0;
+    rela_list_capacity[i] = 0;
   }
 }
 
-#define STRBUF_SIZE 128
-char shstrtab_buf[STRBUF_SIZE];
-int shstrtab_buf_used = 0;
-
-SectionHeaderEntry shdr_list[10];
-int shdr_list_used = 0;
-
-char strtab_buf[STRBUF_SIZE];
-int strtab_buf_used = 0;
-
-SymbolTableEntry symbol_list[10];
-int symbol_list_used = 0;
-
-void AddStrToBuf(char *buf, int *buf_used, const char *s) {
+void AddStrToBuf(char **buf, int *buf_used, size_t *capacity,
+                 const char *s) {
   int len = strlen(s);
-  if (*buf_used + len + 1 >= STRBUF_SIZE) {
-    Error("exceeded STRBUF_SIZE");
-  }
-  strcpy(&buf[*buf_used], s);
+  *buf = ArenaReserve(&assembly_arena, *buf, capacity, *buf_used + len + 1,
+                      1);
+  strcpy(&(*buf)[*buf_used], s);
   *buf_used += (len + 1);
 }
 
 SectionHeaderEntry *AddSection(const char *name, uint32_t type, uint64_t flags,
-                               uint64_t addr, uint64_t size_in_file,
-                               uint64_t size_in_mem) {
+                               const void *data, uint64_t size) {
+  if (shdr_list_used >= MAX_SHDRS) {
+    Error("exceeded MAX_SHDRS");
+  }
   int name_idx = shstrtab_buf_used;
-  AddStrToBuf(shstrtab_buf, &shstrtab_buf_used, name);
+  AddStrToBuf(&shstrtab_buf, &shstrtab_buf_used, &shstrtab_buf_capacity,
+              name);
 
   shdr_list[shdr_list_used].name_idx = name_idx;
   shdr_list[shdr_list_used].type = type;
   shdr_list[shdr_list_used].flags = flags;
-  shdr_list[shdr_list_used].addr = addr;
-  shdr_list[shdr_list_used].size_in_file = size_in_file;
-  shdr_list[shdr_list_used].size_in_mem = size_in_mem;
+  shdr_list[shdr_list_used].addr = 0;
+  shdr_list[shdr_list_used].size = size;
+  shdr_list[shdr_list_used].link = 0;
+  shdr_list[shdr_list_used].info = 0;
   shdr_list[shdr_list_used].align = 1;
   shdr_list[shdr_list_used].entsize = 0;
+  shdr_data_list[shdr_list_used] = data;
   return &shdr_list[shdr_list_used++];
 }
 
 SymbolTableEntry *AddSymbol(const char *name, uint16_t type, uint16_t index,
                             uint64_t value) {
+  RESERVE_ONE(symbol_list, symbol_list_used, symbol_list_capacity);
   int name_idx = strtab_buf_used;
-  AddStrToBuf(strtab_buf, &strtab_buf_used, name);
+  AddStrToBuf(&strtab_buf, &strtab_buf_used, &strtab_buf_capacity, name);
 
   symbol_list[symbol_list_used].name_idx = name_idx;
   symbol_list[symbol_list_used].type = type;
@@ -126,61 +188,28 @@ SymbolTableEntry *AddSymbol(const char *name, uint16_t type, uint16_t index,
   return &symbol_list[symbol_list_used++];
 }
 
-void WriteObjFileForELF64(FILE *fp, uint8_t *bin_buf, uint32_t bin_size) {
-  int i;
-  size_t bin_size_aligned = (bin_size + 0xf) & ~0xf;
-  printf("bin_size_aligned = 0x%lX\n", bin_size_aligned);
-
-  AddSymbol("", kLocalNoType, 0, 0);
-  AddSymbol("", kLocalSection, 1, 0);
-  AddSymbol("", kLocalSection, 2, 0);
-  AddSymbol("", kLocalSection, 3, 0);
-  AddSymbol("main", kGlobalNoType, 1, 0);
-
-  AddSection("", 0, 0, 0, 0, 0);
-  AddSection(".text", kProgBits, kAllocated | kExecutable, 0, bin_size_aligned,
-             0);
-  AddSection(".data", kProgBits, kAllocated | kWritable, 0, 0, 0);
-  AddSection(".bss", kNoBits, kAllocated | kWritable, 0, 0, 0);
-
-  SectionHeaderEntry *shstrtab = AddSection(".shstrtab", kStrTable, 0, 0, 0, 0);
-  int idx_of_shstrtab = (shstrtab - shdr_list);
-
-  SectionHeaderEntry *strtab = AddSection(".strtab", kStrTable, 0, 0, 0, 0);
-  int idx_of_strtab = (strtab - shdr_list);
-
-  SectionHeaderEntry *symtab = AddSection(".symtab", kSymTable, 0, 0, 0, 0);
-  symtab->size_in_file = sizeof(SymbolTableEntry) * symbol_list_used;
-  symtab->entsize = 24;
-  symtab->align = 8;
-  symtab->size_in_mem = ((uint64_t)idx_of_shstrtab << 32) | idx_of_strtab;
-  printf("symtab entries = %d\n", symbol_list_used);
-
-  size_t strtab_size_aligned = (strtab_buf_used + 0xf) & ~0xf;
-  printf("strtab size = 0x%lX\n", strtab_size_aligned);
-  strtab->size_in_file = strtab_size_aligned;
+// Adds a label (or an .extern name) of the source at address value.
+void AddSourceSymbol(const Symbol *symbol, int is_global, uint64_t value) {
+  uint16_t type = is_global ? (symbol->is_func ? kGlobalFunc : kGlobalNoType)
+                            : (symbol->is_func ? kLocalFunc : kLocalNoType);
+  // .extern names are undefined (index 0)
+  SymbolTableEntry *entry =
+      AddSymbol(symbol->name, type, 1 + symbol->section, value);
+  entry->size = symbol->size;
+}
 
-  size_t shstrtab_size_aligned = (shstrtab_buf_used + 0xf) & ~0xf;
-  printf("shstrtab size = 0x%lX\n", shstrtab_size_aligned);
-  shstrtab->size_in_file = shstrtab_size_aligned;
+uint64_t AlignUp(uint64_t v, uint64_t align) {
+  return (v + align - 1) & ~(align - 1);
+}
 
-  // recalc ofsets of shdrs
-  uint64_t ofs = 0x40;
-  for (int i = 0; i < shdr_list_used; i++) {
-    shdr_list[i].offset = ofs;
-    ofs += shdr_list[i].size_in_file;
+void PutZerosTo(uint64_t *ofs, uint64_t target, FILE *fp) {
+  for (; *ofs < target; (*ofs)++) {
+    fputc(0x00, fp);
   }
+}
 
-  // +0x00: ELF Header(0x40)
-  // data of .symtab (sizeof(SymbolTableEntry) * symbol_list_used)
-  // data of .text (bin_size_aligned)
-  // data of .data ()
-  // data of .bss ()
-  // data of .shstrtab (shstrtab_size_aligned)
-  // data of .strtab (strtab_size_aligned)
-  // data of shdr list (sizeof(SectionHeaderEntry) * shdr_list_used)
-
-  // header
+void PutELFHeader(uint16_t type, uint64_t entry, uint16_t num_of_phdrs,
+                  uint64_t shdr_ofs, int idx_of_shstrtab, FILE *fp) {
   fputc(0x7f, fp);
   fputc('E', fp);
   fputc('L', fp);
@@ -190,43 +219,394 @@ void WriteObjFileForELF64(FILE *fp, uint8_t *bin_buf, uint32_t bin_size) {
   fputc(0x01, fp);
   fputc(0x00, fp);
   fputc(0x00, fp);
-  for (i = 0; i < 7; i++) {
+  for (int i = 0; i < 7; i++) {
     fputc(0x00, fp);
   }
 
-  Put16(0x0001, fp);
+  Put16(type, fp);
   Put16(0x003e, fp);
   Put32(0x0001, fp);
-  Put64(0x0000, fp);
+  Put64(entry, fp);
 
-  Put64(0x0000, fp);
-  Put64(ofs, fp); // beginning of shdr array (ofs in file)
+  Put64(num_of_phdrs ? 0x40 : 0, fp); // phdr array follows the header
+  Put64(shdr_ofs, fp); // beginning of shdr array (ofs in file)
 
   Put32(0x0000, fp);
   Put16(0x0040, fp);
-  Put16(0x0000, fp);
-  Put16(0x0000, fp);
+  Put16(num_of_phdrs ? sizeof(ProgramHeaderEntry) : 0, fp);
+  Put16(num_of_phdrs, fp);
   Put16(0x0040, fp);          // size of shdr entry (fixed)
   Put16(shdr_list_used, fp);  // number of shdrs
   Put16(idx_of_shstrtab, fp); // index of shstrtab in shdr array
+}
 
-  for (i = 0; i < bin_size_aligned; i++) {
-    fputc(bin_buf[i], fp);
+// Writes the contents of the sections at their offsets (in the order of
+// the offsets), then the shdrs. written is the number of bytes already
+// written (headers).
+void PutSectionsAndHeaders(uint64_t written, uint64_t shdr_ofs, FILE *fp) {
+  for (;;) {
+    int next = -1;
+    for (int i = 1; i < shdr_list_used; i++) {
+      if (shdr_list[i].type != kNoBits && shdr_list[i].size &&
+          shdr_list[i].offset >= written &&
+          (next == -1 || shdr_list[i].offset < shdr_list[next].offset)) {
+        next = i;
+      }
+    }
+    if (next == -1) {
+      break;
+    }
+    PutZerosTo(&written, shdr_list[next].offset, fp);
+    fwrite(shdr_data_list[next], 1, shdr_list[next].size, fp);
+    written += shdr_list[next].size;
   }
+  PutZerosTo(&written, shdr_ofs, fp);
 
-  for (i = 0; i < shstrtab_size_aligned; i++) {
-    fputc(shstrtab_buf[i], fp);
+  for (int i = 0; i < shdr_list_used; i++) {
+    PutSectionHeaderEntry(&shdr_list[i], fp);
   }
+}
+
+void AddRela(const Relocation *reloc, int num_of_local_symbols) {
+  RESERVE_ONE(rela_list[reloc->section], rela_list_used[reloc->section],
+              rela_list_capacity[reloc->section]);
+  // targets are global symbols or section symbols
+  uint64_t symbol_idx = reloc->symbol >= 0
+                            ? num_of_local_symbols + reloc->symbol
+                            : 1 + reloc->target_section;
+  RelocationEntry *rela =
+      &rela_list[reloc->section][rela_list_used[reloc->section]++];
+  rela->offset = reloc->offset;
+  rela->info = (symbol_idx << 32) | reloc->type;
+  rela->addend = reloc->addend;
+}
 
-  for (i = 0; i < strtab_size_aligned; i++) {
-    fputc(strtab_buf[i], fp);
+void WriteObjFileForELF64(FILE *fp, const OutputSection *sections,
+                          const Symbol *func_symbols,
+                          int num_of_func_symbols,
+                          const Symbol *global_symbols,
+                          int num_of_global_symbols,
+                          const Relocation *relocations,
+                          int num_of_relocations,
+                          const DebugInfo *debug_info) {
+  int i;
+  const uint64_t section_flags[kNumOfObjSections] = {
+      kAllocated | kExecutable, // .text
+      kAllocated | kWritable,   // .data
+      kAllocated,               // .rodata
+      kAllocated | kWritable,   // .bss
+      kAllocated,               // .eh_frame
+      0, 0, 0,                  // .debug_*
+  };
+  OutputSection obj_sections[kNumOfObjSections];
+  // one per FDE, and a few for .debug_*
+  Relocation *debug_relocations = ArenaAlloc(
+      &assembly_arena, sizeof(Relocation) * (debug_info->num_of_fdes + 4));
+  int num_of_debug_relocations = 0;
+  ResetObjWriter();
+  int num_of_obj_sections = kNumOfSections;
+  memcpy(obj_sections, sections, sizeof(OutputSection) * kNumOfSections);
+  if (debug_info->num_of_fdes || debug_info->src_path) {
+    num_of_debug_relocations += BuildEhFrame(
+        &obj_sections[kEhFrame], &debug_relocations[num_of_debug_relocations],
+        debug_info->fdes, debug_info->num_of_fdes, debug_info->cfi_ops);
+    num_of_obj_sections = kEhFrame + 1;
+  }
+  if (debug_info->src_path) {
+    num_of_debug_relocations += BuildDebugSections(
+        &obj_sections[kDebugAbbrev],
+        &debug_relocations[num_of_debug_relocations], debug_info->src_path,
+        sections[kSectionText].size, debug_info->line_rows,
+        debug_info->num_of_line_rows);
+    num_of_obj_sections = kNumOfObjSections;
   }
 
-  for (i = 0; i < symbol_list_used; i++) {
-    PutSymbolTableEntry(&symbol_list[i], fp);
+  AddSymbol("", kLocalNoType, 0, 0);
+  for (i = 0; i < num_of_obj_sections; i++) {
+    AddSymbol("", kLocalSection, 1 + i, 0);
+  }
+  for (i = 0; i < num_of_func_symbols; i++) {
+    AddSourceSymbol(&func_symbols[i], 0, func_symbols[i].value);
+  }
+  int num_of_local_symbols = symbol_list_used;
+  for (i = 0; i < num_of_global_symbols; i++) {
+    AddSourceSymbol(&global_symbols[i], 1, global_symbols[i].value);
   }
 
-  for (i = 0; i < shdr_list_used; i++) {
-    PutSectionHeaderEntry(&shdr_list[i], fp);
+  for (i = 0; i < num_of_relocations; i++) {
+    AddRela(&relocations[i], num_of_local_symbols);
+  }
+  for (i = 0; i < num_of_debug_relocations; i++) {
+    AddRela(&debug_relocations[i], num_of_local_symbols);
+  }
+
+  AddSection("", 0, 0, NULL, 0);
+  for (i = 0; i < num_of_obj_sections; i++) {
+    // .bss occupies no space in the file
+    const OutputSection *section = &obj_sections[i];
+    uint32_t type = i == kEhFrame ? kX86_64Unwind
+                                  : (section->buf ? kProgBits : kNoBits);
+    SectionHeaderEntry *shdr = AddSection(section->name, type, section_flags[i],
+                                          section->buf, section->size);
+    shdr->align = section->align;
+  }
+  SectionHeaderEntry *rela_shdr_list[kNumOfObjSections] = {NULL};
+  for (i = 0; i < num_of_obj_sections; i++) {
+    if (!rela_list_used[i]) {
+      continue;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), ".rela%s", obj_sections[i].name);
+    SectionHeaderEntry *rela =
+        AddSection(name, kRela, kInfoLink, rela_list[i],
+                   sizeof(RelocationEntry) * rela_list_used[i]);
+    rela->entsize = sizeof(RelocationEntry);
+    rela->align = 8;
+    rela->info = 1 + i; // section to patch
+    rela_shdr_list[i] = rela;
+  }
+
+  SectionHeaderEntry *shstrtab =
+      AddSection(".shstrtab", kStrTable, 0, shstrtab_buf, 0);
+  int idx_of_shstrtab = (shstrtab - shdr_list);
+
+  SectionHeaderEntry *strtab =
+      AddSection(".strtab", kStrTable, 0, strtab_buf, strtab_buf_used);
+  int idx_of_strtab = (strtab - shdr_list);
+
+  SectionHeaderEntry *symtab =
+      AddSection(".symtab", kSymTable, 0, symbol_list,
+                 sizeof(SymbolTableEntry) * symbol_list_used);
+  symtab->entsize = sizeof(SymbolTableEntry);
+  symtab->align = 8;
+  symtab->link = idx_of_strtab;
+  symtab->info = num_of_local_symbols; // index of the first global symbol
+  for (i = 0; i < num_of_obj_sections; i++) {
+    if (rela_shdr_list[i]) {
+      rela_shdr_list[i]->link = symtab - shdr_list;
+    }
+  }
+  printf("symtab entries = %d\n", symbol_list_used);
+
+  // all names are added now
+  shstrtab->size = shstrtab_buf_used;
+  shdr_data_list[idx_of_shstrtab] = shstrtab_buf; // may have moved
+
+  // +0x00: ELF Header(0x40)
+  // data of each section, aligned to its align (.bss has no data)
+  // shdr list (sizeof(SectionHeaderEntry) * shdr_list_used), 8-byte aligned
+  uint64_t ofs = 0x40;
+  for (i = 1; i < shdr_list_used; i++) {
+    shdr_list[i].offset = AlignUp(ofs, shdr_list[i].align);
+    if (shdr_list[i].type != kNoBits) {
+      ofs = shdr_list[i].offset + shdr_list[i].size;
+    }
+    printf("%s: offset = 0x%lX, size = 0x%lX\n",
+           &shstrtab_buf[shdr_list[i].name_idx], shdr_list[i].offset,
+           shdr_list[i].size);
+  }
+  ofs = AlignUp(ofs, 8);
+
+  PutELFHeader(kRelocatable, 0, 0, ofs, idx_of_shstrtab, fp);
+  PutSectionsAndHeaders(0x40, ofs, fp);
+}
+
+//
+// Executable
+//
+
+#define EXEC_BASE_ADDR 0x400000
+#define EXEC_PAGE_SIZE 0x1000
+
+// Applies a relocation to the section contents now that the addresses are
+// fixed.
+void ApplyRelocation(OutputSection *sections, const uint64_t *section_addr,
+                     const Symbol *global_symbols,
+                     const Relocation *reloc) {
+  uint64_t target;
+  if (reloc->symbol >= 0) {
+    const Symbol *symbol = &global_symbols[reloc->symbol];
+    if (symbol->section < 0) {
+      ErrorAt(0, "%s: External symbols need ELF object output (--elf)",
+              symbol->name);
+    }
+    target = section_addr[symbol->section] + symbol->value;
+  } else {
+    target = section_addr[reloc->target_section];
+  }
+  target += reloc->addend;
+  uint8_t *field = &sections[reloc->section].buf[reloc->offset];
+  int64_t v;
+  int size;
+  switch (reloc->type) {
+  case kRelocAbs64:
+    v = target;
+    size = 8;
+    break;
+  case kRelocAbs32:
+    v = target;
+    size = 4;
+    if (target >> 32) {
+      Error("Absolute address does not fit in 32 bits");
+    }
+    break;
+  case kRelocAbs16:
+    v = target;
+    size = 2;
+    if (target >> 16) {
+      Error("Absolute address does not fit in 16 bits");
+    }
+    break;
+  default:
+    v = target - (section_addr[reloc->section] + reloc->offset);
+    size = reloc->type == kRelocPC16 ? 2 : 4;
+    if (v != (size == 2 ? (int16_t)v : (int32_t)v)) {
+      Error("PC-relative reference out of range");
+    }
+    break;
+  }
+  for (int i = 0; i < size; i++) {
+    field[i] = (v >> (8 * i)) & 0xff;
+  }
+}
+
+void WriteExecFileForELF64(FILE *fp, OutputSection *sections,
+                           const Symbol *func_symbols,
+                           int num_of_func_symbols,
+                           const Symbol *global_symbols,
+                           int num_of_global_symbols,
+                           const Relocation *relocations,
+                           int num_of_relocations, int entry_section,
+                           uint64_t entry_offset, uint64_t segment_align) {
+  int i;
+  const OutputSection *text = &sections[kSectionText];
+  const OutputSection *data = &sections[kSectionData];
+  const OutputSection *rodata = &sections[kSectionRodata];
+  const OutputSection *bss = &sections[kSectionBss];
+
+  // One PT_LOAD per protection: headers + .text (R X), .rodata (R) and
+  // .data + .bss (RW). Each segment starts on a new page in the file and at
+  // the next segment_align boundary in memory, keeping vaddr == offset
+  // modulo segment_align so that the kernel can map it.
+  ProgramHeaderEntry phdr_list[3];
+  int num_of_phdrs =
+      1 + (rodata->size != 0) + (data->size != 0 || bss->size != 0);
+  uint64_t section_ofs[kNumOfSections] = {0};
+  uint64_t section_addr[kNumOfSections] = {0};
+
+  section_ofs[kSectionText] =
+      AlignUp(0x40 + sizeof(ProgramHeaderEntry) * num_of_phdrs, text->align);
+  section_addr[kSectionText] = EXEC_BASE_ADDR + section_ofs[kSectionText];
+  uint64_t ofs = section_ofs[kSectionText] + text->size;
+  uint64_t addr = EXEC_BASE_ADDR + ofs;
+  memset(phdr_list, 0, sizeof(phdr_list));
+  phdr_list[0].type = kLoad;
+  phdr_list[0].flags = kSegmentReadable | kSegmentExecutable;
+  phdr_list[0].offset = 0;
+  phdr_list[0].vaddr = EXEC_BASE_ADDR;
+  phdr_list[0].size_in_file = ofs;
+  phdr_list[0].size_in_mem = ofs;
+  int phdr_idx = 1;
+
+  if (rodata->size) {
+    ProgramHeaderEntry *phdr = &phdr_list[phdr_idx++];
+    ofs = AlignUp(ofs, EXEC_PAGE_SIZE);
+    addr = AlignUp(addr, segment_align) + (ofs & (segment_align - 1));
+    section_ofs[kSectionRodata] = ofs;
+    section_addr[kSectionRodata] = addr;
+    phdr->type = kLoad;
+    phdr->flags = kSegmentReadable;
+    phdr->offset = ofs;
+    phdr->vaddr = addr;
+    phdr->size_in_file = rodata->size;
+    phdr->size_in_mem = rodata->size;
+    ofs += rodata->size;
+    addr += rodata->size;
+  }
+  if (data->size || bss->size) {
+    ProgramHeaderEntry *phdr = &phdr_list[phdr_idx++];
+    ofs = AlignUp(ofs, EXEC_PAGE_SIZE);
+    addr = AlignUp(addr, segment_align) + (ofs & (segment_align - 1));
+    section_ofs[kSectionData] = ofs;
+    section_addr[kSectionData] = addr;
+    // .bss follows .data in memory only
+    section_addr[kSectionBss] = AlignUp(addr + data->size, bss->align);
+    section_ofs[kSectionBss] = ofs + (section_addr[kSectionBss] - addr);
+    phdr->type = kLoad;
+    phdr->flags = kSegmentReadable | kSegmentWritable;
+    phdr->offset = ofs;
+    phdr->vaddr = addr;
+    phdr->size_in_file = data->size;
+    phdr->size_in_mem = section_addr[kSectionBss] + bss->size - addr;
+    ofs += data->size;
+  }
+  for (i = 0; i < num_of_phdrs; i++) {
+    phdr_list[i].paddr = phdr_list[i].vaddr;
+    phdr_list[i].align = segment_align;
+  }
+
+  for (i = 0; i < num_of_relocations; i++) {
+    ApplyRelocation(sections, section_addr, global_symbols, &relocations[i]);
+  }
+
+  // Section headers are not needed to run, but keep the file readable by
+  // objdump, gdb and muimsa.
+  const uint64_t section_flags[kNumOfSections] = {
+      kAllocated | kExecutable, // .text
+      kAllocated | kWritable,   // .data
+      kAllocated,               // .rodata
+      kAllocated | kWritable,   // .bss
+  };
+  ResetObjWriter();
+  AddSection("", 0, 0, NULL, 0);
+  for (i = 0; i < kNumOfSections; i++) {
+    SectionHeaderEntry *shdr =
+        AddSection(sections[i].name, sections[i].buf ? kProgBits : kNoBits,
+                   section_flags[i], sections[i].buf, sections[i].size);
+    shdr->addr = section_addr[i];
+    shdr->offset = section_ofs[i];
+    shdr->align = sections[i].align;
+  }
+  AddSymbol("", kLocalNoType, 0, 0);
+  for (i = 0; i < num_of_func_symbols; i++) {
+    const Symbol *symbol = &func_symbols[i];
+    AddSourceSymbol(symbol, 0, section_addr[symbol->section] + symbol->value);
+  }
+  int num_of_local_symbols = symbol_list_used;
+  for (i = 0; i < num_of_global_symbols; i++) {
+    const Symbol *symbol = &global_symbols[i];
+    if (symbol->section >= 0) {
+      AddSourceSymbol(symbol, 1,
+                      section_addr[symbol->section] + symbol->value);
+    }
+  }
+  SectionHeaderEntry *shstrtab =
+      AddSection(".shstrtab", kStrTable, 0, shstrtab_buf, 0);
+  int idx_of_shstrtab = (shstrtab - shdr_list);
+  SectionHeaderEntry *strtab =
+      AddSection(".strtab", kStrTable, 0, strtab_buf, strtab_buf_used);
+  SectionHeaderEntry *symtab =
+      AddSection(".symtab", kSymTable, 0, symbol_list,
+                 sizeof(SymbolTableEntry) * symbol_list_used);
+  symtab->entsize = sizeof(SymbolTableEntry);
+  symtab->align = 8;
+  symtab->link = strtab - shdr_list;
+  symtab->info = num_of_local_symbols; // index of the first global symbol
+  shstrtab->size = shstrtab_buf_used;
+  shdr_data_list[idx_of_shstrtab] = shstrtab_buf; // may have moved
+  for (i = idx_of_shstrtab; i < shdr_list_used; i++) {
+    shdr_list[i].offset = AlignUp(ofs, shdr_list[i].align);
+    ofs = shdr_list[i].offset + shdr_list[i].size;
+  }
+  ofs = AlignUp(ofs, 8);
+
+  uint64_t entry = section_addr[entry_section] + entry_offset;
+  printf("entry = 0x%lX\n", entry);
+  PutELFHeader(kExecutableFile, entry, num_of_phdrs, ofs, idx_of_shstrtab,
+               fp);
+  for (i = 0; i < num_of_phdrs; i++) {
+    fwrite(&phdr_list[i], 1, sizeof(ProgramHeaderEntry), fp);
   }
+  PutSectionsAndHeaders(0x40 + sizeof(ProgramHeaderEntry) * num_of_phdrs,
+                        ofs, fp);
 }
@@ -0,0 +1,410 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "asmium.h"
+
+//
+// In-process (JIT) assembly
+//
+// The sections are placed in memory of this process (.text executable,
+// .rodata read-only, .data and .bss writable) and called from there. perf
+// sees such code as anonymous pages, so the functions are described to it
+// by a perf map (/tmp/perf-<pid>.map) and / or a jitdump file
+// (jit-<pid>.dump, for perf inject --jit).
+//
+
+#define JIT_PAGE_SIZE 0x1000
+
+void LoadJitImage(JitImage *image, OutputSection *sections,
+                  const Symbol *global_symbols, const Relocation *relocations,
+                  int num_of_relocations) {
+  const OutputSection *data = &sections[kSectionData];
+  const OutputSection *bss = &sections[kSectionBss];
+  uint64_t text_size = AlignUp(sections[kSectionText].size, JIT_PAGE_SIZE);
+  uint64_t rodata_size = AlignUp(sections[kSectionRodata].size, JIT_PAGE_SIZE);
+  uint64_t bss_ofs = AlignUp(data->size, bss->align);
+  uint64_t data_size = AlignUp(bss_ofs + bss->size, JIT_PAGE_SIZE);
+  image->size = text_size + rodata_size + data_size;
+  if (!image->size) {
+    image->size = JIT_PAGE_SIZE;
+  }
+  image->base = mmap(NULL, image->size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (image->base == MAP_FAILED) {
+    Error("Failed to map memory for the code");
+  }
+  uint64_t base = (uintptr_t)image->base;
+  image->section_addr[kSectionText] = base;
+  image->section_addr[kSectionRodata] = base + text_size;
+  image->section_addr[kSectionData] = base + text_size + rodata_size;
+  image->section_addr[kSectionBss] =
+      image->section_addr[kSectionData] + bss_ofs;
+
+  for (int i = 0; i < num_of_relocations; i++) {
+    ApplyRelocation(sections, image->section_addr, global_symbols,
+                    &relocations[i]);
+  }
+  for (int s = 0; s < kNumOfSections; s++) {
+    if (sections[s].buf) {
+      memcpy((void *)(uintptr_t)image->section_addr[s], sections[s].buf,
+             sections[s].size);
+    }
+  }
+  if ((text_size && mprotect(image->base, text_size, PROT_READ | PROT_EXEC)) ||
+      (rodata_size &&
+       mprotect(image->base + text_size, rodata_size, PROT_READ))) {
+    Error("Failed to protect memory for the code");
+  }
+}
+
+void UnloadJitImage(JitImage *image) {
+  munmap(image->base, image->size);
+  image->base = NULL;
+}
+
+void WritePerfMap(const JitImage *image, const Symbol *symbols,
+                  int num_of_symbols) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+  FILE *fp = fopen(path, "a");
+  if (!fp) {
+    Error("Failed to open the perf map");
+  }
+  for (int i = 0; i < num_of_symbols; i++) {
+    const Symbol *symbol = &symbols[i];
+    fprintf(fp, "%llx %llx %s\n",
+            (unsigned long long)(image->section_addr[symbol->section] +
+                                 symbol->value),
+            (unsigned long long)symbol->size, symbol->name);
+  }
+  fclose(fp);
+}
+
+//
+// jitdump (tools/perf/Documentation/jitdump-specification.txt)
+//
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define EM_X86_64 62
+
+typedef enum {
+  kJitCodeLoad = 0,
+  kJitCodeDebugInfo = 2,
+} JitRecordType;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+} JitHeader;
+
+typedef struct {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+} JitRecordHeader;
+
+typedef struct {
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+} JitCodeLoad;
+
+typedef struct {
+  uint64_t code_addr;
+  uint32_t line;
+  uint32_t discrim;
+} JitDebugEntry;
+
+uint64_t GetJitTimestamp() {
+  // perf record -k mono
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void PutJitRecordHeader(JitRecordType id, size_t size, FILE *fp) {
+  JitRecordHeader header = {id, sizeof(JitRecordHeader) + size,
+                            GetJitTimestamp()};
+  fwrite(&header, sizeof(header), 1, fp);
+}
+
+// The jitdump file of the process, opened and mapped by the first run.
+// Later runs (--watch) append their records, so that the code which perf
+// has seen before keeps its records, and code_index is unique in the file.
+FILE *jitdump_fp;
+uint64_t jitdump_code_index;
+
+void WriteJitDump(const JitImage *image, const OutputSection *sections,
+                  const Symbol *symbols, int num_of_symbols,
+                  const char *src_path, const LineRow *line_rows,
+                  int num_of_line_rows) {
+  FILE *fp = jitdump_fp;
+  if (!fp) {
+    char path[64];
+    snprintf(path, sizeof(path), "jit-%d.dump", getpid());
+    fp = fopen(path, "w+");
+    if (!fp) {
+      Error("Failed to open the jitdump file");
+    }
+    // perf finds the file by this executable mapping of it.
+    if (mmap(NULL, JIT_PAGE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE,
+             fileno(fp), 0) == MAP_FAILED) {
+      fclose(fp);
+      Error("Failed to map the jitdump file");
+    }
+    JitHeader header = {JITDUMP_MAGIC,    JITDUMP_VERSION, sizeof(JitHeader),
+                        EM_X86_64,        0,               getpid(),
+                        GetJitTimestamp(), 0};
+    fwrite(&header, sizeof(header), 1, fp);
+    jitdump_fp = fp;
+  }
+#ifdef __linux__
+  uint32_t tid = syscall(SYS_gettid);
+#else
+  uint32_t tid = getpid();
+#endif
+  size_t src_path_size = strlen(src_path) + 1;
+
+  for (int i = 0; i < num_of_symbols; i++) {
+    const Symbol *symbol = &symbols[i];
+    uint64_t text_addr = image->section_addr[kSectionText];
+    uint64_t addr = image->section_addr[symbol->section] + symbol->value;
+    // lines of the function, before its code is loaded
+    int first_row = 0;
+    int num_of_rows = 0;
+    for (int k = 0; k < num_of_line_rows; k++) {
+      if (line_rows[k].offset < symbol->value) {
+        first_row = k + 1;
+      } else if (line_rows[k].offset < symbol->value + symbol->size) {
+        num_of_rows++;
+      }
+    }
+    if (num_of_rows) {
+      PutJitRecordHeader(kJitCodeDebugInfo,
+                         sizeof(uint64_t) * 2 +
+                             (sizeof(JitDebugEntry) + src_path_size) *
+                                 num_of_rows,
+                         fp);
+      uint64_t code_addr_and_nr_entry[2] = {addr, num_of_rows};
+      fwrite(code_addr_and_nr_entry, sizeof(code_addr_and_nr_entry), 1, fp);
+      for (int k = first_row; k < first_row + num_of_rows; k++) {
+        JitDebugEntry entry = {text_addr + line_rows[k].offset,
+                               line_rows[k].line, 0};
+        fwrite(&entry, sizeof(entry), 1, fp);
+        fwrite(src_path, src_path_size, 1, fp);
+      }
+    }
+    const char *name = symbol->name;
+    size_t name_size = strlen(name) + 1;
+    PutJitRecordHeader(kJitCodeLoad,
+                       sizeof(JitCodeLoad) + name_size + symbol->size, fp);
+    JitCodeLoad load = {getpid(), tid, addr, addr, symbol->size,
+                        jitdump_code_index++};
+    fwrite(&load, sizeof(load), 1, fp);
+    fwrite(name, name_size, 1, fp);
+    fwrite(&sections[symbol->section].buf[symbol->value], symbol->size, 1,
+           fp);
+  }
+  fflush(fp);
+}
+
+//
+// Microbenchmark (--bench)
+//
+
+#define BENCH_WARMUP_DIVISOR 10  // warmup calls per call measured
+
+// Hardware counters, summed over the measured calls. They are opened as one
+// group, so that the PMU counts all of them at the same time or none: when
+// it multiplexes the group with other events, the counts are of the same
+// intervals and are scaled to the whole run.
+typedef struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+  int fd;  // -1 if perf_event_open is not available for it
+  int index_in_group;
+} BenchCounter;
+
+#ifdef __linux__
+#define PERF_L1D_READ_MISS                                     \
+  (PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+#define PERF_L1I_READ_MISS                                     \
+  (PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+BenchCounter bench_counters[] = {
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1, 0},
+    {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS, -1, 0},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1, 0},
+    {"L1d-misses", PERF_TYPE_HW_CACHE, PERF_L1D_READ_MISS, -1, 0},
+    {"L1i-misses", PERF_TYPE_HW_CACHE, PERF_L1I_READ_MISS, -1, 0},
+};
+#define NUM_OF_BENCH_COUNTERS \
+  (int)(sizeof(bench_counters) / sizeof(bench_counters[0]))
+int bench_group_fd = -1; // the leader, the first counter opened
+int bench_group_size;
+
+void OpenBenchCounters() {
+  bench_group_fd = -1;
+  bench_group_size = 0;
+  for (int i = 0; i < NUM_OF_BENCH_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = bench_counters[i].type;
+    attr.config = bench_counters[i].config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // The members are enabled and disabled with the leader.
+    attr.disabled = bench_group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, bench_group_fd, 0);
+    bench_counters[i].fd = fd;
+    if (fd == -1) {
+      continue;
+    }
+    if (bench_group_fd == -1) {
+      bench_group_fd = fd;
+    }
+    bench_counters[i].index_in_group = bench_group_size++;
+  }
+}
+
+void EnableBenchCounters(int enable) {
+  if (bench_group_fd != -1) {
+    ioctl(bench_group_fd,
+          enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE,
+          PERF_IOC_FLAG_GROUP);
+  }
+}
+
+void PrintBenchCounters(int iterations) {
+  // PERF_FORMAT_GROUP: nr, time_enabled, time_running, values[nr]
+  uint64_t group[3 + NUM_OF_BENCH_COUNTERS];
+  ssize_t size = sizeof(uint64_t) * (3 + bench_group_size);
+  int is_read = bench_group_fd != -1 &&
+                read(bench_group_fd, group, size) == size && group[2] != 0;
+  double scale = is_read ? (double)group[1] / group[2] : 0;
+  for (int i = 0; i < NUM_OF_BENCH_COUNTERS; i++) {
+    if (bench_counters[i].fd == -1 || !is_read) {
+      printf("%-14s n/a\n", bench_counters[i].name);
+    } else {
+      printf("%-14s %.2f / call\n", bench_counters[i].name,
+             group[3 + bench_counters[i].index_in_group] * scale / iterations);
+    }
+  }
+  if (is_read && group[2] < group[1]) {
+    printf("(counters multiplexed: counted %.1f%% of the time, scaled)\n",
+           100.0 * group[2] / group[1]);
+  }
+  // The members first, and then the leader.
+  for (int i = NUM_OF_BENCH_COUNTERS - 1; i >= 0; i--) {
+    if (bench_counters[i].fd != -1) {
+      close(bench_counters[i].fd);
+      bench_counters[i].fd = -1;
+    }
+  }
+  bench_group_fd = -1;
+}
+#else
+void OpenBenchCounters() {}
+void EnableBenchCounters(int enable) { (void)enable; }
+void PrintBenchCounters(int iterations) {
+  (void)iterations;
+  puts("(no hardware counters on this platform)");
+}
+#endif
+
+uint64_t ReadCycleCounterBegin() {
+#if defined(__x86_64__) || defined(__i386__)
+  // Previous instructions complete before rdtsc reads the counter.
+  _mm_lfence();
+  uint64_t t = __rdtsc();
+  _mm_lfence();
+  return t;
+#else
+  return GetJitTimestamp();
+#endif
+}
+
+uint64_t ReadCycleCounterEnd() {
+#if defined(__x86_64__) || defined(__i386__)
+  // rdtscp waits for the code measured, lfence keeps later code out.
+  uint32_t aux;
+  uint64_t t = __rdtscp(&aux);
+  _mm_lfence();
+  return t;
+#else
+  return GetJitTimestamp();
+#endif
+}
+
+int CompareUInt64(const void *a, const void *b) {
+  uint64_t va = *(const uint64_t *)a;
+  uint64_t vb = *(const uint64_t *)b;
+  return va < vb ? -1 : va > vb;
+}
+
+void BenchJitEntry(int (*entry)(void), const char *entry_name,
+                   int iterations) {
+  uint64_t *cycles = malloc(sizeof(uint64_t) * iterations);
+  if (!cycles) {
+    Error("No memory for the benchmark");
+  }
+  int warmup = iterations / BENCH_WARMUP_DIVISOR;
+  for (int i = 0; i < warmup; i++) {
+    entry();
+  }
+  // The overhead of reading the counter itself is subtracted.
+  uint64_t overhead = UINT64_MAX;
+  for (int i = 0; i < warmup || i < 16; i++) {
+    uint64_t t0 = ReadCycleCounterBegin();
+    uint64_t t1 = ReadCycleCounterEnd();
+    if (t1 - t0 < overhead) {
+      overhead = t1 - t0;
+    }
+  }
+  OpenBenchCounters();
+  EnableBenchCounters(1);
+  for (int i = 0; i < iterations; i++) {
+    uint64_t t0 = ReadCycleCounterBegin();
+    entry();
+    uint64_t t1 = ReadCycleCounterEnd();
+    cycles[i] = t1 - t0 > overhead ? t1 - t0 - overhead : 0;
+  }
+  EnableBenchCounters(0);
+  qsort(cycles, iterations, sizeof(uint64_t), CompareUInt64);
+  printf("bench %s: %d calls (%d warmup)\n", entry_name, iterations, warmup);
+  printf("%-14s min %llu, median %llu (TSC, overhead %llu subtracted)\n",
+         "cycles", (unsigned long long)cycles[0],
+         (unsigned long long)cycles[iterations / 2],
+         (unsigned long long)overhead);
+  PrintBenchCounters(iterations);
+  free(cycles);
+}
@@ -0,0 +1,455 @@
+#include "cfg.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+using K = OperandKind;
+using M = Mnemonic;
+
+constexpr int kCacheLineSize = 64;
+constexpr int kFetchWindowSize = 32;
+
+enum class BranchKind {
+  kNone,
+  kJump,          // direct, unconditional
+  kCondJump,      // direct, falls through if not taken
+  kCall,          // falls through
+  kIndirectJump,  // target unknown, never falls through
+  kStop,          // ret, hlt, ud2, ... never falls through
+};
+
+BranchKind GetBranchKind(const Instr &instr) {
+  const M m = instr.mnemonic;
+  if (instr.flags & kInstrInvalid) {
+    return BranchKind::kStop;
+  }
+  if ((m >= M::kJO && m <= M::kJG) || m == M::kLOOPNE || m == M::kLOOPE ||
+      m == M::kLOOP || m == M::kJRCXZ || m == M::kXBEGIN) {
+    return BranchKind::kCondJump;
+  }
+  switch (m) {
+  case M::kJMP:
+    return instr.operands[0] == K::kJb || instr.operands[0] == K::kJz
+               ? BranchKind::kJump
+               : BranchKind::kIndirectJump;
+  case M::kJMPF:
+    return BranchKind::kIndirectJump;
+  case M::kCALL:
+  case M::kCALLF:
+    return BranchKind::kCall;
+  case M::kRET:
+  case M::kRETF:
+  case M::kIRET:
+  case M::kHLT:
+  case M::kUD2:
+    return BranchKind::kStop;
+  default:
+    return BranchKind::kNone;
+  }
+}
+
+struct InstrInfo {
+  uint64_t addr;
+  BranchKind kind;
+  uint64_t target;  // for kJump and kCondJump
+};
+
+int FindBlock(const vector<BasicBlock> &blocks, uint64_t addr) {
+  auto it = lower_bound(
+      blocks.begin(), blocks.end(), addr,
+      [](const BasicBlock &b, uint64_t addr) { return b.addr < addr; });
+  return it != blocks.end() && it->addr == addr ? it - blocks.begin() : -1;
+}
+
+// "A Simple, Fast Dominance Algorithm" (Cooper, Harvey and Kennedy)
+void ComputeDominators(vector<BasicBlock> &blocks) {
+  const int n = blocks.size();
+  vector<int> rpo;
+  vector<int> order(n, -1);  // position in rpo
+  {
+    vector<int> post;
+    vector<bool> visited(n);
+    vector<pair<int, size_t>> stack = {{0, 0}};
+    visited[0] = true;
+    while (!stack.empty()) {
+      auto &[b, i] = stack.back();
+      if (i < blocks[b].succs.size()) {
+        int s = blocks[b].succs[i++];
+        if (!visited[s]) {
+          visited[s] = true;
+          stack.push_back({s, 0});
+        }
+      } else {
+        post.push_back(b);
+        stack.pop_back();
+      }
+    }
+    rpo.assign(post.rbegin(), post.rend());
+  }
+  for (size_t i = 0; i < rpo.size(); i++) {
+    order[rpo[i]] = i;
+  }
+  vector<vector<int>> preds(n);
+  for (int b = 0; b < n; b++) {
+    for (int s : blocks[b].succs) {
+      preds[s].push_back(b);
+    }
+  }
+  vector<int> idom(n, -1);
+  idom[0] = 0;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t i = 1; i < rpo.size(); i++) {
+      const int b = rpo[i];
+      int new_idom = -1;
+      for (int p : preds[b]) {
+        if (idom[p] < 0) {
+          continue;
+        }
+        if (new_idom < 0) {
+          new_idom = p;
+          continue;
+        }
+        int x = p, y = new_idom;
+        while (x != y) {
+          while (order[x] > order[y]) {
+            x = idom[x];
+          }
+          while (order[y] > order[x]) {
+            y = idom[y];
+          }
+        }
+        new_idom = x;
+      }
+      if (idom[b] != new_idom) {
+        idom[b] = new_idom;
+        changed = true;
+      }
+    }
+  }
+  idom[0] = -1;
+  for (int b = 0; b < n; b++) {
+    blocks[b].idom = idom[b];
+  }
+}
+
+bool Dominates(const vector<BasicBlock> &blocks, int a, int b) {
+  for (; b >= 0; b = blocks[b].idom) {
+    if (a == b) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void FindLoops(Function *func) {
+  const vector<BasicBlock> &blocks = func->blocks;
+  const int n = blocks.size();
+  vector<vector<int>> preds(n);
+  for (int b = 0; b < n; b++) {
+    for (int s : blocks[b].succs) {
+      preds[s].push_back(b);
+    }
+  }
+  for (int h = 0; h < n; h++) {
+    vector<bool> in_body(n);
+    vector<int> stack;
+    for (int p : preds[h]) {
+      // A back edge p -> h
+      if (Dominates(blocks, h, p) && !in_body[p]) {
+        in_body[p] = true;
+        stack.push_back(p);
+      }
+    }
+    if (stack.empty()) {
+      continue;
+    }
+    in_body[h] = true;
+    while (!stack.empty()) {
+      int b = stack.back();
+      stack.pop_back();
+      if (b == h) {
+        continue;
+      }
+      for (int p : preds[b]) {
+        if (!in_body[p]) {
+          in_body[p] = true;
+          stack.push_back(p);
+        }
+      }
+    }
+    Loop loop = {};
+    loop.header = h;
+    loop.begin = UINT64_MAX;
+    for (int b = 0; b < n; b++) {
+      if (in_body[b]) {
+        loop.blocks.push_back(b);
+        loop.begin = min(loop.begin, blocks[b].addr);
+        loop.end = max(loop.end, blocks[b].addr + blocks[b].size);
+      }
+    }
+    const uint64_t size = loop.end - loop.begin;
+    loop.alignment = 1;
+    while (loop.alignment < kCacheLineSize &&
+           !(blocks[h].addr & loop.alignment)) {
+      loop.alignment <<= 1;
+    }
+    loop.cache_lines = (loop.end - 1) / kCacheLineSize -
+                       loop.begin / kCacheLineSize + 1;
+    loop.min_cache_lines = (size + kCacheLineSize - 1) / kCacheLineSize;
+    loop.fetch_windows = (loop.end - 1) / kFetchWindowSize -
+                         loop.begin / kFetchWindowSize + 1;
+    loop.min_fetch_windows = (size + kFetchWindowSize - 1) / kFetchWindowSize;
+    func->loops.push_back(move(loop));
+  }
+}
+
+void PutAddr(OutputBuffer *out, uint64_t addr) {
+  out->Put("0x");
+  out->PutHex(addr, 1, false);
+}
+
+void PutNodeID(OutputBuffer *out, const Function &func, int b) {
+  out->Put('"');
+  PutJSONString(out, func.name);
+  out->Put(':');
+  PutAddr(out, func.blocks[b].addr);
+  out->Put('"');
+}
+
+}  // namespace
+
+Function AnalyzeFunction(const Section &section, const char *name,
+                         uint64_t addr, uint64_t size, CPUMode mode) {
+  Function func;
+  func.name = name;
+  func.addr = addr;
+  func.size = size;
+  const uint64_t end = addr + size;
+
+  vector<InstrInfo> instrs;
+  Instr instr;
+  for (uint64_t a = addr; a < end;) {
+    const size_t ofs = a - section.addr;
+    Decode(&section.data[ofs], section.size - ofs, mode, &instr);
+    InstrInfo info = {a, GetBranchKind(instr), 0};
+    if (info.kind == BranchKind::kJump || info.kind == BranchKind::kCondJump) {
+      info.target = GetBranchTarget(instr, a);
+    }
+    instrs.push_back(info);
+    a += instr.length;
+  }
+  if (instrs.empty()) {
+    return func;
+  }
+
+  // Leaders: the entry, branch targets inside the function (only if they
+  // are instruction boundaries of this sweep) and instructions after branches
+  vector<bool> is_leader(instrs.size());
+  is_leader[0] = true;
+  auto find_instr = [&](uint64_t a) {
+    auto it = lower_bound(
+        instrs.begin(), instrs.end(), a,
+        [](const InstrInfo &i, uint64_t a) { return i.addr < a; });
+    return it != instrs.end() && it->addr == a ? it - instrs.begin() : -1;
+  };
+  for (size_t i = 0; i < instrs.size(); i++) {
+    if (instrs[i].kind == BranchKind::kNone) {
+      continue;
+    }
+    if (i + 1 < instrs.size()) {
+      is_leader[i + 1] = true;
+    }
+    if (instrs[i].kind == BranchKind::kJump ||
+        instrs[i].kind == BranchKind::kCondJump) {
+      int t = find_instr(instrs[i].target);
+      if (t >= 0) {
+        is_leader[t] = true;
+      }
+    }
+  }
+
+  vector<size_t> last_instr;  // of each block
+  for (size_t i = 0; i < instrs.size(); i++) {
+    if (is_leader[i]) {
+      BasicBlock block = {};
+      block.addr = instrs[i].addr;
+      block.idom = -1;
+      func.blocks.push_back(block);
+      last_instr.push_back(i);
+    }
+    BasicBlock &block = func.blocks.back();
+    const uint64_t next = i + 1 < instrs.size() ? instrs[i + 1].addr : end;
+    block.size = next - block.addr;
+    block.num_of_instrs++;
+    last_instr.back() = i;
+  }
+  for (size_t b = 0; b < func.blocks.size(); b++) {
+    const InstrInfo &last = instrs[last_instr[b]];
+    vector<int> &succs = func.blocks[b].succs;
+    if (last.kind == BranchKind::kJump || last.kind == BranchKind::kCondJump) {
+      int t = FindBlock(func.blocks, last.target);
+      if (t >= 0) {
+        succs.push_back(t);
+      }
+    }
+    if ((last.kind == BranchKind::kNone || last.kind == BranchKind::kCall ||
+         last.kind == BranchKind::kCondJump) &&
+        b + 1 < func.blocks.size() &&
+        find(succs.begin(), succs.end(), b + 1) == succs.end()) {
+      succs.push_back(b + 1);
+    }
+  }
+  ComputeDominators(func.blocks);
+  FindLoops(&func);
+  return func;
+}
+
+vector<Function> AnalyzeSection(const ObjectFile &obj, int index,
+                                CPUMode mode) {
+  const Section &section = obj.GetSections()[index];
+  const uint64_t section_end = section.addr + section.size;
+  vector<const Symbol *> starts;
+  for (const Symbol &sym : obj.GetSymbols()) {
+    if (sym.section == index && sym.addr >= section.addr &&
+        sym.addr < section_end &&
+        (starts.empty() || starts.back()->addr != sym.addr)) {
+      starts.push_back(&sym);
+    }
+  }
+  vector<Function> funcs;
+  if (starts.empty()) {
+    funcs.push_back(AnalyzeFunction(section, section.name.c_str(),
+                                    section.addr, section.size, mode));
+    return funcs;
+  }
+  for (size_t i = 0; i < starts.size(); i++) {
+    uint64_t end = i + 1 < starts.size() ? starts[i + 1]->addr : section_end;
+    if (starts[i]->size && starts[i]->addr + starts[i]->size < end) {
+      end = starts[i]->addr + starts[i]->size;
+    }
+    funcs.push_back(AnalyzeFunction(section, starts[i]->name, starts[i]->addr,
+                                    end - starts[i]->addr, mode));
+  }
+  return funcs;
+}
+
+void PrintCFGHeader(OutputBuffer *out, CFGStyle style) {
+  if (style == CFGStyle::kDOT) {
+    out->Put("digraph cfg {\n  node [shape=box, fontname=\"monospace\"];\n");
+  }
+}
+
+void PrintCFGFooter(OutputBuffer *out, CFGStyle style) {
+  if (style == CFGStyle::kDOT) {
+    out->Put("}\n");
+  }
+}
+
+void PrintCFG(OutputBuffer *out, CFGStyle style, const Function &func) {
+  if (style == CFGStyle::kJSON) {
+    out->Put("{\"function\":\"");
+    PutJSONString(out, func.name);
+    out->Put("\",\"addr\":");
+    out->PutDec(func.addr);
+    out->Put(",\"size\":");
+    out->PutDec(func.size);
+    out->Put(",\"blocks\":[");
+    for (size_t b = 0; b < func.blocks.size(); b++) {
+      const BasicBlock &block = func.blocks[b];
+      out->Put(b ? ",{\"addr\":" : "{\"addr\":");
+      out->PutDec(block.addr);
+      out->Put(",\"size\":");
+      out->PutDec(block.size);
+      out->Put(",\"instrs\":");
+      out->PutDec(block.num_of_instrs);
+      out->Put(",\"succs\":[");
+      for (size_t i = 0; i < block.succs.size(); i++) {
+        if (i) {
+          out->Put(',');
+        }
+        out->PutDec(func.blocks[block.succs[i]].addr);
+      }
+      out->Put("]}");
+    }
+    out->Put("],\"loops\":[");
+    for (size_t i = 0; i < func.loops.size(); i++) {
+      const Loop &loop = func.loops[i];
+      out->Put(i ? ",{\"header\":" : "{\"header\":");
+      out->PutDec(func.blocks[loop.header].addr);
+      out->Put(",\"begin\":");
+      out->PutDec(loop.begin);
+      out->Put(",\"size\":");
+      out->PutDec(loop.end - loop.begin);
+      out->Put(",\"blocks\":");
+      out->PutDec(loop.blocks.size());
+      out->Put(",\"alignment\":");
+      out->PutDec(loop.alignment);
+      out->Put(",\"cache_lines\":");
+      out->PutDec(loop.cache_lines);
+      out->Put(",\"min_cache_lines\":");
+      out->PutDec(loop.min_cache_lines);
+      out->Put(",\"fetch_windows\":");
+      out->PutDec(loop.fetch_windows);
+      out->Put(",\"min_fetch_windows\":");
+      out->PutDec(loop.min_fetch_windows);
+      out->Put(loop.IsFlagged() ? ",\"flagged\":true}" : ",\"flagged\":false}");
+    }
+    out->Put("]}\n");
+    return;
+  }
+
+  vector<const Loop *> loop_of(func.blocks.size());
+  for (const Loop &loop : func.loops) {
+    loop_of[loop.header] = &loop;
+  }
+  out->Put("  subgraph \"cluster_");
+  PutJSONString(out, func.name);
+  out->Put("\" {\n    label=\"");
+  PutJSONString(out, func.name);
+  out->Put("\";\n");
+  for (size_t b = 0; b < func.blocks.size(); b++) {
+    const BasicBlock &block = func.blocks[b];
+    out->Put("    ");
+    PutNodeID(out, func, b);
+    out->Put(" [label=\"");
+    PutAddr(out, block.addr);
+    out->Put(": ");
+    out->PutDec(block.num_of_instrs);
+    out->Put(" instrs, ");
+    out->PutDec(block.size);
+    out->Put(" bytes");
+    if (const Loop *loop = loop_of[b]) {
+      out->Put("\\nloop: ");
+      out->PutDec(loop->end - loop->begin);
+      out->Put(" bytes, align ");
+      out->PutDec(loop->alignment);
+      out->Put(", ");
+      out->PutDec(loop->cache_lines);
+      out->Put('/');
+      out->PutDec(loop->min_cache_lines);
+      out->Put(" lines, ");
+      out->PutDec(loop->fetch_windows);
+      out->Put('/');
+      out->PutDec(loop->min_fetch_windows);
+      out->Put(" windows\", style=filled, fillcolor=");
+      out->Put(loop->IsFlagged() ? "salmon" : "lightblue");
+    } else {
+      out->Put('"');
+    }
+    out->Put("];\n");
+  }
+  for (size_t b = 0; b < func.blocks.size(); b++) {
+    for (int s : func.blocks[b].succs) {
+      out->Put("    ");
+      PutNodeID(out, func, b);
+      out->Put(" -> ");
+      PutNodeID(out, func, s);
+      out->Put(";\n");
+    }
+  }
+  out->Put("  }\n");
+}
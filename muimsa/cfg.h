@@ -0,0 +1,67 @@
+#ifndef MUIMSA_CFG_H_
+#define MUIMSA_CFG_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "decoder.h"
+#include "formatter.h"
+#include "object_file.h"
+
+struct BasicBlock {
+  uint64_t addr;
+  uint32_t size;
+  uint32_t num_of_instrs;
+  std::vector<int> succs;  // indices in Function::blocks
+  int idom;                // immediate dominator, -1 for entry / unreachable
+};
+
+// A natural loop: the blocks dominated by header that reach a back edge to it
+struct Loop {
+  int header;
+  std::vector<int> blocks;
+  uint64_t begin;  // lowest address of the loop body
+  uint64_t end;    // end of the highest block of the loop body
+  int alignment;   // of the header address (power of two, up to 64)
+  int cache_lines;      // 64-byte lines touched by [begin, end)
+  int min_cache_lines;  // if the body were ideally aligned
+  int fetch_windows;    // 32-byte windows touched by [begin, end)
+  int min_fetch_windows;
+
+  bool IsFlagged() const {
+    return cache_lines > min_cache_lines || fetch_windows > min_fetch_windows;
+  }
+};
+
+struct Function {
+  const char *name;
+  uint64_t addr;
+  uint64_t size;
+  std::vector<BasicBlock> blocks;  // sorted by address, entry first
+  std::vector<Loop> loops;
+};
+
+// Recovers the basic blocks, the control flow graph and the natural loops of
+// the code in [addr, addr + size) of a section. Blocks end at jmp, jcc,
+// call, ret (and other instructions that never fall through); calls and
+// indirect branches add no edges other than the fall-through.
+Function AnalyzeFunction(const Section &section, const char *name,
+                         uint64_t addr, uint64_t size, CPUMode mode);
+
+// Splits an executable section into functions at its symbols (the whole
+// section if there is none) and analyzes each.
+std::vector<Function> AnalyzeSection(const ObjectFile &obj, int index,
+                                     CPUMode mode);
+
+enum class CFGStyle {
+  kDOT,
+  kJSON,  // one object per function
+};
+
+// DOT output is a fragment; wrap it with PrintCFGHeader / PrintCFGFooter.
+void PrintCFGHeader(OutputBuffer *out, CFGStyle style);
+void PrintCFG(OutputBuffer *out, CFGStyle style, const Function &func);
+void PrintCFGFooter(OutputBuffer *out, CFGStyle style);
+
+#endif  // MUIMSA_CFG_H_
@@ -0,0 +1,1455 @@
+#include "decoder.h"
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+using K = OperandKind;
+using M = Mnemonic;
+
+// OpcodeEntry::attrs
+enum : uint8_t {
+  kAttrModRM = 1,
+  kAttrPrefix = 2,
+  kAttrInvalid = 4,
+  kAttrInvalid64 = 8,
+  kAttrDefault64 = 16,  // operand size defaults to 64bit in 64bit mode
+  kAttrEscape = 32,     // 0x0F, VEX, EVEX
+};
+
+enum Group : uint8_t {
+  kGroupNone,
+  kGroup1,
+  kGroup1A,
+  kGroup2,
+  kGroup3,
+  kGroup4,
+  kGroup5,
+  kGroup8,
+  kGroup11,
+  kNumOfGroups,
+};
+
+struct OpcodeEntry {
+  Mnemonic mnemonic;
+  Group group;
+  uint8_t attrs;
+  OperandKind operands[3];
+};
+
+struct OpcodeTable {
+  OpcodeEntry entries[256];
+};
+
+constexpr bool IsModRMOperand(OperandKind k) {
+  return k == K::kEb || k == K::kEv || k == K::kEw || k == K::kEd ||
+         k == K::kM || k == K::kGb || k == K::kGv || k == K::kSw;
+}
+
+constexpr OpcodeEntry Op(Mnemonic m, OperandKind a = K::kNone,
+                         OperandKind b = K::kNone, OperandKind c = K::kNone,
+                         uint8_t attrs = 0) {
+  if (IsModRMOperand(a) || IsModRMOperand(b) || IsModRMOperand(c)) {
+    attrs |= kAttrModRM;
+  }
+  return OpcodeEntry{m, kGroupNone, attrs, {a, b, c}};
+}
+
+constexpr OpcodeEntry Grp(Group g, OperandKind a, OperandKind b = K::kNone,
+                          uint8_t attrs = 0) {
+  return OpcodeEntry{M::kBAD, g, static_cast<uint8_t>(attrs | kAttrModRM),
+                     {a, b, K::kNone}};
+}
+
+constexpr OpcodeEntry Attr(uint8_t attrs) {
+  return OpcodeEntry{M::kBAD, kGroupNone, attrs, {K::kNone}};
+}
+
+constexpr Mnemonic kJccMnemonics[16] = {
+    M::kJO, M::kJNO, M::kJB, M::kJAE, M::kJE,  M::kJNE, M::kJBE, M::kJA,
+    M::kJS, M::kJNS, M::kJP, M::kJNP, M::kJL,  M::kJGE, M::kJLE, M::kJG,
+};
+
+// Intel SDM Vol.2 Table A-2. One-byte Opcode Map
+constexpr OpcodeTable BuildOneByteTable() {
+  OpcodeTable t{};
+  for (int i = 0; i < 256; i++) {
+    t.entries[i] = Attr(kAttrInvalid);
+  }
+  constexpr Mnemonic alu[8] = {M::kADD, M::kOR,  M::kADC, M::kSBB,
+                               M::kAND, M::kSUB, M::kXOR, M::kCMP};
+  for (int i = 0; i < 8; i++) {
+    OpcodeEntry *e = &t.entries[i * 8];
+    e[0] = Op(alu[i], K::kEb, K::kGb);
+    e[1] = Op(alu[i], K::kEv, K::kGv);
+    e[2] = Op(alu[i], K::kGb, K::kEb);
+    e[3] = Op(alu[i], K::kGv, K::kEv);
+    e[4] = Op(alu[i], K::kAL, K::kIb);
+    e[5] = Op(alu[i], K::kRAX, K::kIz);
+  }
+  t.entries[0x06] = Op(M::kPUSH, K::kES, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0x07] = Op(M::kPOP, K::kES, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0x0e] = Op(M::kPUSH, K::kCS, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0x0f] = Attr(kAttrEscape);
+  t.entries[0x16] = Op(M::kPUSH, K::kSS, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0x17] = Op(M::kPOP, K::kSS, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0x1e] = Op(M::kPUSH, K::kDS, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0x1f] = Op(M::kPOP, K::kDS, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0x26] = Attr(kAttrPrefix);
+  t.entries[0x27] = Op(M::kDAA, K::kNone, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0x2e] = Attr(kAttrPrefix);
+  t.entries[0x2f] = Op(M::kDAS, K::kNone, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0x36] = Attr(kAttrPrefix);
+  t.entries[0x37] = Op(M::kAAA, K::kNone, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0x3e] = Attr(kAttrPrefix);
+  t.entries[0x3f] = Op(M::kAAS, K::kNone, K::kNone, K::kNone, kAttrInvalid64);
+  for (int i = 0; i < 8; i++) {
+    // 0x40-0x4f are REX prefixes in 64bit mode
+    t.entries[0x40 + i] = Op(M::kINC, K::kZv);
+    t.entries[0x48 + i] = Op(M::kDEC, K::kZv);
+    t.entries[0x50 + i] =
+        Op(M::kPUSH, K::kZv, K::kNone, K::kNone, kAttrDefault64);
+    t.entries[0x58 + i] =
+        Op(M::kPOP, K::kZv, K::kNone, K::kNone, kAttrDefault64);
+  }
+  t.entries[0x60] =
+      Op(M::kPUSHA, K::kNone, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0x61] = Op(M::kPOPA, K::kNone, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0x62] = Op(M::kBOUND, K::kGv, K::kM, K::kNone, kAttrEscape);
+  t.entries[0x63] = Op(M::kARPL, K::kEw, K::kGv);  // MOVSXD in 64bit mode
+  t.entries[0x64] = Attr(kAttrPrefix);
+  t.entries[0x65] = Attr(kAttrPrefix);
+  t.entries[0x66] = Attr(kAttrPrefix);
+  t.entries[0x67] = Attr(kAttrPrefix);
+  t.entries[0x68] = Op(M::kPUSH, K::kIz, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0x69] = Op(M::kIMUL, K::kGv, K::kEv, K::kIz);
+  t.entries[0x6a] = Op(M::kPUSH, K::kIbs, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0x6b] = Op(M::kIMUL, K::kGv, K::kEv, K::kIbs);
+  t.entries[0x6c] = Op(M::kINS);
+  t.entries[0x6d] = Op(M::kINS);
+  t.entries[0x6e] = Op(M::kOUTS);
+  t.entries[0x6f] = Op(M::kOUTS);
+  for (int i = 0; i < 16; i++) {
+    t.entries[0x70 + i] =
+        Op(kJccMnemonics[i], K::kJb, K::kNone, K::kNone, kAttrDefault64);
+  }
+  t.entries[0x80] = Grp(kGroup1, K::kEb, K::kIb);
+  t.entries[0x81] = Grp(kGroup1, K::kEv, K::kIz);
+  t.entries[0x82] = Grp(kGroup1, K::kEb, K::kIb, kAttrInvalid64);
+  t.entries[0x83] = Grp(kGroup1, K::kEv, K::kIbs);
+  t.entries[0x84] = Op(M::kTEST, K::kEb, K::kGb);
+  t.entries[0x85] = Op(M::kTEST, K::kEv, K::kGv);
+  t.entries[0x86] = Op(M::kXCHG, K::kEb, K::kGb);
+  t.entries[0x87] = Op(M::kXCHG, K::kEv, K::kGv);
+  t.entries[0x88] = Op(M::kMOV, K::kEb, K::kGb);
+  t.entries[0x89] = Op(M::kMOV, K::kEv, K::kGv);
+  t.entries[0x8a] = Op(M::kMOV, K::kGb, K::kEb);
+  t.entries[0x8b] = Op(M::kMOV, K::kGv, K::kEv);
+  t.entries[0x8c] = Op(M::kMOV, K::kEv, K::kSw);
+  t.entries[0x8d] = Op(M::kLEA, K::kGv, K::kM);
+  t.entries[0x8e] = Op(M::kMOV, K::kSw, K::kEw);
+  t.entries[0x8f] = Grp(kGroup1A, K::kEv, K::kNone, kAttrDefault64);
+  t.entries[0x90] = Op(M::kNOP);
+  for (int i = 1; i < 8; i++) {
+    t.entries[0x90 + i] = Op(M::kXCHG, K::kZv, K::kRAX);
+  }
+  t.entries[0x98] = Op(M::kCBW);
+  t.entries[0x99] = Op(M::kCWD);
+  t.entries[0x9a] = Op(M::kCALLF, K::kAp, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0x9b] = Op(M::kFWAIT);
+  t.entries[0x9c] = Op(M::kPUSHF, K::kNone, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0x9d] = Op(M::kPOPF, K::kNone, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0x9e] = Op(M::kSAHF);
+  t.entries[0x9f] = Op(M::kLAHF);
+  t.entries[0xa0] = Op(M::kMOV, K::kAL, K::kOb);
+  t.entries[0xa1] = Op(M::kMOV, K::kRAX, K::kOv);
+  t.entries[0xa2] = Op(M::kMOV, K::kOb, K::kAL);
+  t.entries[0xa3] = Op(M::kMOV, K::kOv, K::kRAX);
+  t.entries[0xa4] = Op(M::kMOVS);
+  t.entries[0xa5] = Op(M::kMOVS);
+  t.entries[0xa6] = Op(M::kCMPS);
+  t.entries[0xa7] = Op(M::kCMPS);
+  t.entries[0xa8] = Op(M::kTEST, K::kAL, K::kIb);
+  t.entries[0xa9] = Op(M::kTEST, K::kRAX, K::kIz);
+  t.entries[0xaa] = Op(M::kSTOS);
+  t.entries[0xab] = Op(M::kSTOS);
+  t.entries[0xac] = Op(M::kLODS);
+  t.entries[0xad] = Op(M::kLODS);
+  t.entries[0xae] = Op(M::kSCAS);
+  t.entries[0xaf] = Op(M::kSCAS);
+  for (int i = 0; i < 8; i++) {
+    t.entries[0xb0 + i] = Op(M::kMOV, K::kZb, K::kIb);
+    t.entries[0xb8 + i] = Op(M::kMOV, K::kZv, K::kIv);
+  }
+  t.entries[0xc0] = Grp(kGroup2, K::kEb, K::kIb);
+  t.entries[0xc1] = Grp(kGroup2, K::kEv, K::kIb);
+  t.entries[0xc2] = Op(M::kRET, K::kIw, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xc3] = Op(M::kRET, K::kNone, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xc4] = Op(M::kLES, K::kGv, K::kM, K::kNone, kAttrEscape);
+  t.entries[0xc5] = Op(M::kLDS, K::kGv, K::kM, K::kNone, kAttrEscape);
+  t.entries[0xc6] = Grp(kGroup11, K::kEb, K::kIb);
+  t.entries[0xc7] = Grp(kGroup11, K::kEv, K::kIz);
+  t.entries[0xc8] = Op(M::kENTER, K::kIw, K::kIb, K::kNone, kAttrDefault64);
+  t.entries[0xc9] = Op(M::kLEAVE, K::kNone, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xca] = Op(M::kRETF, K::kIw);
+  t.entries[0xcb] = Op(M::kRETF);
+  t.entries[0xcc] = Op(M::kINT3);
+  t.entries[0xcd] = Op(M::kINT, K::kIb);
+  t.entries[0xce] = Op(M::kINTO, K::kNone, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0xcf] = Op(M::kIRET);
+  t.entries[0xd0] = Grp(kGroup2, K::kEb, K::kOne);
+  t.entries[0xd1] = Grp(kGroup2, K::kEv, K::kOne);
+  t.entries[0xd2] = Grp(kGroup2, K::kEb, K::kCL);
+  t.entries[0xd3] = Grp(kGroup2, K::kEv, K::kCL);
+  t.entries[0xd4] = Op(M::kAAM, K::kIb, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0xd5] = Op(M::kAAD, K::kIb, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0xd6] = Op(M::kSALC, K::kNone, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0xd7] = Op(M::kXLAT);
+  for (int i = 0; i < 8; i++) {
+    t.entries[0xd8 + i] = Op(M::kFPU, K::kNone, K::kNone, K::kNone, kAttrModRM);
+  }
+  t.entries[0xe0] = Op(M::kLOOPNE, K::kJb, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xe1] = Op(M::kLOOPE, K::kJb, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xe2] = Op(M::kLOOP, K::kJb, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xe3] = Op(M::kJRCXZ, K::kJb, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xe4] = Op(M::kIN, K::kAL, K::kIb);
+  t.entries[0xe5] = Op(M::kIN, K::kRAX, K::kIb);
+  t.entries[0xe6] = Op(M::kOUT, K::kIb, K::kAL);
+  t.entries[0xe7] = Op(M::kOUT, K::kIb, K::kRAX);
+  t.entries[0xe8] = Op(M::kCALL, K::kJz, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xe9] = Op(M::kJMP, K::kJz, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xea] = Op(M::kJMPF, K::kAp, K::kNone, K::kNone, kAttrInvalid64);
+  t.entries[0xeb] = Op(M::kJMP, K::kJb, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xec] = Op(M::kIN, K::kAL, K::kDX);
+  t.entries[0xed] = Op(M::kIN, K::kRAX, K::kDX);
+  t.entries[0xee] = Op(M::kOUT, K::kDX, K::kAL);
+  t.entries[0xef] = Op(M::kOUT, K::kDX, K::kRAX);
+  t.entries[0xf0] = Attr(kAttrPrefix);
+  t.entries[0xf1] = Op(M::kINT1);
+  t.entries[0xf2] = Attr(kAttrPrefix);
+  t.entries[0xf3] = Attr(kAttrPrefix);
+  t.entries[0xf4] = Op(M::kHLT);
+  t.entries[0xf5] = Op(M::kCMC);
+  t.entries[0xf6] = Grp(kGroup3, K::kEb);
+  t.entries[0xf7] = Grp(kGroup3, K::kEv);
+  t.entries[0xf8] = Op(M::kCLC);
+  t.entries[0xf9] = Op(M::kSTC);
+  t.entries[0xfa] = Op(M::kCLI);
+  t.entries[0xfb] = Op(M::kSTI);
+  t.entries[0xfc] = Op(M::kCLD);
+  t.entries[0xfd] = Op(M::kSTD);
+  t.entries[0xfe] = Grp(kGroup4, K::kEb);
+  t.entries[0xff] = Grp(kGroup5, K::kEv);
+  return t;
+}
+
+// Intel SDM Vol.2 Table A-3. Two-byte Opcode Map (0F xx)
+// Entries without a dedicated mnemonic are decoded as Mnemonic::kOTHER with
+// the correct ModRM and immediate layout.
+constexpr OpcodeTable Build0FTable() {
+  OpcodeTable t{};
+  const OpcodeEntry modrm = Op(M::kOTHER, K::kNone, K::kNone, K::kNone,
+                               kAttrModRM);
+  const OpcodeEntry modrm_ib =
+      Op(M::kOTHER, K::kIb, K::kNone, K::kNone, kAttrModRM);
+  const OpcodeEntry none = Op(M::kOTHER);
+  for (int i = 0; i < 256; i++) {
+    t.entries[i] = modrm;
+  }
+  t.entries[0x04] = Attr(kAttrInvalid);
+  t.entries[0x05] = Op(M::kSYSCALL);
+  t.entries[0x06] = none;  // CLTS
+  t.entries[0x07] = Op(M::kSYSRET);
+  t.entries[0x08] = none;  // INVD
+  t.entries[0x09] = none;  // WBINVD
+  t.entries[0x0a] = Attr(kAttrInvalid);
+  t.entries[0x0b] = Op(M::kUD2);
+  t.entries[0x0c] = Attr(kAttrInvalid);
+  t.entries[0x0e] = none;      // FEMMS
+  t.entries[0x0f] = modrm_ib;  // 3DNow! (imm8 is the opcode suffix)
+  t.entries[0x1f] = Op(M::kNOP, K::kEv);
+  for (int i = 0x30; i < 0x38; i++) {
+    t.entries[i] = none;  // WRMSR, RDTSC, RDMSR, RDPMC, SYSENTER, ...
+  }
+  t.entries[0x31] = Op(M::kRDTSC);
+  t.entries[0x36] = Attr(kAttrInvalid);
+  t.entries[0x38] = Attr(kAttrEscape);
+  t.entries[0x39] = Attr(kAttrInvalid);
+  t.entries[0x3a] = Attr(kAttrEscape);
+  for (int i = 0x3b; i < 0x40; i++) {
+    t.entries[i] = Attr(kAttrInvalid);
+  }
+  for (int i = 0; i < 16; i++) {
+    t.entries[0x40 + i] = Op(M::kCMOVCC, K::kGv, K::kEv);
+    t.entries[0x80 + i] =
+        Op(kJccMnemonics[i], K::kJz, K::kNone, K::kNone, kAttrDefault64);
+    t.entries[0x90 + i] = Op(M::kSETCC, K::kEb);
+  }
+  for (int i = 0x70; i < 0x74; i++) {
+    t.entries[i] = modrm_ib;  // PSHUFx, Group 12-14
+  }
+  t.entries[0x77] = none;  // EMMS
+  t.entries[0xa0] = Op(M::kPUSH, K::kFS, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xa1] = Op(M::kPOP, K::kFS, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xa2] = Op(M::kCPUID);
+  t.entries[0xa3] = Op(M::kBT, K::kEv, K::kGv);
+  t.entries[0xa4] = Op(M::kSHLD, K::kEv, K::kGv, K::kIb);
+  t.entries[0xa5] = Op(M::kSHLD, K::kEv, K::kGv, K::kCL);
+  t.entries[0xa6] = Attr(kAttrInvalid);
+  t.entries[0xa7] = Attr(kAttrInvalid);
+  t.entries[0xa8] = Op(M::kPUSH, K::kGS, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xa9] = Op(M::kPOP, K::kGS, K::kNone, K::kNone, kAttrDefault64);
+  t.entries[0xaa] = none;  // RSM
+  t.entries[0xab] = Op(M::kBTS, K::kEv, K::kGv);
+  t.entries[0xac] = Op(M::kSHRD, K::kEv, K::kGv, K::kIb);
+  t.entries[0xad] = Op(M::kSHRD, K::kEv, K::kGv, K::kCL);
+  t.entries[0xaf] = Op(M::kIMUL, K::kGv, K::kEv);
+  t.entries[0xb0] = Op(M::kCMPXCHG, K::kEb, K::kGb);
+  t.entries[0xb1] = Op(M::kCMPXCHG, K::kEv, K::kGv);
+  t.entries[0xb3] = Op(M::kBTR, K::kEv, K::kGv);
+  t.entries[0xb6] = Op(M::kMOVZX, K::kGv, K::kEb);
+  t.entries[0xb7] = Op(M::kMOVZX, K::kGv, K::kEw);
+  t.entries[0xba] = Grp(kGroup8, K::kEv, K::kIb);
+  t.entries[0xbb] = Op(M::kBTC, K::kEv, K::kGv);
+  t.entries[0xbc] = Op(M::kBSF, K::kGv, K::kEv);
+  t.entries[0xbd] = Op(M::kBSR, K::kGv, K::kEv);
+  t.entries[0xbe] = Op(M::kMOVSX, K::kGv, K::kEb);
+  t.entries[0xbf] = Op(M::kMOVSX, K::kGv, K::kEw);
+  t.entries[0xc0] = Op(M::kXADD, K::kEb, K::kGb);
+  t.entries[0xc1] = Op(M::kXADD, K::kEv, K::kGv);
+  t.entries[0xc2] = modrm_ib;  // CMPPS
+  t.entries[0xc4] = modrm_ib;  // PINSRW
+  t.entries[0xc5] = modrm_ib;  // PEXTRW
+  t.entries[0xc6] = modrm_ib;  // SHUFPS
+  for (int i = 0; i < 8; i++) {
+    t.entries[0xc8 + i] = Op(M::kBSWAP, K::kZv);
+  }
+  return t;
+}
+
+// Table A-4. Three-byte Opcode Map (0F 38 xx): ModRM, no immediate
+// Table A-5. Three-byte Opcode Map (0F 3A xx): ModRM and imm8
+constexpr OpcodeTable BuildThreeByteTable(bool has_imm8) {
+  OpcodeTable t{};
+  for (int i = 0; i < 256; i++) {
+    t.entries[i] = Op(M::kOTHER, has_imm8 ? K::kIb : K::kNone, K::kNone,
+                      K::kNone, kAttrModRM);
+  }
+  return t;
+}
+
+constexpr OpcodeTable kOneByteTable = BuildOneByteTable();
+constexpr OpcodeTable k0FTable = Build0FTable();
+constexpr OpcodeTable k0F38Table = BuildThreeByteTable(false);
+constexpr OpcodeTable k0F3ATable = BuildThreeByteTable(true);
+
+// Mnemonics selected by ModRM.reg
+constexpr Mnemonic kGroupMnemonics[kNumOfGroups][8] = {
+    {},
+    {M::kADD, M::kOR, M::kADC, M::kSBB, M::kAND, M::kSUB, M::kXOR, M::kCMP},
+    {M::kPOP, M::kBAD, M::kBAD, M::kBAD, M::kBAD, M::kBAD, M::kBAD, M::kBAD},
+    {M::kROL, M::kROR, M::kRCL, M::kRCR, M::kSHL, M::kSHR, M::kSHL, M::kSAR},
+    {M::kTEST, M::kTEST, M::kNOT, M::kNEG, M::kMUL, M::kIMUL, M::kDIV,
+     M::kIDIV},
+    {M::kINC, M::kDEC, M::kBAD, M::kBAD, M::kBAD, M::kBAD, M::kBAD, M::kBAD},
+    {M::kINC, M::kDEC, M::kCALL, M::kCALLF, M::kJMP, M::kJMPF, M::kPUSH,
+     M::kBAD},
+    {M::kBAD, M::kBAD, M::kBAD, M::kBAD, M::kBT, M::kBTS, M::kBTR, M::kBTC},
+    {M::kMOV, M::kBAD, M::kBAD, M::kBAD, M::kBAD, M::kBAD, M::kBAD, M::kBAD},
+};
+
+constexpr const char *kMnemonicNames[] = {
+#define MUIMSA_MNEMONIC_NAME(name, str) str,
+    MUIMSA_MNEMONICS(MUIMSA_MNEMONIC_NAME)
+#undef MUIMSA_MNEMONIC_NAME
+};
+
+constexpr size_t kMaxInstrLength = 15;
+
+size_t DecodeAsBad(const uint8_t *p, Instr *instr) {
+  *instr = Instr{};
+  instr->length = 1;
+  instr->opcode = p[0];
+  instr->mnemonic = M::kBAD;
+  instr->flags = kInstrInvalid;
+  return 1;
+}
+
+int GetImmSize(OperandKind k, const Instr &instr, CPUMode mode) {
+  switch (k) {
+  case K::kIb:
+  case K::kIbs:
+  case K::kJb:
+    return 1;
+  case K::kIw:
+    return 2;
+  case K::kIz:
+    return instr.operand_size == 2 ? 2 : 4;
+  case K::kIv:
+    return instr.operand_size;
+  case K::kJz:
+    return (mode != CPUMode::k64 && instr.operand_size == 2) ? 2 : 4;
+  case K::kOb:
+  case K::kOv:
+    return instr.address_size;
+  case K::kAp:
+    return instr.operand_size == 2 ? 4 : 6;
+  default:
+    return 0;
+  }
+}
+
+uint64_t ReadLE(const uint8_t *p, int size) {
+  uint64_t v = 0;
+  for (int i = 0; i < size; i++) {
+    v |= static_cast<uint64_t>(p[i]) << (i * 8);
+  }
+  return v;
+}
+
+int64_t SignExtend(uint64_t v, int size) {
+  if (size >= 8) {
+    return static_cast<int64_t>(v);
+  }
+  int shift = 64 - size * 8;
+  return static_cast<int64_t>(v << shift) >> shift;
+}
+
+}  // namespace
+
+const char *GetMnemonicName(Mnemonic mnemonic) {
+  return kMnemonicNames[static_cast<int>(mnemonic)];
+}
+
+size_t Decode(const uint8_t *p, size_t size, CPUMode mode, Instr *instr) {
+  if (size == 0) {
+    return 0;
+  }
+  *instr = Instr{};
+  const size_t limit = size < kMaxInstrLength ? size : kMaxInstrLength;
+  const int default_size = mode == CPUMode::k16 ? 2 : 4;
+  size_t i = 0;
+
+  // Legacy prefixes
+  for (; i < limit && (kOneByteTable.entries[p[i]].attrs & kAttrPrefix);
+       i++) {
+    switch (p[i]) {
+    case 0xf0:
+      instr->prefixes |= kPrefixLock;
+      break;
+    case 0xf2:
+      instr->prefixes = (instr->prefixes & ~kPrefixRep) | kPrefixRepne;
+      break;
+    case 0xf3:
+      instr->prefixes = (instr->prefixes & ~kPrefixRepne) | kPrefixRep;
+      break;
+    case 0x66:
+      instr->prefixes |= kPrefixOpSize;
+      break;
+    case 0x67:
+      instr->prefixes |= kPrefixAddrSize;
+      break;
+    case 0x26:
+      instr->segment = 1;
+      break;
+    case 0x2e:
+      instr->segment = 2;
+      break;
+    case 0x36:
+      instr->segment = 3;
+      break;
+    case 0x3e:
+      instr->segment = 4;
+      break;
+    case 0x64:
+      instr->segment = 5;
+      break;
+    case 0x65:
+      instr->segment = 6;
+      break;
+    }
+  }
+  // REX (must be just before the opcode)
+  if (mode == CPUMode::k64 && i < limit && (p[i] & 0xf0) == 0x40) {
+    instr->rex = p[i++];
+  }
+  instr->num_of_prefixes = i;
+  if (i >= limit) {
+    return DecodeAsBad(p, instr);
+  }
+
+  if (mode == CPUMode::k64) {
+    instr->operand_size =
+        (instr->rex & 0x08) ? 8 : (instr->prefixes & kPrefixOpSize) ? 2 : 4;
+    instr->address_size = (instr->prefixes & kPrefixAddrSize) ? 4 : 8;
+  } else {
+    instr->operand_size = (instr->prefixes & kPrefixOpSize)
+                              ? (6 - default_size)
+                              : default_size;
+    instr->address_size = (instr->prefixes & kPrefixAddrSize)
+                              ? (6 - default_size)
+                              : default_size;
+  }
+
+  uint8_t op = p[i++];
+  const OpcodeEntry *entry = &kOneByteTable.entries[op];
+  instr->map = OpcodeMap::kOneByte;
+  if (entry->attrs & kAttrPrefix) {
+    // a legacy prefix after REX
+    return DecodeAsBad(p, instr);
+  }
+  if (entry->attrs & kAttrEscape) {
+    if (op == 0x0f) {
+      if (i >= limit) {
+        return DecodeAsBad(p, instr);
+      }
+      op = p[i++];
+      instr->map = OpcodeMap::k0F;
+      entry = &k0FTable.entries[op];
+      if (op == 0x38 || op == 0x3a) {
+        if (i >= limit) {
+          return DecodeAsBad(p, instr);
+        }
+        instr->map = op == 0x38 ? OpcodeMap::k0F38 : OpcodeMap::k0F3A;
+        entry = op == 0x38 ? &k0F38Table.entries[p[i]]
+                           : &k0F3ATable.entries[p[i]];
+        op = p[i++];
+      }
+    } else if (i < limit &&
+               (mode == CPUMode::k64 || (p[i] & 0xc0) == 0xc0)) {
+      // VEX (C4, C5) or EVEX (62). Outside of 64bit mode, these are LES,
+      // LDS and BOUND unless the next byte looks like a register ModRM.
+      size_t payload = op == 0xc5 ? 1 : op == 0xc4 ? 2 : 3;
+      if (instr->rex || i + payload >= limit) {
+        return DecodeAsBad(p, instr);
+      }
+      int vex_map = op == 0xc5 ? 1 : (p[i] & (op == 0x62 ? 0x07 : 0x1f));
+      bool w = op == 0xc4 ? (p[i + 1] & 0x80) : op == 0x62 && (p[i + 1] & 0x80);
+      instr->map = op == 0x62 ? OpcodeMap::kEVEX : OpcodeMap::kVEX;
+      i += payload;
+      op = p[i++];
+      if (vex_map == 1) {
+        entry = &k0FTable.entries[op];
+      } else if (vex_map == 2) {
+        entry = &k0F38Table.entries[op];
+      } else if (vex_map == 3) {
+        entry = &k0F3ATable.entries[op];
+      } else if (instr->map == OpcodeMap::kEVEX &&
+                 (vex_map == 5 || vex_map == 6)) {
+        entry = &k0F38Table.entries[op];  // AVX512-FP16 maps
+      } else {
+        return DecodeAsBad(p, instr);
+      }
+      if (mode == CPUMode::k64 && w) {
+        instr->operand_size = 8;
+      }
+    }
+  }
+  instr->opcode = op;
+  if ((entry->attrs & kAttrInvalid) ||
+      (mode == CPUMode::k64 && (entry->attrs & kAttrInvalid64))) {
+    return DecodeAsBad(p, instr);
+  }
+  if (mode == CPUMode::k64 && (entry->attrs & kAttrDefault64) &&
+      instr->operand_size == 4) {
+    instr->operand_size = 8;
+  }
+  instr->mnemonic = entry->mnemonic;
+  instr->operands[0] = entry->operands[0];
+  instr->operands[1] = entry->operands[1];
+  instr->operands[2] = entry->operands[2];
+
+  bool has_modrm = entry->attrs & kAttrModRM;
+  if (instr->map == OpcodeMap::kVEX || instr->map == OpcodeMap::kEVEX) {
+    // VZEROUPPER / VZEROALL have no ModRM. All others do.
+    has_modrm = !(instr->map == OpcodeMap::kVEX && op == 0x77 &&
+                  entry == &k0FTable.entries[0x77]);
+    instr->mnemonic = M::kOTHER;
+    instr->operands[0] = entry->operands[0] == K::kIb ? K::kIb : K::kNone;
+    instr->operands[1] = K::kNone;
+    instr->operands[2] = K::kNone;
+  } else if (mode == CPUMode::k64 && instr->map == OpcodeMap::kOneByte &&
+             op == 0x63) {
+    instr->mnemonic = M::kMOVSXD;
+    instr->operands[0] = K::kGv;
+    instr->operands[1] = K::kEd;
+  }
+
+  if (has_modrm) {
+    if (i >= limit) {
+      return DecodeAsBad(p, instr);
+    }
+    instr->modrm = p[i++];
+    instr->flags |= kInstrHasModRM;
+    ModRM modrm(instr->modrm);
+    if (modrm.HasSIB(instr->address_size)) {
+      if (i >= limit) {
+        return DecodeAsBad(p, instr);
+      }
+      instr->sib = p[i++];
+      instr->flags |= kInstrHasSIB;
+    }
+    instr->disp_size = modrm.GetNumOfDispBytes(instr->address_size, instr->sib);
+    if (instr->address_size != 2 && instr->GetMod() == 0 &&
+        instr->GetRM() == 5 && mode == CPUMode::k64) {
+      instr->flags |= kInstrRIPRelative;
+    }
+    if (i + instr->disp_size > limit) {
+      return DecodeAsBad(p, instr);
+    }
+    instr->disp =
+        SignExtend(ReadLE(&p[i], instr->disp_size), instr->disp_size);
+    i += instr->disp_size;
+    if (instr->GetMod() == 3 &&
+        (instr->operands[0] == K::kM || instr->operands[1] == K::kM)) {
+      return DecodeAsBad(p, instr);  // LEA, LES, ... require memory
+    }
+  }
+
+  if (entry->group != kGroupNone) {
+    instr->mnemonic = kGroupMnemonics[entry->group][instr->GetReg()];
+    if (entry->group == kGroup11 && instr->modrm == 0xf8) {
+      // XABORT Ib / XBEGIN Jz
+      bool is_xabort = entry->operands[0] == K::kEb;
+      instr->mnemonic = is_xabort ? M::kXABORT : M::kXBEGIN;
+      instr->operands[0] = is_xabort ? K::kIb : K::kJz;
+      instr->operands[1] = K::kNone;
+    }
+    if (instr->mnemonic == M::kBAD) {
+      return DecodeAsBad(p, instr);
+    }
+    if (entry->group == kGroup3 && instr->GetReg() < 2) {
+      // TEST Eb, Ib / TEST Ev, Iz
+      instr->operands[1] = entry->operands[0] == K::kEb ? K::kIb : K::kIz;
+    }
+    if (entry->group == kGroup5 && mode == CPUMode::k64 &&
+        (instr->GetReg() == 2 || instr->GetReg() == 4 ||
+         instr->GetReg() == 6) &&
+        instr->operand_size == 4) {
+      instr->operand_size = 8;  // near CALL, JMP and PUSH
+    }
+    if (entry->group == kGroup5 &&
+        (instr->GetReg() == 3 || instr->GetReg() == 5)) {
+      if (instr->GetMod() == 3) {
+        return DecodeAsBad(p, instr);
+      }
+      instr->operands[0] = K::kM;
+    }
+  }
+
+  // Immediates
+  for (int n = 0; n < 3; n++) {
+    int imm_size = GetImmSize(instr->operands[n], *instr, mode);
+    if (!imm_size) {
+      continue;
+    }
+    if (i + imm_size > limit) {
+      return DecodeAsBad(p, instr);
+    }
+    if (instr->imm_size) {
+      instr->imm2 = p[i];  // ENTER Iw, Ib
+    } else {
+      instr->imm = ReadLE(&p[i], imm_size);
+      instr->imm_size = imm_size;
+    }
+    i += imm_size;
+  }
+
+  if (instr->map == OpcodeMap::k0F && op == 0x1e && instr->modrm == 0xfa &&
+      (instr->prefixes & kPrefixRep)) {
+    instr->mnemonic = M::kENDBR64;
+    instr->operands[0] = K::kNone;
+  }
+  instr->length = i;
+  return i;
+}
+
+uint64_t GetBranchTarget(const Instr &instr, uint64_t addr) {
+  return addr + instr.length + SignExtend(instr.imm, instr.imm_size);
+}
+
+//
+// Length decoder
+//
+
+namespace {
+
+// LengthInfo::flags
+enum : uint8_t {
+  kLenModRM = 1,
+  kLenPrefix = 2,
+  kLenEscape0F = 4,
+  kLenSlow = 8,  // needs full Decode() (VEX, EVEX, LES, LDS, BOUND, ...)
+  kLenInvalid = 16,
+  kLenInvalid64 = 32,
+  kLenGroup3 = 64,  // immediate only for ModRM.reg 0 and 1 (TEST)
+};
+
+// LengthInfo::imm
+enum : uint8_t {
+  kImmNone,
+  kImm1,
+  kImm2,
+  kImmIwIb,
+  kImmZ,
+  kImmV,
+  kImmJz,
+  kImmMoffs,
+  kImmAp,
+};
+
+// Per-opcode length class. Derived from the opcode tables above so that
+// DecodeLength() always agrees with Decode().
+struct LengthInfo {
+  uint8_t flags;
+  uint8_t imm;
+  uint8_t valid_regs;     // ModRM.reg values which are defined
+  uint8_t mem_only_regs;  // ModRM.reg values which require mod != 0b11
+};
+
+struct LengthTable {
+  LengthInfo entries[256];
+};
+
+constexpr uint8_t GetImmClass(const OpcodeEntry &e) {
+  bool has_ib = false;
+  bool has_iw = false;
+  uint8_t imm = kImmNone;
+  for (int n = 0; n < 3; n++) {
+    switch (e.operands[n]) {
+    case K::kIb:
+    case K::kIbs:
+    case K::kJb:
+      has_ib = true;
+      imm = kImm1;
+      break;
+    case K::kIw:
+      has_iw = true;
+      imm = kImm2;
+      break;
+    case K::kIz:
+      imm = kImmZ;
+      break;
+    case K::kIv:
+      imm = kImmV;
+      break;
+    case K::kJz:
+      imm = kImmJz;
+      break;
+    case K::kOb:
+    case K::kOv:
+      imm = kImmMoffs;
+      break;
+    case K::kAp:
+      imm = kImmAp;
+      break;
+    default:
+      break;
+    }
+  }
+  return (has_ib && has_iw) ? kImmIwIb : imm;
+}
+
+constexpr LengthTable BuildLengthTable(const OpcodeTable &t) {
+  LengthTable lt{};
+  for (int i = 0; i < 256; i++) {
+    const OpcodeEntry &e = t.entries[i];
+    LengthInfo &li = lt.entries[i];
+    li.flags = ((e.attrs & kAttrModRM) ? kLenModRM : 0) |
+               ((e.attrs & kAttrPrefix) ? kLenPrefix : 0) |
+               ((e.attrs & kAttrInvalid) ? kLenInvalid : 0) |
+               ((e.attrs & kAttrInvalid64) ? kLenInvalid64 : 0);
+    if (e.attrs & kAttrEscape) {
+      li.flags |= (&t == &kOneByteTable && i == 0x0f) ? kLenEscape0F
+                                                       : kLenSlow;
+    }
+    li.imm = GetImmClass(e);
+    li.valid_regs = 0xff;
+    if (e.group != kGroupNone) {
+      li.valid_regs = 0;
+      for (int reg = 0; reg < 8; reg++) {
+        if (kGroupMnemonics[e.group][reg] != M::kBAD) {
+          li.valid_regs |= 1 << reg;
+        }
+      }
+      if (e.group == kGroup3) {
+        li.flags |= kLenGroup3;
+        li.imm = e.operands[0] == K::kEb ? kImm1 : kImmZ;
+      }
+      if (e.group == kGroup5) {
+        li.mem_only_regs = (1 << 3) | (1 << 5);  // CALLF, JMPF
+      }
+    }
+    for (int n = 0; n < 3; n++) {
+      if (e.operands[n] == K::kM) {
+        li.mem_only_regs = 0xff;
+      }
+    }
+  }
+  return lt;
+}
+
+constexpr LengthTable kOneByteLengthTable = BuildLengthTable(kOneByteTable);
+constexpr LengthTable k0FLengthTable = BuildLengthTable(k0FTable);
+constexpr LengthTable k0F38LengthTable = BuildLengthTable(k0F38Table);
+constexpr LengthTable k0F3ALengthTable = BuildLengthTable(k0F3ATable);
+
+// Fast path tables for the common case in 32bit mode: no legacy prefix, a
+// one-byte or 0F opcode without ModRM.reg dependent decoding. 0 means "use
+// DecodeLengthGeneral()".
+enum : uint8_t {
+  kFastLengthMask = 0x0f,  // last opcode byte + immediate bytes
+  kFastModRM = 0x10,
+  kFastMemOnly = 0x40,  // mod == 0b11 is undefined (LEA)
+};
+
+struct FastLengthTable {
+  uint8_t entries[256];
+};
+
+constexpr FastLengthTable BuildFastLengthTable(const LengthTable &lt) {
+  FastLengthTable ft{};
+  for (int i = 0; i < 256; i++) {
+    const LengthInfo &li = lt.entries[i];
+    if ((li.flags & (kLenPrefix | kLenEscape0F | kLenSlow | kLenInvalid |
+                     kLenGroup3)) ||
+        li.valid_regs != 0xff ||
+        (li.mem_only_regs != 0 && li.mem_only_regs != 0xff)) {
+      continue;
+    }
+    int imm = 0;
+    switch (li.imm) {
+    case kImmNone:
+      break;
+    case kImm1:
+      imm = 1;
+      break;
+    case kImm2:
+      imm = 2;
+      break;
+    case kImmIwIb:
+      imm = 3;
+      break;
+    case kImmZ:
+    case kImmV:
+    case kImmJz:
+      imm = 4;
+      break;
+    default:
+      continue;  // moffs and far pointers
+    }
+    ft.entries[i] = static_cast<uint8_t>(
+        (1 + imm) | ((li.flags & kLenModRM) ? kFastModRM : 0) |
+        (li.mem_only_regs ? kFastMemOnly : 0));
+  }
+  return ft;
+}
+
+constexpr FastLengthTable kFastOneByteTable32 =
+    BuildFastLengthTable(kOneByteLengthTable);
+constexpr FastLengthTable kFast0FTable = BuildFastLengthTable(k0FLengthTable);
+
+// Bytes taken by ModRM, SIB and displacement with 32 / 64bit addressing.
+// 0x80 is set if the SIB base may need an extra disp32 (mod == 0b00).
+struct ModRMLengthTable {
+  uint8_t entries[256];
+};
+
+constexpr ModRMLengthTable BuildModRMLengthTable() {
+  ModRMLengthTable t{};
+  for (int i = 0; i < 256; i++) {
+    const ModRM modrm(static_cast<uint8_t>(i));
+    bool has_sib = modrm.HasSIB(4);
+    t.entries[i] = static_cast<uint8_t>(1 + has_sib +
+                                        modrm.GetNumOfDispBytes(4, 0));
+    if (has_sib && (i >> 6) == 0) {
+      t.entries[i] |= 0x80;
+    }
+  }
+  return t;
+}
+
+constexpr ModRMLengthTable kModRMLengthTable = BuildModRMLengthTable();
+
+// Fast path of DecodeLength() in 32bit mode. p must have at least
+// kMaxInstrLength bytes. Returns 0 if the instruction needs
+// DecodeLengthGeneral().
+// Written without data dependent branches: the loop around this is bound by
+// the latency of "offset -> opcode -> table -> length -> offset", and a
+// mispredicted branch would cost more than computing both sides.
+inline size_t DecodeLengthFast32(const uint8_t *p) {
+  const size_t is_0f = p[0] == 0x0f;
+  const uint8_t op = p[is_0f];
+  const uint8_t info = is_0f ? kFast0FTable.entries[op]
+                             : kFastOneByteTable32.entries[op];
+  if (!info) {
+    return 0;
+  }
+  const size_t opcode_end = is_0f + 1;
+  const uint8_t modrm = p[opcode_end];
+  const uint8_t sib = p[opcode_end + 1];
+  const uint8_t modrm_info = kModRMLengthTable.entries[modrm];
+  if ((info & kFastMemOnly) && modrm >= 0xc0) {
+    return 0;
+  }
+  const size_t sib_disp = ((modrm_info >> 7) & ((sib & 7) == 5)) << 2;
+  const size_t modrm_len = ((modrm_info & 0x7f) + sib_disp) &
+                           -static_cast<size_t>((info >> 4) & 1);
+  return is_0f + (info & kFastLengthMask) + modrm_len;
+}
+
+// Length table for 64bit mode with a single lookup keyed by the opcode byte
+// of a map and the byte after it (ModRM), which also settles the ModRM.reg
+// dependent cases (groups, TEST immediates, LEA with mod == 0b11). Entries
+// are the bytes from the opcode byte to the end of the immediate with a
+// 32bit operand size, and 0 for DecodeLengthGeneral().
+enum : uint8_t {
+  kLen64Mask = 0x0f,
+  kLen64SIBDisp = 0x10,  // SIB with mod == 0b00: disp32 if SIB.base is 5
+  kLen64ImmZ = 0x20,     // imm32 becomes imm16 with 66 (without REX.W)
+  kLen64ImmV = 0x40,     // imm32 becomes imm64 with REX.W (MOV r64, imm64)
+};
+
+// one-byte, 0F, 0F38, 0F3A, then VEX maps 1 (0F), 2 (0F38) and 3 (0F3A)
+constexpr int kNumOfLengthMaps = 7;
+constexpr int kVEXLengthMapBase = 3;
+
+struct LengthTable64 {
+  uint8_t entries[kNumOfLengthMaps][256][256];  // [map][opcode][ModRM]
+};
+
+uint8_t BuildLength64Entry(const LengthInfo &li, int map, int op,
+                           uint8_t modrm_byte) {
+  if ((li.flags & (kLenPrefix | kLenEscape0F | kLenSlow | kLenInvalid |
+                   kLenInvalid64)) ||
+      (map == 0 && ((op & 0xf0) == 0x40 || op == 0xc4 || op == 0xc5))) {
+    return 0;  // REX and VEX are only taken before the opcode
+  }
+  int len = 1;
+  uint8_t flags = 0;
+  const uint8_t reg = (modrm_byte >> 3) & 7;
+  if (li.flags & kLenModRM) {
+    const ModRM modrm(modrm_byte);
+    if (!(li.valid_regs & (1 << reg)) ||
+        ((li.mem_only_regs & (1 << reg)) && modrm_byte >= 0xc0)) {
+      return 0;
+    }
+    len += 1 + modrm.HasSIB(8) + modrm.GetNumOfDispBytes(8, 0);
+    if (modrm.HasSIB(8) && (modrm_byte >> 6) == 0) {
+      flags |= kLen64SIBDisp;
+    }
+  }
+  const bool has_group3_imm = !(li.flags & kLenGroup3) || reg < 2;
+  switch (li.imm) {
+  case kImmNone:
+    break;
+  case kImm1:
+    len += has_group3_imm;
+    break;
+  case kImm2:
+    len += 2;
+    break;
+  case kImmIwIb:
+    len += 3;
+    break;
+  case kImmZ:
+    if (has_group3_imm) {
+      len += 4;
+      flags |= kLen64ImmZ;
+    }
+    break;
+  case kImmV:
+    len += 4;
+    flags |= kLen64ImmZ | kLen64ImmV;
+    break;
+  case kImmJz:
+    len += 4;
+    break;
+  case kImmMoffs:
+    len += 8;
+    break;
+  default:
+    return 0;  // far pointers
+  }
+  return static_cast<uint8_t>(len | flags);
+}
+
+// Same as Decode() after a VEX prefix: ModRM except for VZEROUPPER /
+// VZEROALL, and an imm8 if the first operand is Ib.
+uint8_t BuildVEXLength64Entry(const OpcodeEntry &e, int vex_map, int op,
+                              uint8_t modrm_byte) {
+  if ((e.attrs & (kAttrInvalid | kAttrInvalid64)) || e.group != kGroupNone) {
+    return 0;
+  }
+  int len = 1;
+  uint8_t flags = 0;
+  if (!(vex_map == 1 && op == 0x77)) {
+    const ModRM modrm(modrm_byte);
+    len += 1 + modrm.HasSIB(8) + modrm.GetNumOfDispBytes(8, 0);
+    if (modrm.HasSIB(8) && (modrm_byte >> 6) == 0) {
+      flags |= kLen64SIBDisp;
+    }
+  }
+  len += e.operands[0] == K::kIb;
+  return static_cast<uint8_t>(len | flags);
+}
+
+void BuildLengthTable64(LengthTable64 *t) {
+  const LengthTable *maps[] = {&kOneByteLengthTable, &k0FLengthTable,
+                               &k0F38LengthTable, &k0F3ALengthTable};
+  const OpcodeTable *vex_maps[] = {&k0FTable, &k0F38Table, &k0F3ATable};
+  for (int op = 0; op < 256; op++) {
+    for (int modrm = 0; modrm < 256; modrm++) {
+      const uint8_t modrm_byte = static_cast<uint8_t>(modrm);
+      for (int map = 0; map < kVEXLengthMapBase + 1; map++) {
+        t->entries[map][op][modrm] =
+            BuildLength64Entry(maps[map]->entries[op], map, op, modrm_byte);
+      }
+      for (int vex_map = 1; vex_map <= 3; vex_map++) {
+        t->entries[kVEXLengthMapBase + vex_map][op][modrm] =
+            BuildVEXLength64Entry(vex_maps[vex_map - 1]->entries[op], vex_map,
+                                  op, modrm_byte);
+      }
+    }
+  }
+}
+
+// 448KB, too large to be built by the compiler as the tables above. Built by
+// InitLengthTable64() on the first use so that it does not add to the start
+// of every run.
+LengthTable64 length_table64;
+
+inline void InitLengthTable64() {
+  static const bool initialized = [] {
+    BuildLengthTable64(&length_table64);
+    return true;
+  }();
+  (void)initialized;
+}
+
+// The first 8 bytes of p, p[0] in the lowest byte.
+inline uint64_t Load64LE(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+// DecodeLengthFast() for 64bit mode: an optional REX and the one-byte or 0F
+// map, which is about 90% of compiler output. The chain from the offset to
+// the length has one table load after the instruction bytes.
+inline size_t DecodeLengthFast64(const uint8_t *p) {
+  const uint64_t w = Load64LE(p);
+  const uint64_t rex = (w & 0xf0) == 0x40;
+  const uint64_t rex_w = rex & (w >> 3);
+  const uint64_t w1 = w >> (rex << 3);
+  const uint64_t is_0f = (w1 & 0xff) == 0x0f;
+  const uint64_t q = w1 >> (is_0f << 3);
+  const uint8_t entry =
+      length_table64.entries[is_0f][q & 0xff][(q >> 8) & 0xff];
+  const uint64_t sib_disp = ((entry >> 4) & (((q >> 16) & 7) == 5)) << 2;
+  const uint64_t imm64 = (entry >> 6) & rex_w;
+  const uint64_t len =
+      rex + is_0f + (entry & kLen64Mask) + sib_disp + (imm64 << 2);
+  return len & -static_cast<uint64_t>(entry != 0);
+}
+
+// DecodeLengthFast64() with the rest of the length_table64 cases: one legacy
+// prefix other than 67, 0F38, 0F3A and VEX. The bytes up to the SIB (at most
+// a prefix, REX, 3 escape bytes, the opcode, ModRM and SIB) come from a
+// single 8 byte load, and the prefixes and the map are computed from it
+// without branches.
+inline size_t DecodeLengthPrefixed64(const uint8_t *p) {
+  const uint64_t w = Load64LE(p);
+  // Legacy prefixes other than 67: 26 2E 36 3E, 64 65, 66, F0 F2 F3.
+  const uint64_t c = w & 0xff;
+  const uint64_t is_66 = c == 0x66;
+  const uint64_t prefix = ((c & 0xe7) == 0x26) | ((c & 0xfe) == 0x64) |
+                          is_66 | (((c & 0xfc) == 0xf0) & (c != 0xf1));
+  const uint64_t w1 = w >> (prefix << 3);
+  const uint64_t rex = (w1 & 0xf0) == 0x40;
+  const uint64_t rex_w = rex & (w1 >> 3);
+  const uint64_t w2 = w1 >> (rex << 3);
+  const uint64_t h = prefix + rex;
+  const uint64_t b0 = w2 & 0xff;
+  const uint64_t b1 = (w2 >> 8) & 0xff;
+  // Legacy maps: 0F, 0F 38 and 0F 3A. VEX (C5: map 0F, C4: map in the
+  // low bits of its next byte) is not allowed after a prefix or REX.
+  const uint64_t is_0f = b0 == 0x0f;
+  const uint64_t is_3byte = is_0f & ((b1 & 0xfd) == 0x38);
+  const uint64_t is_vex = (h == 0) & ((b0 & 0xfe) == 0xc4);
+  const uint64_t is_c4 = is_vex & ~b0 & 1;
+  const uint64_t vex_map = is_c4 ? (b1 & 0x1f) : 1;
+  const uint64_t is_valid_map = !is_vex | (vex_map - 1 < 3);
+  const uint64_t map =
+      (is_vex ? kVEXLengthMapBase + vex_map
+              : is_0f + is_3byte + (is_3byte & (b1 >> 1))) &
+      -is_valid_map;
+  const uint64_t escape = is_vex ? 2 + is_c4 : is_0f + is_3byte;
+  const uint64_t q = w2 >> (escape << 3);
+  const uint8_t entry =
+      length_table64.entries[map][q & 0xff][(q >> 8) & 0xff];
+  const uint64_t sib_disp = ((entry >> 4) & (((q >> 16) & 7) == 5)) << 2;
+  const uint64_t imm16 = (entry >> 5) & is_66 & ~rex_w & 1;
+  const uint64_t imm64 = (entry >> 6) & rex_w;
+  const uint64_t len = h + escape + (entry & kLen64Mask) + sib_disp -
+                       (imm16 << 1) + (imm64 << 2);
+  // 0 for an entry of 0 and for VEX with a map other than 1, 2 and 3, which
+  // read the one-byte map above
+  return len & -((entry != 0) & is_valid_map);
+}
+
+// Fast path of DecodeLength(). p must have at least kMaxInstrLength bytes,
+// and InitLengthTable64() must have been called for 64bit mode. Returns 0 if
+// the instruction needs DecodeLengthFastMiss().
+inline size_t DecodeLengthFast(const uint8_t *p, bool is64) {
+  return is64 ? DecodeLengthFast64(p) : DecodeLengthFast32(p);
+}
+
+// Returns the number of leading legacy prefix bytes in p[0, limit).
+inline size_t CountLegacyPrefixes(const uint8_t *p, size_t limit,
+                                  size_t size) {
+#ifdef __SSE2__
+  if (size >= 16) {
+    // Compare 16 bytes against all 11 prefix values at once. This pays off
+    // for the long prefix chains used in compiler generated NOP padding.
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(0x66));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x67)));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x2e)));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x3e)));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x26)));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x36)));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x64)));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x65)));
+    m = _mm_or_si128(
+        m, _mm_cmpeq_epi8(v, _mm_set1_epi8(static_cast<char>(0xf0))));
+    m = _mm_or_si128(
+        m, _mm_cmpeq_epi8(v, _mm_set1_epi8(static_cast<char>(0xf2))));
+    m = _mm_or_si128(
+        m, _mm_cmpeq_epi8(v, _mm_set1_epi8(static_cast<char>(0xf3))));
+    // bits above 15 are set, so ctz is at most 16
+    unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(m));
+    size_t n = __builtin_ctz(mask);
+    return n < limit ? n : limit;
+  }
+#endif
+  size_t n = 0;
+  while (n < limit && (kOneByteLengthTable.entries[p[n]].flags & kLenPrefix)) {
+    n++;
+  }
+  return n;
+}
+
+size_t DecodeLengthSlow(const uint8_t *p, size_t size, CPUMode mode) {
+  Instr instr;
+  return Decode(p, size, mode, &instr);
+}
+
+// Handles any instruction in any mode.
+size_t DecodeLengthGeneral(const uint8_t *p, size_t size, CPUMode mode) {
+  const size_t limit = size < kMaxInstrLength ? size : kMaxInstrLength;
+  size_t i = 0;
+  bool has_66 = false;
+  bool has_67 = false;
+  bool rex_w = false;
+  if (kOneByteLengthTable.entries[p[0]].flags & kLenPrefix) {
+    i = CountLegacyPrefixes(p, limit, size);
+    for (size_t n = 0; n < i; n++) {
+      has_66 |= p[n] == 0x66;
+      has_67 |= p[n] == 0x67;
+    }
+  }
+  if (mode == CPUMode::k64 && i < limit && (p[i] & 0xf0) == 0x40) {
+    rex_w = p[i] & 0x08;
+    i++;
+  }
+  if (i >= limit) {
+    return 1;
+  }
+  const uint8_t op = p[i++];
+  const LengthInfo *li = &kOneByteLengthTable.entries[op];
+  if (li->flags & (kLenSlow | kLenPrefix)) {
+    return DecodeLengthSlow(p, size, mode);
+  }
+  if (li->flags & kLenEscape0F) {
+    if (i >= limit) {
+      return 1;
+    }
+    const uint8_t op2 = p[i++];
+    li = &k0FLengthTable.entries[op2];
+    if (op2 == 0x38 || op2 == 0x3a) {
+      if (i >= limit) {
+        return 1;
+      }
+      li = op2 == 0x38 ? &k0F38LengthTable.entries[p[i]]
+                       : &k0F3ALengthTable.entries[p[i]];
+      i++;
+    }
+  }
+  if ((li->flags & kLenInvalid) ||
+      (mode == CPUMode::k64 && (li->flags & kLenInvalid64))) {
+    return 1;
+  }
+
+  int operand_size;
+  int address_size;
+  if (mode == CPUMode::k64) {
+    operand_size = rex_w ? 8 : has_66 ? 2 : 4;
+    address_size = has_67 ? 4 : 8;
+  } else {
+    const int default_size = mode == CPUMode::k16 ? 2 : 4;
+    operand_size = has_66 ? (6 - default_size) : default_size;
+    address_size = has_67 ? (6 - default_size) : default_size;
+  }
+
+  uint8_t reg = 0;
+  if (li->flags & kLenModRM) {
+    if (i >= limit) {
+      return 1;
+    }
+    const uint8_t modrm_byte = p[i++];
+    const ModRM modrm(modrm_byte);
+    reg = (modrm_byte >> 3) & 7;
+    if (!(li->valid_regs & (1 << reg)) ||
+        ((li->mem_only_regs & (1 << reg)) && modrm_byte >= 0xc0)) {
+      // undefined, or group 11 XABORT / XBEGIN
+      return DecodeLengthSlow(p, size, mode);
+    }
+    uint8_t sib = 0;
+    if (modrm.HasSIB(address_size)) {
+      if (i >= limit) {
+        return 1;
+      }
+      sib = p[i++];
+    }
+    i += modrm.GetNumOfDispBytes(address_size, sib);
+  }
+
+  switch (li->imm) {
+  case kImmNone:
+    break;
+  case kImm1:
+    i += ((li->flags & kLenGroup3) && reg >= 2) ? 0 : 1;
+    break;
+  case kImm2:
+    i += 2;
+    break;
+  case kImmIwIb:
+    i += 3;
+    break;
+  case kImmZ:
+    i += ((li->flags & kLenGroup3) && reg >= 2) ? 0
+         : operand_size == 2                    ? 2
+                                                : 4;
+    break;
+  case kImmV:
+    i += operand_size;
+    break;
+  case kImmJz:
+    i += (mode != CPUMode::k64 && operand_size == 2) ? 2 : 4;
+    break;
+  case kImmMoffs:
+    i += address_size;
+    break;
+  case kImmAp:
+    i += operand_size == 2 ? 4 : 6;
+    break;
+  }
+  return i > limit ? 1 : i;
+}
+
+// Called when DecodeLengthFast() returns 0. p must have at least
+// kMaxInstrLength bytes.
+size_t DecodeLengthFastMiss(const uint8_t *p, size_t size, CPUMode mode) {
+  if (mode == CPUMode::k64) {
+    size_t len = DecodeLengthPrefixed64(p);
+    if (len) {
+      return len;
+    }
+  }
+  return DecodeLengthGeneral(p, size, mode);
+}
+
+}  // namespace
+
+size_t DecodeLength(const uint8_t *p, size_t size, CPUMode mode) {
+  if (size >= kMaxInstrLength && mode != CPUMode::k16) {
+    if (mode == CPUMode::k64) {
+      InitLengthTable64();
+    }
+    size_t len = DecodeLengthFast(p, mode == CPUMode::k64);
+    return len ? len : DecodeLengthFastMiss(p, size, mode);
+  }
+  return DecodeLengthGeneral(p, size, mode);
+}
+
+namespace {
+
+constexpr int kNumOfLengthLanes = 4;
+constexpr size_t kMinSizeForLengthLanes = 4096;
+constexpr int kMaxResyncInstrs = 64;
+
+struct LengthLane {
+  size_t ofs;
+  size_t end;
+  size_t n;
+  uint8_t *lengths;
+};
+
+inline size_t DecodeLengthUnchecked(const uint8_t *p, size_t size,
+                                    CPUMode mode) {
+  size_t len = DecodeLengthFast(p, mode == CPUMode::k64);
+  return len ? len : DecodeLengthFastMiss(p, size, mode);
+}
+
+size_t DecodeLengthsSerial(const uint8_t *p, size_t ofs, size_t end,
+                           size_t size, CPUMode mode, uint8_t *lengths) {
+  // Decodes from ofs until reaching end. Returns the number of instructions.
+  size_t n = 0;
+  if (mode != CPUMode::k16) {
+    const size_t safe_end = size < kMaxInstrLength ? 0 : size - kMaxInstrLength;
+    const size_t fast_end = end < safe_end ? end : safe_end;
+    while (ofs < fast_end) {
+      size_t len = DecodeLengthUnchecked(&p[ofs], size - ofs, mode);
+      lengths[n++] = len;
+      ofs += len;
+    }
+  }
+  while (ofs < end) {
+    size_t len = DecodeLength(&p[ofs], size - ofs, mode);
+    lengths[n++] = len;
+    ofs += len;
+  }
+  return n;
+}
+
+}  // namespace
+
+size_t DecodeLengths(const uint8_t *p, size_t size, CPUMode mode,
+                     uint8_t *lengths) {
+  if (mode == CPUMode::k64) {
+    InitLengthTable64();
+  }
+  if (size < kMinSizeForLengthLanes || mode == CPUMode::k16) {
+    return DecodeLengthsSerial(p, 0, size, size, mode, lengths);
+  }
+  const bool is64 = mode == CPUMode::k64;
+  // The chain of lengths is inherently serial, so decode kNumOfLengthLanes
+  // chunks interleaved to overlap their latencies. Lanes other than the first
+  // start at a guessed boundary; x86 code resynchronizes within a few
+  // instructions, and the lanes are stitched at the first common boundary.
+  // Each lane writes its lengths to lengths[chunk begin], which never
+  // overlaps the next lane as every instruction is at least 1 byte.
+  LengthLane lanes[kNumOfLengthLanes];
+  for (int j = 0; j < kNumOfLengthLanes; j++) {
+    lanes[j].ofs = size * j / kNumOfLengthLanes;
+    lanes[j].end = size * (j + 1) / kNumOfLengthLanes;
+    lanes[j].n = 0;
+    lanes[j].lengths = &lengths[lanes[j].ofs];
+  }
+  // Keep the lane state in locals so that it stays in registers (stores
+  // through uint8_t * may alias anything in memory).
+  static_assert(kNumOfLengthLanes == 4, "the loop below is unrolled by 4");
+  const size_t safe_end = size - kMaxInstrLength;
+  size_t o0 = lanes[0].ofs, o1 = lanes[1].ofs, o2 = lanes[2].ofs,
+         o3 = lanes[3].ofs;
+  size_t n = 0;  // all lanes advance by one instruction per iteration
+  uint8_t *l0 = lanes[0].lengths, *l1 = lanes[1].lengths,
+          *l2 = lanes[2].lengths, *l3 = lanes[3].lengths;
+  const size_t e0 = lanes[0].end, e1 = lanes[1].end, e2 = lanes[2].end,
+               e3 = lanes[3].end < safe_end ? lanes[3].end : safe_end;
+  while (o0 < e0 && o1 < e1 && o2 < e2 && o3 < e3) {
+    size_t len0 = DecodeLengthFast(&p[o0], is64);
+    size_t len1 = DecodeLengthFast(&p[o1], is64);
+    size_t len2 = DecodeLengthFast(&p[o2], is64);
+    size_t len3 = DecodeLengthFast(&p[o3], is64);
+    if (__builtin_expect(!(len0 && len1 && len2 && len3), 0)) {
+      len0 = len0 ? len0 : DecodeLengthFastMiss(&p[o0], size - o0, mode);
+      len1 = len1 ? len1 : DecodeLengthFastMiss(&p[o1], size - o1, mode);
+      len2 = len2 ? len2 : DecodeLengthFastMiss(&p[o2], size - o2, mode);
+      len3 = len3 ? len3 : DecodeLengthFastMiss(&p[o3], size - o3, mode);
+    }
+    l0[n] = len0;
+    l1[n] = len1;
+    l2[n] = len2;
+    l3[n] = len3;
+    n++;
+    o0 += len0;
+    o1 += len1;
+    o2 += len2;
+    o3 += len3;
+  }
+  lanes[0].ofs = o0;
+  lanes[1].ofs = o1;
+  lanes[2].ofs = o2;
+  lanes[3].ofs = o3;
+  for (int j = 0; j < kNumOfLengthLanes; j++) {
+    lanes[j].n = n;
+  }
+  for (int j = 0; j < kNumOfLengthLanes; j++) {
+    LengthLane &lane = lanes[j];
+    if (lane.ofs < lane.end) {
+      size_t n = DecodeLengthsSerial(p, lane.ofs, lane.end, size, mode,
+                                     &lane.lengths[lane.n]);
+      for (size_t k = lane.n; k < lane.n + n; k++) {
+        lane.ofs += lane.lengths[k];
+      }
+      lane.n += n;
+    }
+  }
+
+  // Stitch lanes. pos is always a true instruction boundary.
+  size_t total = lanes[0].n;
+  size_t pos = lanes[0].ofs;
+  for (int j = 1; j < kNumOfLengthLanes; j++) {
+    const LengthLane &lane = lanes[j];
+    const size_t lane_begin = size * j / kNumOfLengthLanes;
+    if (pos >= lane.ofs) {
+      continue;  // the previous lane already covered this one
+    }
+    uint8_t resync[kMaxResyncInstrs];
+    int num_of_resync = 0;
+    size_t q = lane_begin;
+    size_t k = 0;
+    bool synced = false;
+    while (num_of_resync < kMaxResyncInstrs) {
+      while (q < pos) {
+        q += lane.lengths[k++];
+      }
+      if (q == pos) {
+        synced = true;
+        break;
+      }
+      size_t len = DecodeLength(&p[pos], size - pos, mode);
+      resync[num_of_resync++] = len;
+      pos += len;
+    }
+    if (!synced) {
+      // Not a code stream (or a pathological one). Redo this lane serially.
+      for (int r = 0; r < num_of_resync; r++) {
+        lengths[total++] = resync[r];
+      }
+      size_t n = DecodeLengthsSerial(p, pos, lane.end, size, mode,
+                                     &lengths[total]);
+      for (size_t r = total; r < total + n; r++) {
+        pos += lengths[r];
+      }
+      total += n;
+      continue;
+    }
+    memmove(&lengths[total + num_of_resync], &lane.lengths[k], lane.n - k);
+    for (int r = 0; r < num_of_resync; r++) {
+      lengths[total++] = resync[r];
+    }
+    total += lane.n - k;
+    pos = lane.ofs;
+  }
+  return total;
+}
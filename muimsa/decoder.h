@@ -0,0 +1,299 @@
+#ifndef MUIMSA_DECODER_H_
+#define MUIMSA_DECODER_H_
+
+#include <cstddef>
+#include <cstdint>
+
+enum class CPUMode : uint8_t {
+  k16,
+  k32,
+  k64,
+};
+
+#define MUIMSA_MNEMONICS(M)                                                    \
+  M(BAD, "(bad)")                                                              \
+  M(ADD, "ADD")                                                                \
+  M(OR, "OR")                                                                  \
+  M(ADC, "ADC")                                                                \
+  M(SBB, "SBB")                                                                \
+  M(AND, "AND")                                                                \
+  M(SUB, "SUB")                                                                \
+  M(XOR, "XOR")                                                                \
+  M(CMP, "CMP")                                                                \
+  M(PUSH, "PUSH")                                                              \
+  M(POP, "POP")                                                                \
+  M(DAA, "DAA")                                                                \
+  M(DAS, "DAS")                                                                \
+  M(AAA, "AAA")                                                                \
+  M(AAS, "AAS")                                                                \
+  M(INC, "INC")                                                                \
+  M(DEC, "DEC")                                                                \
+  M(PUSHA, "PUSHA")                                                            \
+  M(POPA, "POPA")                                                              \
+  M(BOUND, "BOUND")                                                            \
+  M(ARPL, "ARPL")                                                              \
+  M(MOVSXD, "MOVSXD")                                                          \
+  M(IMUL, "IMUL")                                                              \
+  M(INS, "INS")                                                                \
+  M(OUTS, "OUTS")                                                              \
+  M(JO, "JO")                                                                  \
+  M(JNO, "JNO")                                                                \
+  M(JB, "JB")                                                                  \
+  M(JAE, "JAE")                                                                \
+  M(JE, "JE")                                                                  \
+  M(JNE, "JNE")                                                                \
+  M(JBE, "JBE")                                                                \
+  M(JA, "JA")                                                                  \
+  M(JS, "JS")                                                                  \
+  M(JNS, "JNS")                                                                \
+  M(JP, "JP")                                                                  \
+  M(JNP, "JNP")                                                                \
+  M(JL, "JL")                                                                  \
+  M(JGE, "JGE")                                                                \
+  M(JLE, "JLE")                                                                \
+  M(JG, "JG")                                                                  \
+  M(TEST, "TEST")                                                              \
+  M(XCHG, "XCHG")                                                              \
+  M(MOV, "MOV")                                                                \
+  M(LEA, "LEA")                                                                \
+  M(NOP, "NOP")                                                                \
+  M(CBW, "CBW")                                                                \
+  M(CWD, "CWD")                                                                \
+  M(CALLF, "CALLF")                                                            \
+  M(FWAIT, "FWAIT")                                                            \
+  M(PUSHF, "PUSHF")                                                            \
+  M(POPF, "POPF")                                                              \
+  M(SAHF, "SAHF")                                                              \
+  M(LAHF, "LAHF")                                                              \
+  M(MOVS, "MOVS")                                                              \
+  M(CMPS, "CMPS")                                                              \
+  M(STOS, "STOS")                                                              \
+  M(LODS, "LODS")                                                              \
+  M(SCAS, "SCAS")                                                              \
+  M(ROL, "ROL")                                                                \
+  M(ROR, "ROR")                                                                \
+  M(RCL, "RCL")                                                                \
+  M(RCR, "RCR")                                                                \
+  M(SHL, "SHL")                                                                \
+  M(SHR, "SHR")                                                                \
+  M(SAR, "SAR")                                                                \
+  M(RET, "RET")                                                                \
+  M(LES, "LES")                                                                \
+  M(LDS, "LDS")                                                                \
+  M(ENTER, "ENTER")                                                            \
+  M(LEAVE, "LEAVE")                                                            \
+  M(RETF, "RETF")                                                              \
+  M(INT3, "INT3")                                                              \
+  M(INT, "INT")                                                                \
+  M(INTO, "INTO")                                                              \
+  M(IRET, "IRET")                                                              \
+  M(AAM, "AAM")                                                                \
+  M(AAD, "AAD")                                                                \
+  M(SALC, "SALC")                                                              \
+  M(XLAT, "XLAT")                                                              \
+  M(FPU, "(x87)")                                                              \
+  M(LOOPNE, "LOOPNE")                                                          \
+  M(LOOPE, "LOOPE")                                                            \
+  M(LOOP, "LOOP")                                                              \
+  M(JRCXZ, "JRCXZ")                                                            \
+  M(IN, "IN")                                                                  \
+  M(OUT, "OUT")                                                                \
+  M(CALL, "CALL")                                                              \
+  M(JMP, "JMP")                                                                \
+  M(JMPF, "JMPF")                                                              \
+  M(INT1, "INT1")                                                              \
+  M(HLT, "HLT")                                                                \
+  M(CMC, "CMC")                                                                \
+  M(NOT, "NOT")                                                                \
+  M(NEG, "NEG")                                                                \
+  M(MUL, "MUL")                                                                \
+  M(DIV, "DIV")                                                                \
+  M(IDIV, "IDIV")                                                              \
+  M(CLC, "CLC")                                                                \
+  M(STC, "STC")                                                                \
+  M(CLI, "CLI")                                                                \
+  M(STI, "STI")                                                                \
+  M(CLD, "CLD")                                                                \
+  M(STD, "STD")                                                                \
+  M(SYSCALL, "SYSCALL")                                                        \
+  M(SYSRET, "SYSRET")                                                          \
+  M(UD2, "UD2")                                                                \
+  M(RDTSC, "RDTSC")                                                            \
+  M(CPUID, "CPUID")                                                            \
+  M(CMOVCC, "CMOVcc")                                                          \
+  M(SETCC, "SETcc")                                                            \
+  M(BT, "BT")                                                                  \
+  M(BTS, "BTS")                                                                \
+  M(BTR, "BTR")                                                                \
+  M(BTC, "BTC")                                                                \
+  M(BSF, "BSF")                                                                \
+  M(BSR, "BSR")                                                                \
+  M(SHLD, "SHLD")                                                              \
+  M(SHRD, "SHRD")                                                              \
+  M(CMPXCHG, "CMPXCHG")                                                        \
+  M(MOVZX, "MOVZX")                                                            \
+  M(MOVSX, "MOVSX")                                                            \
+  M(XADD, "XADD")                                                              \
+  M(BSWAP, "BSWAP")                                                            \
+  M(ENDBR64, "ENDBR64")                                                        \
+  M(XABORT, "XABORT")                                                          \
+  M(XBEGIN, "XBEGIN")                                                          \
+  M(OTHER, "(op)")
+
+enum class Mnemonic : uint8_t {
+#define MUIMSA_MNEMONIC_ENUM(name, str) k##name,
+  MUIMSA_MNEMONICS(MUIMSA_MNEMONIC_ENUM)
+#undef MUIMSA_MNEMONIC_ENUM
+      kNumOfMnemonics
+};
+
+const char *GetMnemonicName(Mnemonic mnemonic);
+
+// Operand addressing methods (Intel SDM Vol.2 Appendix A.2)
+enum class OperandKind : uint8_t {
+  kNone,
+  kEb,  // ModRM r/m, byte
+  kEv,  // ModRM r/m, operand size
+  kEw,  // ModRM r/m, word
+  kEd,  // ModRM r/m, dword
+  kM,   // ModRM r/m, memory only
+  kGb,  // ModRM reg, byte
+  kGv,  // ModRM reg, operand size
+  kSw,  // ModRM reg, segment register
+  kZb,  // low 3 bits of opcode, byte register
+  kZv,  // low 3 bits of opcode, operand size register
+  kAL,
+  kRAX,
+  kCL,
+  kDX,
+  kOne,  // constant 1 (shift count)
+  kIb,
+  kIbs,  // imm8 sign-extended to operand size
+  kIw,
+  kIz,  // imm16 or imm32 (sign-extended for 64bit operand size)
+  kIv,  // imm16, imm32 or imm64
+  kJb,  // rel8
+  kJz,  // rel16 or rel32
+  kOb,  // moffs, byte
+  kOv,  // moffs, operand size
+  kAp,  // far pointer
+  kES,
+  kCS,
+  kSS,
+  kDS,
+  kFS,
+  kGS,
+};
+
+// Legacy prefixes (Instr::prefixes)
+enum : uint8_t {
+  kPrefixLock = 1,
+  kPrefixRepne = 2,
+  kPrefixRep = 4,
+  kPrefixOpSize = 8,
+  kPrefixAddrSize = 16,
+};
+
+enum class OpcodeMap : uint8_t {
+  kOneByte,
+  k0F,
+  k0F38,
+  k0F3A,
+  kVEX,   // any VEX encoded instruction (C4 / C5)
+  kEVEX,  // any EVEX encoded instruction (62)
+};
+
+// Instr::flags
+enum : uint8_t {
+  kInstrHasModRM = 1,
+  kInstrHasSIB = 2,
+  kInstrRIPRelative = 4,
+  kInstrInvalid = 8,
+};
+
+// Table 2-2. 32-Bit Addressing Forms with the ModR/M Byte
+// Table 2-1. 16-Bit Addressing Forms with the ModR/M Byte
+class ModRM {
+public:
+  constexpr explicit ModRM(uint8_t byte)
+      : mod_((byte >> 6) & 0b11), reg_((byte >> 3) & 0b111),
+        r_m_(byte & 0b111) {}
+  constexpr bool HasSIB(int address_size) const {
+    return address_size != 2 && mod_ != 0b11 && r_m_ == 0b100;
+  }
+  constexpr int GetNumOfDispBytes(int address_size, uint8_t sib) const {
+    if (address_size == 2) {
+      if (mod_ == 0b00 && r_m_ == 0b110) {
+        return 2;
+      }
+      return mod_ == 0b01 ? 1 : mod_ == 0b10 ? 2 : 0;
+    }
+    if (mod_ == 0b00 && r_m_ == 0b101) {
+      return 4;
+    }
+    if (mod_ == 0b00 && r_m_ == 0b100 && (sib & 0b111) == 0b101) {
+      // SIB with no base
+      return 4;
+    }
+    if (mod_ == 0b01) {
+      return 1;
+    }
+    if (mod_ == 0b10) {
+      return 4;
+    }
+    return 0;
+  }
+
+private:
+  uint8_t mod_;
+  uint8_t reg_;
+  uint8_t r_m_;
+};
+
+// Decoded instruction. Trivially copyable and fixed-size so that it can live
+// on the stack and be reused across instructions without any allocation.
+struct Instr {
+  int64_t disp;
+  uint64_t imm;
+  uint8_t imm2;  // second immediate (ENTER Iw, Ib)
+  uint8_t length;
+  uint8_t num_of_prefixes;  // legacy prefixes + REX
+  uint8_t prefixes;         // kPrefix*
+  uint8_t segment;          // 0: none, 1 + segment register number
+  uint8_t rex;              // 0 if not present
+  OpcodeMap map;
+  uint8_t opcode;
+  uint8_t modrm;
+  uint8_t sib;
+  uint8_t disp_size;
+  uint8_t imm_size;
+  uint8_t operand_size;  // in bytes: 2, 4 or 8
+  uint8_t address_size;  // in bytes: 2, 4 or 8
+  uint8_t flags;         // kInstr*
+  Mnemonic mnemonic;
+  OperandKind operands[3];
+
+  uint8_t GetMod() const { return modrm >> 6; }
+  uint8_t GetReg() const { return (modrm >> 3) & 7; }
+  uint8_t GetRM() const { return modrm & 7; }
+};
+
+// Decodes one instruction from [p, p + size). Undefined or truncated byte
+// sequences are decoded as a 1-byte Mnemonic::kBAD. Returns the length of
+// the instruction (0 only if size == 0).
+size_t Decode(const uint8_t *p, size_t size, CPUMode mode, Instr *instr);
+
+// Returns the destination of the relative branch (kJb / kJz operand) instr
+// located at addr.
+uint64_t GetBranchTarget(const Instr &instr, uint64_t addr);
+
+// Computes only the length of the instruction at p, using compact per-opcode
+// length class tables. Always returns the same value as Decode().
+size_t DecodeLength(const uint8_t *p, size_t size, CPUMode mode);
+
+// Stores the lengths of all instructions in [p, p + size) into lengths,
+// which must have room for size entries. Returns the number of instructions.
+size_t DecodeLengths(const uint8_t *p, size_t size, CPUMode mode,
+                     uint8_t *lengths);
+
+#endif  // MUIMSA_DECODER_H_
@@ -0,0 +1,156 @@
+#include "disassembler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+constexpr size_t kMinChunkSize = 64 * 1024;
+constexpr int kNumOfChunksPerThread = 8;
+
+struct Chunk {
+  size_t begin;  // decoding starts here, which may be a wrong boundary
+  size_t end;    // instructions starting at or after end belong to the next
+  size_t stop;   // offset after the last decoded instruction
+  vector<size_t> instr_ofs;
+  vector<size_t> out_pos;  // position in out where instr_ofs[i] starts
+  OutputBuffer *out;       // the buffer of the thread which decoded this
+  size_t out_end;
+};
+
+// Disassembles the instructions starting in [ofs, end) and returns the offset
+// after the last one. If chunk is given, records where each instruction
+// (including its labels) starts in the output.
+size_t DisassembleRange(OutputBuffer *out, OutputStyle style,
+                        const ObjectFile &obj, int index, size_t ofs,
+                        size_t end, CPUMode mode, Chunk *chunk) {
+  const Section &section = obj.GetSections()[index];
+  const vector<Symbol> &symbols = obj.GetSymbols();
+  auto sym = lower_bound(
+      symbols.begin(), symbols.end(), section.addr + ofs,
+      [](const Symbol &s, uint64_t addr) { return s.addr < addr; });
+  Instr instr;
+  while (ofs < end) {
+    const uint64_t addr = section.addr + ofs;
+    if (chunk) {
+      chunk->instr_ofs.push_back(ofs);
+      chunk->out_pos.push_back(out->GetSize());
+    }
+    for (; sym != symbols.end() && sym->addr <= addr; ++sym) {
+      if (sym->addr == addr && sym->section == index) {
+        FormatLabel(out, style, addr, sym->name);
+      }
+    }
+    Decode(&section.data[ofs], section.size - ofs, mode, &instr);
+    FormatInstr(out, style, instr, &section.data[ofs], addr);
+    out->FlushIfFull();
+    ofs += instr.length;
+  }
+  return ofs;
+}
+
+// Splits [0, section.size) into chunks of about chunk_size bytes. A boundary
+// is moved forward to a symbol start if there is one within chunk_size / 2.
+vector<Chunk> SplitIntoChunks(const ObjectFile &obj, int index,
+                              size_t chunk_size) {
+  const Section &section = obj.GetSections()[index];
+  const vector<Symbol> &symbols = obj.GetSymbols();
+  vector<Chunk> chunks;
+  size_t begin = 0;
+  while (begin < section.size) {
+    size_t end = begin + chunk_size;
+    if (end >= section.size) {
+      end = section.size;
+    } else {
+      auto sym = lower_bound(
+          symbols.begin(), symbols.end(), section.addr + end,
+          [](const Symbol &s, uint64_t addr) { return s.addr < addr; });
+      for (; sym != symbols.end() &&
+             sym->addr < section.addr + end + chunk_size / 2;
+           ++sym) {
+        if (sym->section == index) {
+          end = sym->addr - section.addr;
+          break;
+        }
+      }
+    }
+    Chunk chunk = {};
+    chunk.begin = begin;
+    chunk.end = end;
+    chunks.push_back(move(chunk));
+    begin = end;
+  }
+  return chunks;
+}
+
+}  // namespace
+
+void DisassembleSection(OutputBuffer *out, OutputStyle style,
+                        const ObjectFile &obj, int index, CPUMode mode,
+                        int num_of_threads, size_t chunk_size) {
+  const Section &section = obj.GetSections()[index];
+  FormatSectionHeader(out, style, section.name.c_str());
+  if (!chunk_size) {
+    chunk_size = max(kMinChunkSize,
+                     section.size / (num_of_threads * kNumOfChunksPerThread));
+  }
+  if (num_of_threads <= 1 || section.size <= chunk_size) {
+    DisassembleRange(out, style, obj, index, 0, section.size, mode, nullptr);
+    return;
+  }
+
+  vector<Chunk> chunks = SplitIntoChunks(obj, index, chunk_size);
+  vector<unique_ptr<OutputBuffer>> buffers;
+  for (int i = 0; i < num_of_threads; i++) {
+    buffers.emplace_back(new OutputBuffer());
+  }
+  atomic<size_t> next_chunk{0};
+  auto worker = [&](OutputBuffer *buf) {
+    for (size_t i; (i = next_chunk.fetch_add(1)) < chunks.size();) {
+      Chunk &chunk = chunks[i];
+      chunk.out = buf;
+      chunk.stop = DisassembleRange(buf, style, obj, index, chunk.begin,
+                                    chunk.end, mode, &chunk);
+      chunk.out_end = buf->GetSize();
+    }
+  };
+  vector<thread> threads;
+  for (int i = 0; i < num_of_threads; i++) {
+    threads.emplace_back(worker, buffers[i].get());
+  }
+  for (thread &t : threads) {
+    t.join();
+  }
+
+  // Concatenate in address order. ofs is always a true instruction boundary.
+  // A chunk which started in the middle of an instruction is resynchronized
+  // by decoding serially from ofs until it hits one of its boundaries.
+  size_t ofs = 0;
+  for (Chunk &chunk : chunks) {
+    for (;;) {
+      auto it =
+          lower_bound(chunk.instr_ofs.begin(), chunk.instr_ofs.end(), ofs);
+      if (it == chunk.instr_ofs.end()) {
+        break;
+      }
+      if (*it == ofs) {
+        size_t pos = chunk.out_pos[it - chunk.instr_ofs.begin()];
+        out->Put(&chunk.out->GetData()[pos], chunk.out_end - pos);
+        out->FlushIfFull();
+        ofs = chunk.stop;
+        break;
+      }
+      ofs = DisassembleRange(out, style, obj, index, ofs, ofs + 1, mode,
+                             nullptr);
+    }
+  }
+  if (ofs < section.size) {
+    DisassembleRange(out, style, obj, index, ofs, section.size, mode,
+                     nullptr);
+  }
+}
@@ -0,0 +1,23 @@
+#ifndef MUIMSA_DISASSEMBLER_H_
+#define MUIMSA_DISASSEMBLER_H_
+
+#include <cstddef>
+
+#include "decoder.h"
+#include "formatter.h"
+#include "object_file.h"
+
+// Disassembles the section obj.GetSections()[index] to out, printing the
+// symbols in it as labels.
+//
+// If num_of_threads > 1, a large section is split into chunks (at symbol
+// starts where possible) which are disassembled on a pool of threads into
+// per-chunk in-memory OutputBuffers. The chunks are then stitched in address
+// order at their first common instruction boundary, so that the output is
+// byte-for-byte the same as a serial run even if a chunk started in the
+// middle of an instruction. chunk_size == 0 chooses the size automatically.
+void DisassembleSection(OutputBuffer *out, OutputStyle style,
+                        const ObjectFile &obj, int index, CPUMode mode,
+                        int num_of_threads, size_t chunk_size = 0);
+
+#endif  // MUIMSA_DISASSEMBLER_H_
@@ -0,0 +1,554 @@
+#include "formatter.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+OutputBuffer::OutputBuffer(int fd) : buf_(kFlushThreshold), fd_(fd) {}
+
+void OutputBuffer::Put(const char *s) { Put(s, strlen(s)); }
+
+void OutputBuffer::Put(const char *s, size_t len) {
+  if (buf_.size() - size_ < len) {
+    MakeRoom(len);
+  }
+  memcpy(&buf_[size_], s, len);
+  size_ += len;
+}
+
+void OutputBuffer::PutHex(uint64_t v, int min_digits, bool is_upper) {
+  const char *digits = is_upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  char tmp[16];
+  int n = 0;
+  do {
+    tmp[n++] = digits[v & 0xf];
+    v >>= 4;
+  } while (v);
+  for (; n < min_digits && n < 16; n++) {
+    tmp[n] = '0';
+  }
+  if (buf_.size() - size_ < static_cast<size_t>(n)) {
+    MakeRoom(n);
+  }
+  while (n) {
+    buf_[size_++] = tmp[--n];
+  }
+}
+
+void OutputBuffer::PutDec(uint64_t v) {
+  char tmp[20];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  if (buf_.size() - size_ < static_cast<size_t>(n)) {
+    MakeRoom(n);
+  }
+  while (n) {
+    buf_[size_++] = tmp[--n];
+  }
+}
+
+void OutputBuffer::PadTo(size_t line_begin, size_t column) {
+  while (size_ - line_begin < column) {
+    Put(' ');
+  }
+}
+
+void OutputBuffer::Flush() {
+  if (fd_ < 0) {
+    return;
+  }
+  for (size_t ofs = 0; ofs < size_;) {
+    ssize_t written = write(fd_, &buf_[ofs], size_ - ofs);
+    if (written <= 0) {
+      perror("write");
+      exit(EXIT_FAILURE);
+    }
+    ofs += written;
+  }
+  size_ = 0;
+}
+
+void OutputBuffer::MakeRoom(size_t len) {
+  buf_.resize(max(buf_.size() * 2, size_ + len));
+}
+
+namespace {
+
+using K = OperandKind;
+using M = Mnemonic;
+
+const char *GetRegName(int size, int number, bool has_rex) {
+  static const char *kRegName8[16] = {
+      "AL",  "CL",  "DL",   "BL",   "AH",   "CH",   "DH",   "BH",
+      "R8B", "R9B", "R10B", "R11B", "R12B", "R13B", "R14B", "R15B",
+  };
+  static const char *kRegName8Rex[8] = {
+      "AL", "CL", "DL", "BL", "SPL", "BPL", "SIL", "DIL",
+  };
+  static const char *kRegName16[16] = {
+      "AX",  "CX",  "DX",   "BX",   "SP",   "BP",   "SI",   "DI",
+      "R8W", "R9W", "R10W", "R11W", "R12W", "R13W", "R14W", "R15W",
+  };
+  static const char *kRegName32[16] = {
+      "EAX", "ECX", "EDX",  "EBX",  "ESP",  "EBP",  "ESI",  "EDI",
+      "R8D", "R9D", "R10D", "R11D", "R12D", "R13D", "R14D", "R15D",
+  };
+  static const char *kRegName64[16] = {
+      "RAX", "RCX", "RDX", "RBX", "RSP", "RBP", "RSI", "RDI",
+      "R8",  "R9",  "R10", "R11", "R12", "R13", "R14", "R15",
+  };
+  switch (size) {
+  case 1:
+    return (has_rex && number < 8) ? kRegName8Rex[number] : kRegName8[number];
+  case 2:
+    return kRegName16[number];
+  case 4:
+    return kRegName32[number];
+  default:
+    return kRegName64[number];
+  }
+}
+
+const char *kSegRegName[8] = {"ES", "CS", "SS", "DS", "FS", "GS", "?", "?"};
+
+const char *kConditionName[16] = {"O", "NO", "B",  "AE", "E", "NE",
+                                  "BE", "A", "S",  "NS", "P", "NP",
+                                  "L",  "GE", "LE", "G"};
+
+int GetOperandSize(OperandKind k, const Instr &instr) {
+  switch (k) {
+  case K::kEb:
+  case K::kGb:
+  case K::kZb:
+  case K::kAL:
+  case K::kOb:
+    return 1;
+  case K::kEw:
+  case K::kSw:
+    return 2;
+  case K::kEd:
+    return 4;
+  default:
+    return instr.operand_size;
+  }
+}
+
+bool IsRegisterOperand(OperandKind k, const Instr &instr) {
+  switch (k) {
+  case K::kGb:
+  case K::kGv:
+  case K::kSw:
+  case K::kZb:
+  case K::kZv:
+  case K::kAL:
+  case K::kRAX:
+    return true;
+  case K::kEb:
+  case K::kEv:
+  case K::kEw:
+  case K::kEd:
+    return instr.GetMod() == 3;
+  default:
+    return false;
+  }
+}
+
+int64_t SignExtend(uint64_t v, int size) {
+  int shift = 64 - size * 8;
+  return static_cast<int64_t>(v << shift) >> shift;
+}
+
+// Renders the text of an instruction ("MNEMONIC OPERANDS") in the compact
+// (uppercase, zero-padded immediates) or the objdump (lowercase, minimal
+// immediates) flavor of Intel syntax.
+class InstrPrinter {
+public:
+  InstrPrinter(OutputBuffer *out, bool is_objdump)
+      : out_(out), is_objdump_(is_objdump) {}
+
+  void Print(const Instr &instr, uint64_t addr) {
+    const size_t begin = out_->GetSize();
+    PrintMnemonic(instr);
+    bool print_ptr_size = true;
+    if (is_objdump_) {
+      print_ptr_size = instr.mnemonic != M::kLEA;
+    } else {
+      for (int n = 0; n < 3; n++) {
+        if (IsRegisterOperand(instr.operands[n], instr)) {
+          print_ptr_size = false;
+        }
+      }
+    }
+    for (int n = 0; n < 3 && instr.operands[n] != K::kNone; n++) {
+      if (n) {
+        out_->Put(is_objdump_ ? "," : ", ");
+      } else if (is_objdump_) {
+        out_->PadTo(begin, 6);
+        out_->Put(' ');
+      } else {
+        out_->Put(' ');
+      }
+      PrintOperand(instr.operands[n], instr, addr, print_ptr_size);
+    }
+  }
+
+private:
+  void PrintName(const char *s) {
+    if (!is_objdump_) {
+      out_->Put(s);
+      return;
+    }
+    for (; *s; s++) {
+      out_->Put(static_cast<char>(*s >= 'A' && *s <= 'Z' ? *s + 0x20 : *s));
+    }
+  }
+
+  void PrintHex(uint64_t v, int min_digits) {
+    out_->Put("0x");
+    out_->PutHex(v, is_objdump_ ? 1 : min_digits, !is_objdump_);
+  }
+
+  void PrintImm(uint64_t v, int size) {
+    PrintHex(v, size * 2);
+  }
+
+  void PrintDisp(int64_t disp) {
+    out_->Put(disp < 0 ? '-' : '+');
+    PrintHex(disp < 0 ? -static_cast<uint64_t>(disp) : disp, 1);
+  }
+
+  // An address without any register: [disp] or, as objdump does, ds:disp
+  void PrintAbsoluteAddress(const Instr &instr, uint64_t v, int size) {
+    if (is_objdump_) {
+      if (!instr.segment) {
+        out_->Put("ds:");
+      }
+      PrintHex(v, size * 2);
+      return;
+    }
+    out_->Put('[');
+    PrintHex(v, size * 2);
+    out_->Put(']');
+  }
+
+  void PrintMnemonic(const Instr &instr) {
+    if (instr.prefixes & kPrefixLock) {
+      PrintName("LOCK ");
+    }
+    if (instr.map == OpcodeMap::kOneByte &&
+        (instr.prefixes & (kPrefixRep | kPrefixRepne)) &&
+        (instr.mnemonic == M::kMOVS || instr.mnemonic == M::kCMPS ||
+         instr.mnemonic == M::kSTOS || instr.mnemonic == M::kLODS ||
+         instr.mnemonic == M::kSCAS || instr.mnemonic == M::kINS ||
+         instr.mnemonic == M::kOUTS)) {
+      PrintName((instr.prefixes & kPrefixRep) ? "REP " : "REPNE ");
+    }
+    if (instr.mnemonic == M::kCMOVCC) {
+      PrintName("CMOV");
+      PrintName(kConditionName[instr.opcode & 0xf]);
+    } else if (instr.mnemonic == M::kSETCC) {
+      PrintName("SET");
+      PrintName(kConditionName[instr.opcode & 0xf]);
+    } else if (instr.mnemonic == M::kOTHER) {
+      static const char *kMapName[] = {"", "0F ", "0F38 ", "0F3A ", "VEX ",
+                                       "EVEX "};
+      out_->Put('(');
+      PrintName(kMapName[static_cast<int>(instr.map)]);
+      out_->PutHex(instr.opcode, 2, !is_objdump_);
+      out_->Put(')');
+    } else if (is_objdump_ && instr.mnemonic == M::kCBW) {
+      static const char *kName[9] = {"", "", "cbw", "", "cwde",
+                                     "", "", "",    "cdqe"};
+      out_->Put(kName[instr.operand_size]);
+    } else if (is_objdump_ && instr.mnemonic == M::kCWD) {
+      static const char *kName[9] = {"", "", "cwd", "", "cdq",
+                                     "", "", "",    "cqo"};
+      out_->Put(kName[instr.operand_size]);
+    } else {
+      PrintName(GetMnemonicName(instr.mnemonic));
+    }
+  }
+
+  void PrintEffectiveAddress(const Instr &instr) {
+    if (instr.segment) {
+      PrintName(kSegRegName[instr.segment - 1]);
+      out_->Put(':');
+    }
+    if (instr.address_size == 2) {
+      static const char *kAddr16[8] = {"BX+SI", "BX+DI", "BP+SI", "BP+DI",
+                                       "SI",    "DI",    "BP",    "BX"};
+      if (instr.GetMod() == 0 && instr.GetRM() == 6) {
+        PrintAbsoluteAddress(instr, instr.disp & 0xffff, 2);
+        return;
+      }
+      out_->Put('[');
+      PrintName(kAddr16[instr.GetRM()]);
+      if (instr.disp_size) {
+        PrintDisp(instr.disp);
+      }
+      out_->Put(']');
+      return;
+    }
+    if (instr.flags & kInstrRIPRelative) {
+      out_->Put('[');
+      PrintName("RIP");
+    } else if (instr.GetMod() == 0 && instr.GetRM() == 5) {
+      // Table 2-7. RIP-Relative Addressing
+      // In protected / compatibility mode: [Disp32]
+      PrintAbsoluteAddress(instr, static_cast<uint32_t>(instr.disp), 4);
+      return;
+    } else if (instr.flags & kInstrHasSIB) {
+      int base = (instr.sib & 7) | ((instr.rex & 1) << 3);
+      int index = ((instr.sib >> 3) & 7) | ((instr.rex & 2) << 2);
+      bool has_base = !(instr.GetMod() == 0 && (instr.sib & 7) == 5);
+      if (!has_base && index == 4) {
+        PrintAbsoluteAddress(instr, static_cast<uint32_t>(instr.disp), 4);
+        return;
+      }
+      out_->Put('[');
+      if (has_base) {
+        PrintName(GetRegName(instr.address_size, base, false));
+      }
+      if (index != 4) {
+        if (has_base) {
+          out_->Put('+');
+        }
+        PrintName(GetRegName(instr.address_size, index, false));
+        out_->Put('*');
+        out_->Put(static_cast<char>('0' + (1 << (instr.sib >> 6))));
+      }
+    } else {
+      out_->Put('[');
+      PrintName(GetRegName(instr.address_size,
+                           instr.GetRM() | ((instr.rex & 1) << 3), false));
+    }
+    if (instr.disp_size) {
+      PrintDisp(instr.disp);
+    }
+    out_->Put(']');
+  }
+
+  void PrintOperand(OperandKind k, const Instr &instr, uint64_t addr,
+                    bool print_ptr_size) {
+    bool has_rex = instr.rex != 0;
+    int reg = instr.GetReg() | ((instr.rex & 4) << 1);
+    int rm = instr.GetRM() | ((instr.rex & 1) << 3);
+    int z = (instr.opcode & 7) | ((instr.rex & 1) << 3);
+    switch (k) {
+    case K::kEb:
+    case K::kEv:
+    case K::kEw:
+    case K::kEd:
+    case K::kM:
+      if (instr.GetMod() == 3) {
+        PrintName(GetRegName(GetOperandSize(k, instr), rm, has_rex));
+        return;
+      }
+      if (print_ptr_size && k != K::kM) {
+        static const char *kPtrName[9] = {"",      "BYTE", "WORD", "", "DWORD",
+                                          "",      "",     "",     "QWORD"};
+        // objdump keeps these uppercase as well
+        out_->Put(kPtrName[GetOperandSize(k, instr)]);
+        out_->Put(" PTR ");
+      }
+      PrintEffectiveAddress(instr);
+      return;
+    case K::kGb:
+    case K::kGv:
+      PrintName(GetRegName(GetOperandSize(k, instr), reg, has_rex));
+      return;
+    case K::kSw:
+      PrintName(kSegRegName[instr.GetReg()]);
+      return;
+    case K::kZb:
+    case K::kZv:
+      PrintName(GetRegName(GetOperandSize(k, instr), z, has_rex));
+      return;
+    case K::kAL:
+    case K::kRAX:
+      PrintName(GetRegName(GetOperandSize(k, instr), 0, false));
+      return;
+    case K::kCL:
+      PrintName("CL");
+      return;
+    case K::kDX:
+      PrintName("DX");
+      return;
+    case K::kOne:
+      out_->Put('1');
+      return;
+    case K::kIbs:
+    case K::kIz:
+      if (is_objdump_) {
+        // objdump shows the value sign-extended to the operand size
+        uint64_t v = SignExtend(instr.imm, instr.imm_size);
+        if (instr.operand_size < 8) {
+          v &= (uint64_t{1} << (instr.operand_size * 8)) - 1;
+        }
+        PrintHex(v, 1);
+        return;
+      }
+      PrintImm(instr.imm, instr.imm_size);
+      return;
+    case K::kIb:
+    case K::kIw:
+    case K::kIv:
+      PrintImm(instr.imm, instr.imm_size);
+      return;
+    case K::kJb:
+    case K::kJz: {
+      uint64_t target = GetBranchTarget(instr, addr);
+      if (is_objdump_) {
+        out_->PutHex(target, 1, false);
+      } else {
+        PrintHex(target, 1);
+      }
+      return;
+    }
+    case K::kOb:
+    case K::kOv:
+      if (instr.segment) {
+        PrintName(kSegRegName[instr.segment - 1]);
+        out_->Put(':');
+      }
+      PrintAbsoluteAddress(instr, instr.imm, instr.imm_size);
+      return;
+    case K::kAp:
+      PrintHex(instr.imm, 1);
+      return;
+    case K::kES:
+    case K::kCS:
+    case K::kSS:
+    case K::kDS:
+    case K::kFS:
+    case K::kGS:
+      PrintName(kSegRegName[static_cast<int>(k) - static_cast<int>(K::kES)]);
+      return;
+    case K::kNone:
+      return;
+    }
+  }
+
+  OutputBuffer *out_;
+  bool is_objdump_;
+};
+
+// Appends "%8x:"
+void PutAddress(OutputBuffer *out, uint64_t addr) {
+  int digits = 1;
+  for (uint64_t v = addr >> 4; v; v >>= 4) {
+    digits++;
+  }
+  for (; digits < 8; digits++) {
+    out->Put(' ');
+  }
+  out->PutHex(addr, 1, false);
+  out->Put(':');
+}
+
+}  // namespace
+
+void PutJSONString(OutputBuffer *out, const char *s) {
+  for (; *s; s++) {
+    const uint8_t c = *s;
+    if (c == '"' || c == '\\') {
+      out->Put('\\');
+      out->Put(c);
+    } else if (c < 0x20) {
+      out->Put("\\u00");
+      out->PutHex(c, 2, false);
+    } else {
+      out->Put(c);
+    }
+  }
+}
+
+void FormatSectionHeader(OutputBuffer *out, OutputStyle style,
+                         const char *name) {
+  if (style == OutputStyle::kJSON) {
+    out->Put("{\"type\":\"section\",\"name\":\"");
+    PutJSONString(out, name);
+    out->Put("\"}\n");
+    return;
+  }
+  out->Put("\nDisassembly of section ");
+  out->Put(name);
+  out->Put(":\n");
+}
+
+void FormatLabel(OutputBuffer *out, OutputStyle style, uint64_t addr,
+                 const char *name) {
+  if (style == OutputStyle::kJSON) {
+    out->Put("{\"type\":\"label\",\"addr\":");
+    out->PutDec(addr);
+    out->Put(",\"name\":\"");
+    PutJSONString(out, name);
+    out->Put("\"}\n");
+    return;
+  }
+  out->Put('\n');
+  out->PutHex(addr, 16, false);
+  out->Put(" <");
+  out->Put(name);
+  out->Put(">:\n");
+}
+
+void FormatInstr(OutputBuffer *out, OutputStyle style, const Instr &instr,
+                 const uint8_t *bytes, uint64_t addr) {
+  switch (style) {
+  case OutputStyle::kCompact:
+    PutAddress(out, addr);
+    out->Put('\t');
+    for (int i = 0; i < instr.length; i++) {
+      out->PutHex(bytes[i], 2);
+      out->Put(i < instr.length - 1 ? ' ' : '\t');
+    }
+    InstrPrinter(out, false).Print(instr, addr);
+    out->Put('\n');
+    return;
+  case OutputStyle::kObjdump: {
+    // At most 7 bytes per line, the rest on continuation lines
+    constexpr int kBytesPerLine = 7;
+    PutAddress(out, addr);
+    out->Put('\t');
+    const size_t bytes_begin = out->GetSize();
+    for (int i = 0; i < instr.length && i < kBytesPerLine; i++) {
+      out->PutHex(bytes[i], 2, false);
+      out->Put(' ');
+    }
+    out->PadTo(bytes_begin, kBytesPerLine * 3);
+    out->Put('\t');
+    InstrPrinter(out, true).Print(instr, addr);
+    out->Put('\n');
+    for (int i = kBytesPerLine; i < instr.length; i += kBytesPerLine) {
+      PutAddress(out, addr + i);
+      out->Put('\t');
+      for (int k = i; k < instr.length && k < i + kBytesPerLine; k++) {
+        out->PutHex(bytes[k], 2, false);
+        out->Put(' ');
+      }
+      out->Put('\n');
+    }
+    return;
+  }
+  case OutputStyle::kJSON:
+    out->Put("{\"type\":\"instr\",\"addr\":");
+    out->PutDec(addr);
+    out->Put(",\"bytes\":\"");
+    for (int i = 0; i < instr.length; i++) {
+      out->PutHex(bytes[i], 2, false);
+    }
+    out->Put("\",\"text\":\"");
+    // The instruction text never contains characters to escape
+    InstrPrinter(out, false).Print(instr, addr);
+    out->Put("\"}\n");
+    return;
+  }
+}
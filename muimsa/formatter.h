@@ -0,0 +1,72 @@
+#ifndef MUIMSA_FORMATTER_H_
+#define MUIMSA_FORMATTER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "decoder.h"
+
+// A large reusable output buffer. Text is appended with hand-rolled number
+// conversions (no stdio formatting) and written to fd in big chunks by
+// FlushIfFull(), which writers call between lines. With fd < 0 the text is
+// kept in memory until Clear().
+class OutputBuffer {
+public:
+  static constexpr size_t kFlushThreshold = 1 << 20;
+
+  explicit OutputBuffer(int fd = -1);
+  OutputBuffer(const OutputBuffer &) = delete;
+  OutputBuffer &operator=(const OutputBuffer &) = delete;
+  ~OutputBuffer() { Flush(); }
+
+  void Put(char c) {
+    if (size_ == buf_.size()) {
+      MakeRoom(1);
+    }
+    buf_[size_++] = c;
+  }
+  void Put(const char *s);
+  void Put(const char *s, size_t len);
+  // Appends v in hex without "0x", zero-padded to at least min_digits.
+  void PutHex(uint64_t v, int min_digits = 1, bool is_upper = true);
+  void PutDec(uint64_t v);
+  // Appends ' ' until column characters have been written since line_begin.
+  void PadTo(size_t line_begin, size_t column);
+
+  const char *GetData() const { return buf_.data(); }
+  size_t GetSize() const { return size_; }
+  void Clear() { size_ = 0; }
+  // Writes everything to fd (no-op for in-memory buffers).
+  void Flush();
+  void FlushIfFull() {
+    if (size_ >= kFlushThreshold) {
+      Flush();
+    }
+  }
+
+private:
+  void MakeRoom(size_t len);
+
+  std::vector<char> buf_;
+  size_t size_ = 0;
+  int fd_;
+};
+
+enum class OutputStyle {
+  kCompact,  // "addr:<TAB>BYTES<TAB>MNEMONIC OPERANDS", uppercase
+  kObjdump,  // the layout of `objdump -d -M intel`
+  kJSON,     // one JSON object per line
+};
+
+// Appends s as the contents of a JSON string (without the quotes).
+void PutJSONString(OutputBuffer *out, const char *s);
+
+void FormatSectionHeader(OutputBuffer *out, OutputStyle style,
+                         const char *name);
+void FormatLabel(OutputBuffer *out, OutputStyle style, uint64_t addr,
+                 const char *name);
+void FormatInstr(OutputBuffer *out, OutputStyle style, const Instr &instr,
+                 const uint8_t *bytes, uint64_t addr);
+
+#endif  // MUIMSA_FORMATTER_H_
@@ -1,151 +1,184 @@
-#include <cassert>
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
-#include <iostream>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+#include <unistd.h>
 #include <vector>
 
+#include "cfg.h"
+#include "decoder.h"
+#include "disassembler.h"
+#include "formatter.h"
+#include "object_file.h"
+#include "stats.h"
+
 using namespace std;
 
-class Imm {
-public:
-  Imm(const vector<uint8_t> &bin, vector<uint8_t>::const_iterator &it,
-      int size) {
-    assert(size == 1 || size == 2 || size == 4 || size == 8);
-    size_ = size;
-    value_ = 0;
-    for (int i = 0; i < size; i++) {
-      assert(it != bin.end());
-      value_ |= (static_cast<uint64_t>(*it) << (i * 8));
-      ++it;
-    }
-  }
-  void Print() {
-    if (size_ == 1) {
-      printf("0x%02llX", value_);
-    } else if (size_ == 2) {
-      printf("0x%04llX", value_);
-    } else if (size_ == 4) {
-      printf("0x%08llX", value_);
-    } else if (size_ == 8) {
-      printf("0x%016llX", value_);
-    }
+void Disassemble(OutputBuffer *out, const uint8_t *bin, size_t size,
+                 CPUMode mode) {
+  Instr instr;
+  for (size_t ofs = 0; ofs < size;) {
+    Decode(&bin[ofs], size - ofs, mode, &instr);
+    FormatInstr(out, OutputStyle::kCompact, instr, &bin[ofs], ofs);
+    ofs += instr.length;
   }
-  uint64_t GetByteSize() { return size_; }
-
-private:
-  uint64_t value_;
-  uint64_t size_;
-};
+}
 
-class ModRM {
-public:
-  ModRM(uint8_t byte) {
-    mod_ = (byte >> 6) & 0b11;
-    reg_ = (byte >> 3) & 0b111;
-    r_m_ = byte & 0b111;
+// Prints the offset and the length of each instruction.
+void PrintLengths(OutputBuffer *out, const uint8_t *bin, size_t size,
+                  uint64_t addr, CPUMode mode) {
+  vector<uint8_t> lengths(size);
+  size_t n = DecodeLengths(bin, size, mode, lengths.data());
+  for (size_t i = 0; i < n; i++) {
+    out->PutHex(addr, 8, false);
+    out->Put(' ');
+    out->PutDec(lengths[i]);
+    out->Put('\n');
+    out->FlushIfFull();
+    addr += lengths[i];
   }
-  void Print() { printf("ModRM(%01X %01X %01X) ", mod_, reg_, r_m_); }
-  int GetNumOfDispBytes() {
-    // Table 2-2. 32-Bit Addressing Forms with the ModR/M Byte
-    if (mod_ == 0b00 && r_m_ == 0b101) {
-      return 4;
+}
+
+void BenchLengths(const uint8_t *bin, size_t size, CPUMode mode) {
+  constexpr int kNumOfRounds = 20;
+  vector<uint8_t> lengths(size);
+  size_t n = DecodeLengths(bin, size, mode, lengths.data());  // warm up
+  double best = 1e9;
+  for (int i = 0; i < kNumOfRounds; i++) {
+    auto begin = chrono::steady_clock::now();
+    DecodeLengths(bin, size, mode, lengths.data());
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - begin;
+    if (elapsed.count() < best) {
+      best = elapsed.count();
     }
-    if (mod_ == 0b01) {
-      return 1;
+  }
+  printf("DecodeLengths: %zu bytes, %zu instrs, %.3f GB/s, %.2f ns/instr\n",
+         size, n, size / best / 1e9, best * 1e9 / n);
+
+  best = 1e9;
+  Instr instr;
+  for (int i = 0; i < kNumOfRounds / 4; i++) {
+    auto begin = chrono::steady_clock::now();
+    for (size_t ofs = 0; ofs < size; ofs += instr.length) {
+      Decode(&bin[ofs], size - ofs, mode, &instr);
     }
-    if (mod_ == 0b10) {
-      return 4;
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - begin;
+    if (elapsed.count() < best) {
+      best = elapsed.count();
     }
-    return 0;
-  }
-  const char *GetRegName32() {
-    static const char *kRegName32[8] = {
-        "EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI",
-    };
-    assert(reg_ < 8);
-    return kRegName32[reg_];
   }
-  void PrintEffectiveAddress(Imm *disp) {
-    if (mod_ == 0b00 && r_m_ == 0b101) {
-      // Table 2-7. RIP-Relative Addressing
-      // In protected / compatibility mode: [Disp32]
-      // In 64-bit mode: [RIP + Disp32]
-      assert(disp);
-      assert(disp->GetByteSize() == 4);
-      printf("[");
-      disp->Print();
-      printf("]");
-      return;
-    }
-    assert(false);
-  };
-
-private:
-  uint8_t mod_;
-  uint8_t reg_;
-  uint8_t r_m_;
-};
+  printf("Decode:        %zu bytes, %zu instrs, %.3f GB/s, %.2f ns/instr\n",
+         size, n, size / best / 1e9, best * 1e9 / n);
+}
 
-class Op {
-public:
-  Op(const vector<uint8_t> &bin, vector<uint8_t>::const_iterator &it) {
-    assert(it != bin.end());
-    begin_ = it;
-    op0_ = static_cast<Opcode0>(*it);
-    if (op0_ == Opcode0::kADDGvEv) {
-      // ADD Gv, Ev
-      ++it;
-      mod_rm_ = new ModRM(*it);
-      ++it;
-      int disp_size = mod_rm_->GetNumOfDispBytes();
-      if (disp_size) {
-        disp_ = new Imm(bin, it, disp_size);
-      }
-      length_ = it - begin_;
-      return;
+int main(int argc, char *argv[]) {
+  CPUMode mode = CPUMode::k64;
+  bool is_mode_specified = false;
+  bool is_lengths_mode = false;
+  bool is_bench_mode = false;
+  bool is_stats_mode = false;
+  bool is_cfg_mode = false;
+  CFGStyle cfg_style = CFGStyle::kDOT;
+  int num_of_threads = max(1u, thread::hardware_concurrency());
+  size_t chunk_size = 0;
+  OutputStyle style = OutputStyle::kCompact;
+  const char *path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--lengths") == 0) {
+      is_lengths_mode = true;
+    } else if (strcmp(argv[i], "--bench-lengths") == 0) {
+      is_bench_mode = true;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      is_stats_mode = true;
+    } else if (strcmp(argv[i], "--cfg=dot") == 0) {
+      is_cfg_mode = true;
+      cfg_style = CFGStyle::kDOT;
+    } else if (strcmp(argv[i], "--cfg=json") == 0) {
+      is_cfg_mode = true;
+      cfg_style = CFGStyle::kJSON;
+    } else if (strcmp(argv[i], "--16") == 0) {
+      mode = CPUMode::k16;
+      is_mode_specified = true;
+    } else if (strcmp(argv[i], "--32") == 0) {
+      mode = CPUMode::k32;
+      is_mode_specified = true;
+    } else if (strcmp(argv[i], "--format=compact") == 0) {
+      style = OutputStyle::kCompact;
+    } else if (strcmp(argv[i], "--format=objdump") == 0) {
+      style = OutputStyle::kObjdump;
+    } else if (strcmp(argv[i], "--format=json") == 0) {
+      style = OutputStyle::kJSON;
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      num_of_threads = max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--chunk-size") == 0 && i + 1 < argc) {
+      chunk_size = strtoull(argv[++i], nullptr, 0);
+    } else if (argv[i][0] != '-' && !path) {
+      path = argv[i];
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--lengths | --bench-lengths | --stats | "
+              "--cfg=dot|json] [--16 | --32] "
+              "[--format=compact|objdump|json] [-j <threads>] "
+              "[--chunk-size <bytes>] "
+              "<ELF64, Mach-O or raw binary>\n",
+              argv[0]);
+      return EXIT_FAILURE;
     }
-    ++it;
-    length_ = it - begin_;
   }
-  void Print() {
-    for (int i = 0; i < length_; i++) {
-      printf("%02X%c", *(begin_ + i), (i < length_ - 1) ? ' ' : '\t');
+  OutputBuffer out(STDOUT_FILENO);
+  if (path) {
+    ObjectFile obj;
+    if (!obj.Open(path)) {
+      return EXIT_FAILURE;
     }
-    printf("%s ", GetMnemonic());
-    if (op0_ == Opcode0::kADDGvEv) {
-      assert(mod_rm_);
-      printf("%s, ", mod_rm_->GetRegName32());
-      mod_rm_->PrintEffectiveAddress(disp_);
+    if (!is_mode_specified) {
+      mode = obj.GetCPUMode();
     }
-    printf("\n");
-  }
-  const char *GetMnemonic() {
-    if (op0_ == Opcode0::kADDGvEv) {
-      return "ADD";
+    constexpr int kNumOfTopEntries = 20;
+    unique_ptr<InstrStats> stats(new InstrStats());
+    const vector<Section> &sections = obj.GetSections();
+    if (is_cfg_mode) {
+      PrintCFGHeader(&out, cfg_style);
     }
-    return "(Unknown)";
-  }
-
-private:
-  enum class Opcode0 : uint8_t {
-    kADDGvEv = 0x03,
-  };
-  int length_;
-  vector<uint8_t>::const_iterator begin_;
-  Opcode0 op0_;
-  ModRM *mod_rm_ = nullptr;
-  Imm *disp_ = nullptr;
-};
-
-void Disassemble(const vector<uint8_t> &bin) {
-  auto begin = bin.begin();
-  auto it = begin;
-  while (it != bin.end()) {
-    Op op(bin, it);
-    op.Print();
+    for (size_t i = 0; i < sections.size(); i++) {
+      const Section &section = sections[i];
+      if (!section.is_executable || !section.size) {
+        continue;
+      }
+      if (is_bench_mode) {
+        printf("%s:\n", section.name.c_str());
+        fflush(stdout);
+        BenchLengths(section.data, section.size, mode);
+      } else if (is_stats_mode) {
+        CollectStats(section.data, section.size, mode, num_of_threads,
+                     stats.get());
+      } else if (is_cfg_mode) {
+        for (const Function &func : AnalyzeSection(obj, i, mode)) {
+          PrintCFG(&out, cfg_style, func);
+          out.FlushIfFull();
+        }
+      } else if (is_lengths_mode) {
+        PrintLengths(&out, section.data, section.size, section.addr, mode);
+      } else {
+        DisassembleSection(&out, style, obj, i, mode, num_of_threads,
+                           chunk_size);
+      }
+    }
+    if (is_cfg_mode) {
+      PrintCFGFooter(&out, cfg_style);
+    }
+    if (is_stats_mode) {
+      stats->Print(&out, kNumOfTopEntries);
+    }
+    return 0;
   }
-}
 
-int main(int argc, char *argv[]) {
   // Example A-1. Look-up Example for 1-Byte Opcodes
   // ADD EAX, [0x0000'0000]
   vector<uint8_t> bin{
@@ -153,6 +186,18 @@ int main(int argc, char *argv[]) {
       0x03, 0x05, 0x78, 0x56, 0x34, 0x12, // ADD EAX, [0x12345678]
       0x03, 0x15, 0x58, 0x0e, 0x03, 0x00, // ADD EDX, [0x00030E58]
   };
-  Disassemble(bin);
+  Disassemble(&out, bin.data(), bin.size(), CPUMode::k32);
+
+  // Tests/Linux/loop0_asmium.s
+  vector<uint8_t> bin64{
+      0xc7, 0xc7, 0x00, 0x00, 0x00, 0x00,       // MOV EDI, 0x00000000
+      0xff, 0xc7,                               // INC EDI
+      0x83, 0xff, 0x0a,                         // CMP EDI, 0x0A
+      0x75, 0xf9,                               // JNE 0x6
+      0x48, 0xc7, 0xc0, 0x01, 0x00, 0x00, 0x02, // MOV RAX, 0x02000001
+      0x0f, 0x05,                               // SYSCALL
+      0xc3,                                     // RET
+  };
+  Disassemble(&out, bin64.data(), bin64.size(), CPUMode::k64);
   return 0;
 }
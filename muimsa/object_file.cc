@@ -0,0 +1,312 @@
+#include "object_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+template <typename T> T Read(const uint8_t *p) {
+  T v;
+  memcpy(&v, p, sizeof(T));
+  return v;
+}
+
+// Returns the NUL-terminated string at strtab[ofs], or nullptr if it does not
+// end inside the table.
+const char *GetString(const uint8_t *strtab, size_t strtab_size, uint32_t ofs) {
+  if (!strtab || ofs >= strtab_size ||
+      !memchr(&strtab[ofs], 0, strtab_size - ofs)) {
+    return nullptr;
+  }
+  return reinterpret_cast<const char *>(&strtab[ofs]);
+}
+
+// ELF64 (System V ABI, the layout gen_elf64.c writes)
+constexpr size_t kELFHeaderSize = 0x40;
+constexpr size_t kELFSectionHeaderSize = 0x40;
+constexpr size_t kELFSymbolSize = 0x18;
+constexpr uint16_t kELFMachineX86_64 = 0x3e;
+constexpr uint32_t kELFSectionNoBits = 8;
+constexpr uint32_t kELFSectionSymTab = 2;
+constexpr uint32_t kELFSectionDynSym = 11;
+constexpr uint64_t kELFSectionExecutable = 4;
+constexpr uint16_t kELFSectionIndexReserved = 0xff00;
+constexpr uint8_t kELFSymbolNoType = 0;
+constexpr uint8_t kELFSymbolFunc = 2;
+
+// Mach-O 64
+constexpr uint32_t kMachOMagic64 = 0xfeedfacf;
+constexpr uint32_t kMachOCPUTypeX86_64 = 0x01000007;
+constexpr size_t kMachOHeaderSize = 0x20;
+constexpr uint32_t kMachOSegment64 = 0x19;
+constexpr uint32_t kMachOSymTab = 0x02;
+constexpr size_t kMachOSegment64Size = 0x48;
+constexpr size_t kMachOSection64Size = 0x50;
+constexpr size_t kMachONList64Size = 0x10;
+constexpr uint32_t kMachOSectionTypeMask = 0xff;
+constexpr uint32_t kMachOSectionZeroFill = 0x01;
+constexpr uint32_t kMachOSectionGBZeroFill = 0x0c;
+constexpr uint32_t kMachOSectionThreadLocalZeroFill = 0x12;
+constexpr uint32_t kMachOSectionPureInstructions = 0x80000000;
+constexpr uint32_t kMachOSectionSomeInstructions = 0x00000400;
+constexpr uint8_t kMachOSymbolStab = 0xe0;
+constexpr uint8_t kMachOSymbolTypeMask = 0x0e;
+constexpr uint8_t kMachOSymbolSect = 0x0e;
+
+}  // namespace
+
+ObjectFile::~ObjectFile() {
+  if (base_) {
+    munmap(const_cast<uint8_t *>(base_), size_);
+  }
+}
+
+bool ObjectFile::Open(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    fprintf(stderr, "%s is empty or not a regular file\n", path);
+    close(fd);
+    return false;
+  }
+  void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "Failed to mmap %s\n", path);
+    return false;
+  }
+  base_ = static_cast<const uint8_t *>(p);
+  size_ = st.st_size;
+
+  static const uint8_t kELFMagic[] = {0x7f, 'E', 'L', 'F'};
+  if (size_ >= kELFHeaderSize && memcmp(base_, kELFMagic, 4) == 0) {
+    format_ = Format::kELF64;
+    return ParseELF64();
+  }
+  if (size_ >= kMachOHeaderSize && Read<uint32_t>(base_) == kMachOMagic64) {
+    format_ = Format::kMachO64;
+    return ParseMachO64();
+  }
+  ParseRaw();
+  return true;
+}
+
+const uint8_t *ObjectFile::GetRange(uint64_t ofs, uint64_t size) const {
+  if (ofs > size_ || size > size_ - ofs) {
+    return nullptr;
+  }
+  return &base_[ofs];
+}
+
+bool ObjectFile::ParseELF64() {
+  if (base_[4] != 2 || base_[5] != 1) {
+    fprintf(stderr, "Only little endian ELF64 is supported\n");
+    return false;
+  }
+  if (Read<uint16_t>(&base_[18]) != kELFMachineX86_64) {
+    fprintf(stderr, "Not an x86_64 ELF file\n");
+    return false;
+  }
+  mode_ = CPUMode::k64;
+  const uint64_t shoff = Read<uint64_t>(&base_[40]);
+  const uint16_t shentsize = Read<uint16_t>(&base_[58]);
+  const uint16_t shnum = Read<uint16_t>(&base_[60]);
+  const uint16_t shstrndx = Read<uint16_t>(&base_[62]);
+  if (shnum == 0) {
+    return true;
+  }
+  const uint8_t *shdrs = GetRange(shoff, uint64_t{shentsize} * shnum);
+  if (!shdrs || shentsize < kELFSectionHeaderSize) {
+    fprintf(stderr, "Broken ELF section header table\n");
+    return false;
+  }
+  auto get_shdr = [&](int i) { return &shdrs[i * shentsize]; };
+
+  const uint8_t *shstrtab = nullptr;
+  uint64_t shstrtab_size = 0;
+  if (shstrndx < shnum) {
+    const uint8_t *shdr = get_shdr(shstrndx);
+    shstrtab_size = Read<uint64_t>(&shdr[32]);
+    shstrtab = GetRange(Read<uint64_t>(&shdr[24]), shstrtab_size);
+  }
+
+  // sections_[i] corresponds to the ELF section header i so that st_shndx
+  // can be used as is.
+  int symtab_index = -1;
+  for (int i = 0; i < shnum; i++) {
+    const uint8_t *shdr = get_shdr(i);
+    const uint32_t type = Read<uint32_t>(&shdr[4]);
+    const uint64_t flags = Read<uint64_t>(&shdr[8]);
+    const uint64_t size = Read<uint64_t>(&shdr[32]);
+    const char *name =
+        GetString(shstrtab, shstrtab_size, Read<uint32_t>(&shdr[0]));
+    Section section;
+    section.name = name ? name : "";
+    section.addr = Read<uint64_t>(&shdr[16]);
+    section.data = nullptr;
+    section.size = size;
+    section.is_executable = false;
+    if (i != 0 && type != kELFSectionNoBits) {
+      section.data = GetRange(Read<uint64_t>(&shdr[24]), size);
+      if (!section.data) {
+        fprintf(stderr, "Section %s is out of the file\n",
+                section.name.c_str());
+        return false;
+      }
+      section.is_executable = flags & kELFSectionExecutable;
+    }
+    sections_.push_back(section);
+    // Prefer .symtab, use .dynsym for stripped binaries
+    if (type == kELFSectionSymTab ||
+        (type == kELFSectionDynSym && symtab_index < 0)) {
+      symtab_index = i;
+    }
+  }
+  if (symtab_index < 0) {
+    return true;
+  }
+
+  const uint8_t *shdr = get_shdr(symtab_index);
+  const uint32_t link = Read<uint32_t>(&shdr[40]);
+  if (link >= shnum) {
+    fprintf(stderr, "Broken ELF symbol table\n");
+    return false;
+  }
+  const uint8_t *strtab = sections_[link].data;
+  const size_t strtab_size = strtab ? sections_[link].size : 0;
+  const uint8_t *syms = sections_[symtab_index].data;
+  const size_t num_of_syms = sections_[symtab_index].size / kELFSymbolSize;
+  for (size_t i = 0; i < num_of_syms; i++) {
+    const uint8_t *sym = &syms[i * kELFSymbolSize];
+    const uint8_t type = sym[4] & 0xf;
+    const uint16_t shndx = Read<uint16_t>(&sym[6]);
+    if ((type != kELFSymbolNoType && type != kELFSymbolFunc) || shndx == 0 ||
+        shndx >= kELFSectionIndexReserved || shndx >= shnum) {
+      continue;
+    }
+    const char *name = GetString(strtab, strtab_size, Read<uint32_t>(sym));
+    if (!name || !name[0]) {
+      continue;
+    }
+    symbols_.push_back(
+        {name, Read<uint64_t>(&sym[8]), Read<uint64_t>(&sym[16]), shndx});
+  }
+  stable_sort(symbols_.begin(), symbols_.end(),
+              [](const Symbol &a, const Symbol &b) { return a.addr < b.addr; });
+  return true;
+}
+
+bool ObjectFile::ParseMachO64() {
+  if (Read<uint32_t>(&base_[4]) != kMachOCPUTypeX86_64) {
+    fprintf(stderr, "Not an x86_64 Mach-O file\n");
+    return false;
+  }
+  mode_ = CPUMode::k64;
+  const uint32_t ncmds = Read<uint32_t>(&base_[16]);
+  const uint8_t *symtab_cmd = nullptr;
+  uint64_t ofs = kMachOHeaderSize;
+  for (uint32_t i = 0; i < ncmds; i++) {
+    const uint8_t *cmd = GetRange(ofs, 8);
+    const uint32_t cmdsize = cmd ? Read<uint32_t>(&cmd[4]) : 0;
+    if (!cmd || cmdsize < 8 || !GetRange(ofs, cmdsize)) {
+      fprintf(stderr, "Broken Mach-O load command\n");
+      return false;
+    }
+    const uint32_t type = Read<uint32_t>(cmd);
+    if (type == kMachOSegment64 && cmdsize >= kMachOSegment64Size) {
+      const uint32_t nsects = Read<uint32_t>(&cmd[64]);
+      if (kMachOSegment64Size + uint64_t{nsects} * kMachOSection64Size >
+          cmdsize) {
+        fprintf(stderr, "Broken Mach-O segment\n");
+        return false;
+      }
+      for (uint32_t k = 0; k < nsects; k++) {
+        const uint8_t *sect =
+            &cmd[kMachOSegment64Size + k * kMachOSection64Size];
+        const uint32_t flags = Read<uint32_t>(&sect[64]);
+        const uint32_t sect_type = flags & kMachOSectionTypeMask;
+        Section section;
+        section.name =
+            string(reinterpret_cast<const char *>(&sect[16]),
+                   strnlen(reinterpret_cast<const char *>(&sect[16]), 16)) +
+            "," +
+            string(reinterpret_cast<const char *>(sect),
+                   strnlen(reinterpret_cast<const char *>(sect), 16));
+        section.addr = Read<uint64_t>(&sect[32]);
+        section.size = Read<uint64_t>(&sect[40]);
+        section.data = nullptr;
+        section.is_executable = false;
+        if (sect_type != kMachOSectionZeroFill &&
+            sect_type != kMachOSectionGBZeroFill &&
+            sect_type != kMachOSectionThreadLocalZeroFill) {
+          section.data = GetRange(Read<uint32_t>(&sect[48]), section.size);
+          if (!section.data) {
+            fprintf(stderr, "Section %s is out of the file\n",
+                    section.name.c_str());
+            return false;
+          }
+          section.is_executable =
+              flags &
+              (kMachOSectionPureInstructions | kMachOSectionSomeInstructions);
+        }
+        sections_.push_back(section);
+      }
+    } else if (type == kMachOSymTab && cmdsize >= 24) {
+      symtab_cmd = cmd;
+    }
+    ofs += cmdsize;
+  }
+  if (!symtab_cmd) {
+    return true;
+  }
+
+  const uint32_t nsyms = Read<uint32_t>(&symtab_cmd[12]);
+  const uint32_t strsize = Read<uint32_t>(&symtab_cmd[20]);
+  const uint8_t *syms = GetRange(Read<uint32_t>(&symtab_cmd[8]),
+                                 uint64_t{nsyms} * kMachONList64Size);
+  const uint8_t *strtab = GetRange(Read<uint32_t>(&symtab_cmd[16]), strsize);
+  if (!syms || !strtab) {
+    fprintf(stderr, "Broken Mach-O symbol table\n");
+    return false;
+  }
+  for (uint32_t i = 0; i < nsyms; i++) {
+    const uint8_t *sym = &syms[i * kMachONList64Size];
+    const uint8_t type = sym[4];
+    const uint8_t sect = sym[5];  // 1-origin
+    if ((type & kMachOSymbolStab) ||
+        (type & kMachOSymbolTypeMask) != kMachOSymbolSect || sect == 0 ||
+        sect > sections_.size()) {
+      continue;
+    }
+    const char *name = GetString(strtab, strsize, Read<uint32_t>(sym));
+    if (!name || !name[0]) {
+      continue;
+    }
+    symbols_.push_back({name, Read<uint64_t>(&sym[8]), 0, sect - 1});
+  }
+  stable_sort(symbols_.begin(), symbols_.end(),
+              [](const Symbol &a, const Symbol &b) { return a.addr < b.addr; });
+  return true;
+}
+
+void ObjectFile::ParseRaw() {
+  Section section;
+  section.name = ".raw";
+  section.addr = 0;
+  section.data = base_;
+  section.size = size_;
+  section.is_executable = true;
+  sections_.push_back(section);
+}
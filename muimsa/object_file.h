@@ -0,0 +1,68 @@
+#ifndef MUIMSA_OBJECT_FILE_H_
+#define MUIMSA_OBJECT_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "decoder.h"
+
+struct Section {
+  std::string name;
+  uint64_t addr;
+  const uint8_t *data;  // points into the mapped file
+  size_t size;
+  bool is_executable;
+};
+
+struct Symbol {
+  const char *name;  // points into the mapped file
+  uint64_t addr;
+  uint64_t size;  // 0 if unknown
+  int section;    // index in ObjectFile::GetSections()
+};
+
+// A read-only view of an ELF64 or Mach-O (x86_64) file. The file is mapped
+// with mmap() and section contents are referenced in place, never copied.
+// Files that are neither are treated as a raw binary in one executable
+// section.
+class ObjectFile {
+public:
+  enum class Format {
+    kRaw,
+    kELF64,
+    kMachO64,
+  };
+
+  ObjectFile() = default;
+  ObjectFile(const ObjectFile &) = delete;
+  ObjectFile &operator=(const ObjectFile &) = delete;
+  ~ObjectFile();
+
+  // Maps and parses the file at path. Prints a message to stderr and returns
+  // false on failure.
+  bool Open(const char *path);
+
+  Format GetFormat() const { return format_; }
+  CPUMode GetCPUMode() const { return mode_; }
+  const std::vector<Section> &GetSections() const { return sections_; }
+  // Sorted by address
+  const std::vector<Symbol> &GetSymbols() const { return symbols_; }
+
+private:
+  bool ParseELF64();
+  bool ParseMachO64();
+  void ParseRaw();
+  // Returns p + ofs if [ofs, ofs + size) is inside the file, nullptr otherwise
+  const uint8_t *GetRange(uint64_t ofs, uint64_t size) const;
+
+  const uint8_t *base_ = nullptr;
+  size_t size_ = 0;
+  Format format_ = Format::kRaw;
+  CPUMode mode_ = CPUMode::k64;
+  std::vector<Section> sections_;
+  std::vector<Symbol> symbols_;
+};
+
+#endif  // MUIMSA_OBJECT_FILE_H_
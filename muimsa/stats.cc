@@ -0,0 +1,234 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+using K = OperandKind;
+
+constexpr int kLabelWidth = 24;
+
+// Appends num / den with two decimal places.
+void PutRatio(OutputBuffer *out, uint64_t num, uint64_t den) {
+  const uint64_t v = den ? (num * 100 + den / 2) / den : 0;
+  out->PutDec(v / 100);
+  out->Put('.');
+  out->Put(static_cast<char>('0' + v / 10 % 10));
+  out->Put(static_cast<char>('0' + v % 10));
+}
+
+void PutPercent(OutputBuffer *out, uint64_t n, uint64_t total) {
+  PutRatio(out, n * 100, total);
+  out->Put('%');
+}
+
+// Finishes a row whose label started at label_begin with ": n (n/total%)".
+void PutCount(OutputBuffer *out, size_t label_begin, uint64_t n,
+              uint64_t total) {
+  out->PadTo(label_begin, kLabelWidth);
+  out->Put(": ");
+  out->PutDec(n);
+  if (total) {
+    out->Put(" (");
+    PutPercent(out, n, total);
+    out->Put(')');
+  }
+  out->Put('\n');
+}
+
+void PutRow(OutputBuffer *out, const char *label, uint64_t n, uint64_t total) {
+  const size_t begin = out->GetSize();
+  out->Put(label);
+  PutCount(out, begin, n, total);
+}
+
+bool HasMemoryOperand(const Instr &instr) {
+  for (int i = 0; i < 3; i++) {
+    switch (instr.operands[i]) {
+    case K::kEb:
+    case K::kEv:
+    case K::kEw:
+    case K::kEd:
+    case K::kM:
+      if (instr.GetMod() != 3) {
+        return true;
+      }
+      break;
+    case K::kOb:
+    case K::kOv:
+      return true;
+    default:
+      break;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+void InstrStats::Add(const Instr &instr) {
+  num_of_instrs++;
+  num_of_bytes += instr.length;
+  by_length[instr.length <= kMaxLength ? instr.length : 0]++;
+  if (instr.flags & kInstrInvalid) {
+    num_of_invalid++;
+    return;
+  }
+  by_opcode[static_cast<int>(instr.map)][instr.opcode]++;
+  by_mnemonic[static_cast<int>(instr.mnemonic)]++;
+  const int num_of_legacy_prefixes =
+      instr.num_of_prefixes - (instr.rex ? 1 : 0);
+  with_legacy_prefix += num_of_legacy_prefixes > 0;
+  with_lock += (instr.prefixes & kPrefixLock) != 0;
+  with_rep += (instr.prefixes & (kPrefixRep | kPrefixRepne)) != 0;
+  with_opsize += (instr.prefixes & kPrefixOpSize) != 0;
+  with_addrsize += (instr.prefixes & kPrefixAddrSize) != 0;
+  with_segment += instr.segment != 0;
+  with_rex += instr.rex != 0;
+  with_rex_w += (instr.rex & 8) != 0;
+  with_memory_operand += HasMemoryOperand(instr);
+  rip_relative += (instr.flags & kInstrRIPRelative) != 0;
+  const bool is_rel8 = instr.operands[0] == K::kJb;
+  const bool is_rel32 = instr.operands[0] == K::kJz;
+  branch_rel8 += is_rel8;
+  branch_rel32 += is_rel32;
+  // rel8/rel32 are stored as the immediate as well
+  with_immediate += instr.imm_size != 0 && !is_rel8 && !is_rel32;
+}
+
+void InstrStats::Merge(const InstrStats &other) {
+  // Every member is a uint64_t counter
+  static_assert(sizeof(InstrStats) % sizeof(uint64_t) == 0, "");
+  uint64_t *dst = reinterpret_cast<uint64_t *>(this);
+  const uint64_t *src = reinterpret_cast<const uint64_t *>(&other);
+  for (size_t i = 0; i < sizeof(InstrStats) / sizeof(uint64_t); i++) {
+    dst[i] += src[i];
+  }
+}
+
+void InstrStats::Print(OutputBuffer *out, int top_n) const {
+  const uint64_t n = num_of_instrs;
+  PutRow(out, "instructions", n, 0);
+  PutRow(out, "bytes", num_of_bytes, 0);
+  const size_t begin = out->GetSize();
+  out->Put("average length");
+  out->PadTo(begin, kLabelWidth);
+  out->Put(": ");
+  PutRatio(out, num_of_bytes, n);
+  out->Put('\n');
+  PutRow(out, "invalid", num_of_invalid, n);
+  PutRow(out, "legacy prefix", with_legacy_prefix, n);
+  PutRow(out, "  LOCK", with_lock, n);
+  PutRow(out, "  REP/REPNE", with_rep, n);
+  PutRow(out, "  operand size (66)", with_opsize, n);
+  PutRow(out, "  address size (67)", with_addrsize, n);
+  PutRow(out, "  segment", with_segment, n);
+  PutRow(out, "REX", with_rex, n);
+  PutRow(out, "  REX.W", with_rex_w, n);
+  PutRow(out, "memory operand", with_memory_operand, n);
+  PutRow(out, "  RIP-relative", rip_relative, n);
+  PutRow(out, "immediate", with_immediate, n);
+  PutRow(out, "branch rel8", branch_rel8, branch_rel8 + branch_rel32);
+  PutRow(out, "branch rel32", branch_rel32, branch_rel8 + branch_rel32);
+
+  out->Put("\nlength:\n");
+  for (int len = 1; len <= kMaxLength; len++) {
+    if (by_length[len]) {
+      const size_t begin = out->GetSize();
+      out->Put("  ");
+      out->PutDec(len);
+      PutCount(out, begin, by_length[len], n);
+    }
+  }
+
+  struct Entry {
+    uint64_t count;
+    int key;
+  };
+  vector<Entry> entries;
+  for (int map = 0; map < kNumOfMaps; map++) {
+    for (int op = 0; op < 256; op++) {
+      if (by_opcode[map][op]) {
+        entries.push_back({by_opcode[map][op], map << 8 | op});
+      }
+    }
+  }
+  auto by_count = [](const Entry &a, const Entry &b) {
+    return a.count != b.count ? a.count > b.count : a.key < b.key;
+  };
+  sort(entries.begin(), entries.end(), by_count);
+  out->Put("\ntop opcodes:\n");
+  static const char *kMapName[kNumOfMaps] = {"",     "0F ",  "0F38 ",
+                                             "0F3A ", "VEX ", "EVEX "};
+  for (int i = 0; i < top_n && i < static_cast<int>(entries.size()); i++) {
+    const size_t begin = out->GetSize();
+    out->Put("  ");
+    out->Put(kMapName[entries[i].key >> 8]);
+    out->PutHex(entries[i].key & 0xff, 2);
+    PutCount(out, begin, entries[i].count, n);
+  }
+
+  entries.clear();
+  for (int m = 0; m < static_cast<int>(Mnemonic::kNumOfMnemonics); m++) {
+    if (by_mnemonic[m]) {
+      entries.push_back({by_mnemonic[m], m});
+    }
+  }
+  sort(entries.begin(), entries.end(), by_count);
+  out->Put("\ntop mnemonics:\n");
+  for (int i = 0; i < top_n && i < static_cast<int>(entries.size()); i++) {
+    const size_t begin = out->GetSize();
+    out->Put("  ");
+    out->Put(GetMnemonicName(static_cast<Mnemonic>(entries[i].key)));
+    PutCount(out, begin, entries[i].count, n);
+  }
+}
+
+void CollectStats(const uint8_t *p, size_t size, CPUMode mode,
+                  int num_of_threads, InstrStats *stats) {
+  vector<uint8_t> lengths(size);
+  const size_t n = DecodeLengths(p, size, mode, lengths.data());
+  // Split the instructions evenly; each part starts at a true boundary.
+  num_of_threads = max(1, min<int>(num_of_threads, n / 4096 + 1));
+  vector<size_t> part_instr(num_of_threads + 1);
+  vector<size_t> part_ofs(num_of_threads + 1);
+  size_t ofs = 0;
+  for (size_t i = 0, part = 0; i <= n; i++) {
+    while (part <= static_cast<size_t>(num_of_threads) &&
+           i == n * part / num_of_threads) {
+      part_instr[part] = i;
+      part_ofs[part] = ofs;
+      part++;
+    }
+    if (i < n) {
+      ofs += lengths[i];
+    }
+  }
+  unique_ptr<InstrStats[]> part_stats(new InstrStats[num_of_threads]());
+  auto worker = [&](int part) {
+    InstrStats &s = part_stats[part];
+    Instr instr;
+    size_t ofs = part_ofs[part];
+    for (size_t i = part_instr[part]; i < part_instr[part + 1]; i++) {
+      Decode(&p[ofs], size - ofs, mode, &instr);
+      s.Add(instr);
+      ofs += instr.length;
+    }
+  };
+  vector<thread> threads;
+  for (int i = 1; i < num_of_threads; i++) {
+    threads.emplace_back(worker, i);
+  }
+  worker(0);
+  for (thread &t : threads) {
+    t.join();
+  }
+  for (int i = 0; i < num_of_threads; i++) {
+    stats->Merge(part_stats[i]);
+  }
+}
@@ -0,0 +1,48 @@
+#ifndef MUIMSA_STATS_H_
+#define MUIMSA_STATS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "decoder.h"
+#include "formatter.h"
+
+// Instruction-mix counters. Fixed-size so that each thread can own one and
+// they can be merged at the end.
+struct InstrStats {
+  static constexpr int kNumOfMaps = static_cast<int>(OpcodeMap::kEVEX) + 1;
+  static constexpr int kMaxLength = 15;
+
+  uint64_t num_of_instrs;
+  uint64_t num_of_bytes;
+  uint64_t num_of_invalid;
+  uint64_t by_opcode[kNumOfMaps][256];
+  uint64_t by_mnemonic[static_cast<int>(Mnemonic::kNumOfMnemonics)];
+  uint64_t by_length[kMaxLength + 1];
+  uint64_t with_legacy_prefix;
+  uint64_t with_lock;
+  uint64_t with_rep;  // F2 or F3
+  uint64_t with_opsize;
+  uint64_t with_addrsize;
+  uint64_t with_segment;
+  uint64_t with_rex;
+  uint64_t with_rex_w;
+  uint64_t with_memory_operand;
+  uint64_t rip_relative;
+  uint64_t with_immediate;
+  uint64_t branch_rel8;
+  uint64_t branch_rel32;  // rel16 in 16-bit operand size as well
+
+  void Add(const Instr &instr);
+  void Merge(const InstrStats &other);
+  // Prints a summary and the top_n most frequent opcodes and mnemonics.
+  void Print(OutputBuffer *out, int top_n) const;
+};
+
+// Adds every instruction in [p, p + size) to stats. Boundaries are found by
+// DecodeLengths() first, then the instructions are decoded on num_of_threads
+// threads into per-thread InstrStats which are merged into stats.
+void CollectStats(const uint8_t *p, size_t size, CPUMode mode,
+                  int num_of_threads, InstrStats *stats);
+
+#endif  // MUIMSA_STATS_H_
@@ -1,61 +1,257 @@
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "asmium.h"
 
+// The sources of the tokens (TokenFileIndex): the main source of the
+// assembly at 0, and the included files (LoadIncludeFile).
+SourceFile *source_files[MAX_SOURCE_FILES];
+
+// The parser stays in one file for many tokens, so the file of the last
+// lookup is tried first.
+int token_file_hint;
+
+int IsTokenOfFile(const TokenStr *ts, int index) {
+  const SourceFile *file = source_files[index];
+  return file && (uintptr_t)ts - (uintptr_t)file->tokens <
+                     (uintptr_t)file->num_of_tokens;
+}
+
+int TokenFileIndex(const TokenStr *ts) {
+  if (IsTokenOfFile(ts, token_file_hint)) {
+    return token_file_hint;
+  }
+  for (int index = 0; index < MAX_SOURCE_FILES; index++) {
+    if (IsTokenOfFile(ts, index)) {
+      token_file_hint = index;
+      return index;
+    }
+  }
+  Error("Token of no source file");
+  return 0;
+}
+
+// retv: index of the token in the arrays of its file, which is *file
+int TokenIndex(const TokenStr *ts, const SourceFile **file) {
+  *file = source_files[token_file_hint];
+  uintptr_t i = (uintptr_t)ts - (uintptr_t)(*file)->tokens;
+  if (i >= (uintptr_t)(*file)->num_of_tokens) {
+    *file = source_files[TokenFileIndex(ts)];
+    i = ts - (*file)->tokens;
+  }
+  return i;
+}
+
+const char *TokenChars(const TokenStr *ts) {
+  const SourceFile *file;
+  int i = TokenIndex(ts, &file);
+  return &file->text[file->token_offsets[i]];
+}
+
+int TokenLen(const TokenStr *ts) {
+  const SourceFile *file;
+  int i = TokenIndex(ts, &file);
+  return file->token_lens[i];
+}
+
+int TokenLine(const TokenStr *ts) {
+  // 1 + the number of newlines before the token
+  const SourceFile *file;
+  int i = TokenIndex(ts, &file);
+  uint32_t offset = file->token_offsets[i];
+  int lo = 0;
+  int hi = file->num_of_newlines;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (file->newline_offsets[mid] < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo + 1;
+}
+
+int TokenLineFrom(const TokenStr *ts, int *newline) {
+  // Tokens are parsed in order, so *newline mostly moves forward by a few
+  // lines, and TokenLine is only needed to go back.
+  const SourceFile *file;
+  int i = TokenIndex(ts, &file);
+  uint32_t offset = file->token_offsets[i];
+  if (*newline > 0 && file->newline_offsets[*newline - 1] >= offset) {
+    *newline = TokenLine(ts) - 1;
+  }
+  while (*newline < file->num_of_newlines &&
+         file->newline_offsets[*newline] < offset) {
+    (*newline)++;
+  }
+  return *newline + 1;
+}
+
+int IsTokenBeforeNewline(const TokenStr *ts, int newline) {
+  const SourceFile *file;
+  int i = TokenIndex(ts, &file);
+  uint32_t offset = file->token_offsets[i];
+  return newline >= file->num_of_newlines ||
+         offset < file->newline_offsets[newline];
+}
+
+int64_t TokenInteger(const TokenStr *ts) {
+  const SourceFile *file;
+  int i = TokenIndex(ts, &file);
+  return file->integers[file->token_values[i]];
+}
+
+const char *TokenPath(const TokenStr *ts) {
+  return source_files[TokenFileIndex(ts)]->path;
+}
+
 void PrintTokenStr(const TokenStr *ts) {
-  write(STDOUT_FILENO, ts->str, ts->len);
+  write(STDOUT_FILENO, TokenChars(ts), TokenLen(ts));
 }
 void DebugPrintTokenStr(const TokenStr *ts) {
   if (ts->type == kIdentifier || ts->type == kInteger ||
       ts->type == kOperator || ts->type == kMemOfsBegin ||
       ts->type == kMemOfsEnd) {
     fflush(stdout);
-    write(STDOUT_FILENO, ts->str, ts->len);
+    write(STDOUT_FILENO, TokenChars(ts), TokenLen(ts));
     putchar(' ');
   } else if (ts->type == kString) {
     putchar('"');
     fflush(stdout);
-    write(STDOUT_FILENO, ts->str, ts->len);
+    write(STDOUT_FILENO, TokenChars(ts), TokenLen(ts));
     putchar('"');
   } else if (ts->type == kLabel) {
     putchar(':');
     fflush(stdout);
-    write(STDOUT_FILENO, ts->str, ts->len);
+    write(STDOUT_FILENO, TokenChars(ts), TokenLen(ts));
   } else {
     putchar('<');
-    printf("%02X", ts->str[0]);
+    printf("%02X", TokenChars(ts)[0]);
     putchar('>');
   }
 }
 
-void DebugPrintTokens(const TokenStr *toke_str_list, int used) {
+void DebugPrintTokens(const SourceFile *file) {
+  // Tokens are in order, so the lines are counted along them.
   int line = 0;
-  for (int i = 0; i < used; i++) {
-    if (line != toke_str_list[i].line) {
-      line = toke_str_list[i].line;
+  int newlines = 0;
+  for (int i = 0; i < file->num_of_tokens; i++) {
+    while (newlines < file->num_of_newlines &&
+           file->newline_offsets[newlines] < file->token_offsets[i]) {
+      newlines++;
+    }
+    if (line != newlines + 1) {
+      line = newlines + 1;
       printf("\n%d\t", line);
     }
-    DebugPrintTokenStr(&toke_str_list[i]);
+    DebugPrintTokenStr(&file->tokens[i]);
   }
   putchar('\n');
 }
 
+// The tables of the file being tokenized grow in this arena.
+Arena *tokenize_arena;
+
+void TokenizeError(const SourceFile *file, int line, const char *fmt, ...) {
+  char message[256];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(message, sizeof(message), fmt, ap);
+  va_end(ap);
+  ReportErrorIn(file->path, line, "%s", message);
+}
+
+void AddNewline(SourceFile *file, const char *s) {
+  file->newline_offsets = ArenaReserve(
+      tokenize_arena, file->newline_offsets, &file->newline_offsets_capacity,
+      file->num_of_newlines + 1, sizeof(uint32_t));
+  file->newline_offsets[file->num_of_newlines++] = s - file->text;
+}
+
+void DecodeIntegerToken(SourceFile *file, int i, int line) {
+  // 0x (hex), 0b (binary) or decimal, scanned by Tokenize
+  // Errors are reported and the value is 0, so that parsing goes on.
+  const char *s = &file->text[file->token_offsets[i]];
+  int len = file->token_lens[i];
+  char tmpstr[64 + 1];
+  int64_t value = 0;
+  if (len >= (int)sizeof(tmpstr)) {
+    TokenizeError(file, line, "Too long integer");
+  } else {
+    memcpy(tmpstr, s, len);
+    tmpstr[len] = 0;
+    int is_binary = len > 2 && s[1] == 'b';
+    char *p;
+    value = strtoll(is_binary ? &tmpstr[2] : tmpstr, &p, is_binary ? 2 : 0);
+    if (*p != '\0' || (len == 2 && (s[1] == 'x' || s[1] == 'b'))) {
+      TokenizeError(file, line, "Not valid integer. '%s'", tmpstr);
+      value = 0;
+    }
+  }
+  file->integers =
+      ArenaReserve(tokenize_arena, file->integers, &file->integers_capacity,
+                   file->num_of_integers + 1, sizeof(int64_t));
+  file->token_values[i] = file->num_of_integers;
+  file->integers[file->num_of_integers++] = value;
+}
+
+// retv: index of a new token of file, whose arrays grow together
+int AddToken(SourceFile *file) {
+  if ((size_t)file->num_of_tokens == file->tokens_capacity) {
+    size_t needed = file->num_of_tokens + 1;
+    size_t capacity = file->tokens_capacity;
+    file->tokens = ArenaReserve(tokenize_arena, file->tokens, &capacity,
+                                needed, sizeof(TokenStr));
+    capacity = file->tokens_capacity;
+    file->token_offsets = ArenaReserve(tokenize_arena, file->token_offsets,
+                                       &capacity, needed, sizeof(uint32_t));
+    capacity = file->tokens_capacity;
+    file->token_lens = ArenaReserve(tokenize_arena, file->token_lens,
+                                    &capacity, needed, sizeof(uint16_t));
+    capacity = file->tokens_capacity;
+    file->token_values = ArenaReserve(tokenize_arena, file->token_values,
+                                      &capacity, needed, sizeof(uint32_t));
+    file->tokens_capacity = capacity;
+  }
+  return file->num_of_tokens++;
+}
+
 #define IS_TOKEN_CHAR(c)                                                       \
   (('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || (c == '_'))
 #define IS_DIGIT(c) (('0' <= c && c <= '9'))
 #define IS_BINDIGIT(c) (('0' <= c && c <= '1'))
 #define IS_HEXDIGIT(c)                                                         \
   (('0' <= c && c <= '9') || ('A' <= c && c <= 'F') || ('a' <= c && c <= 'f'))
-void Tokenize(TokenStr *toke_str_list, int size, int *used, const char *s) {
+void Tokenize(SourceFile *file, Arena *arena) {
+  const char *s = file->text;
+  tokenize_arena = arena;
+  file->tokens = NULL;
+  file->token_offsets = NULL;
+  file->token_lens = NULL;
+  file->token_values = NULL;
+  file->num_of_tokens = 0;
+  file->tokens_capacity = 0;
+  file->newline_offsets = NULL;
+  file->num_of_newlines = 0;
+  file->newline_offsets_capacity = 0;
+  file->integers = NULL;
+  file->num_of_integers = 0;
+  file->integers_capacity = 0;
   int line_count = 1;
   while (*s) {
     if ((*s <= 0x20 || *s == 0x7f || (uint8_t)*s == 0xff)) {
       // Skip non printable
-      if (*s == '\n')
+      if (*s == '\n') {
+        AddNewline(file, s);
         line_count++;
+      }
       s++;
     } else if (*s == '#' || (s[0] == '/' && s[1] == '/')) {
       // Line comment
@@ -75,92 +271,207 @@ void Tokenize(TokenStr *toke_str_list, int size, int *used, const char *s) {
           if (!nest_count)
             break;
         } else {
-          if (*s == '\n')
+          if (*s == '\n') {
+            AddNewline(file, s);
             line_count++;
+          }
           s++;
         }
       }
       if (nest_count) {
-        fputs("Block comment marker is not balanced.\n", stderr);
-        exit(EXIT_FAILURE);
+        TokenizeError(file, line_count, "Block comment marker is not balanced");
       }
     } else {
       // Token cases
-      if (*used >= size) {
-        fputs("No more space for token. Abort.\n", stderr);
-        exit(EXIT_FAILURE);
-      }
-      TokenStr *ts = &toke_str_list[(*used)++];
-      ts->line = line_count;
+      int i = AddToken(file);
+      TokenStr *ts = &file->tokens[i];
+      const char *begin;
+      int len = 0;
 
       if (IS_TOKEN_CHAR(*s)) {
         ts->type = kIdentifier;
-        ts->str = s;
+        begin = s;
         while (IS_TOKEN_CHAR(*s) || IS_DIGIT(*s)) {
-          ts->len++;
+          len++;
           s++;
         }
       } else if (*s == ':') {
         ts->type = kLabel;
-        ts->str = ++s; // skip ':'
-        ts->len = 0;
+        begin = ++s; // skip ':'
+        len = 0;
         while (IS_TOKEN_CHAR(*s) || IS_DIGIT(*s)) {
-          ts->len++;
+          len++;
           s++;
         }
       } else if (IS_DIGIT(*s)) {
         ts->type = kInteger;
-        ts->str = s;
+        begin = s;
         if (s[0] == '0' && s[1] == 'x') {
-          ts->len = 2;
+          len = 2;
           s += 2;
           while (IS_HEXDIGIT(*s)) {
-            ts->len++;
+            len++;
             s++;
           }
         } else if (s[0] == '0' && s[1] == 'b') {
-          ts->len = 2;
+          len = 2;
           s += 2;
           while (IS_BINDIGIT(*s)) {
-            ts->len++;
+            len++;
             s++;
           }
         } else {
           while (IS_DIGIT(*s)) {
-            ts->len++;
+            len++;
             s++;
           }
         }
       } else if (*s == '"') {
         ts->type = kString;
-        ts->str = ++s;
+        begin = ++s;
         while (*s != '"' || s[-1] == '\\') {
           if (!*s) {
-            fputs("Unexpected NULL character in string literal\n", stderr);
-            exit(EXIT_FAILURE);
+            TokenizeError(file, line_count,
+                          "Unexpected NULL character in string literal");
+            break;
           }
-          ts->len++;
+          len++;
+          s++;
+        }
+        if (*s) {
           s++;
         }
-        s++;
       } else if (*s == '[') {
         ts->type = kMemOfsBegin;
-        ts->str = s++;
-        ts->len = 1;
+        begin = s++;
+        len = 1;
       } else if (*s == ']') {
         ts->type = kMemOfsEnd;
-        ts->str = s++;
-        ts->len = 1;
+        begin = s++;
+        len = 1;
       } else {
         ts->type = kOperator;
-        ts->str = s++;
-        ts->len = 1;
-        if ((ts->str[0] == '^' && ts->str[1] == '=') ||
-            (ts->str[0] == '+' && ts->str[1] == '+')) {
+        begin = s++;
+        len = 1;
+        if ((begin[0] == '^' && begin[1] == '=') ||
+            (begin[0] == '+' && begin[1] == '+')) {
           s++;
-          ts->len++;
+          len++;
         }
       }
+      if (len > UINT16_MAX) {
+        TokenizeError(file, line_count, "Too long token");
+        len = UINT16_MAX;
+      }
+      file->token_offsets[i] = begin - file->text;
+      file->token_lens[i] = len;
+      file->token_values[i] = 0;
+      if (ts->type == kInteger) {
+        DecodeIntegerToken(file, i, line_count);
+      }
     }
   }
 }
+
+//
+// Included files
+//
+// Each included file is tokenized once per process into its own arena.
+// Later includes, also in later assemblies (--watch, --daemon), reuse the
+// tokens by reference while the mtime and the size of the file are the
+// same. Files are identified by (st_dev, st_ino), so that another spelling
+// of the path, or the main source itself, maps to the same index.
+//
+
+#ifdef __APPLE__
+#define ST_MTIM st_mtimespec
+#else
+#define ST_MTIM st_mtim
+#endif
+
+typedef struct {
+  SourceFile file;
+  char path[4096];
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  off_t size; // -1 if the tokens should not be reused (errors)
+  Arena arena;
+  int generation; // of the assembly which checked the file last
+} IncludedFile;
+
+IncludedFile included_files[MAX_SOURCE_FILES]; // [0]: the main source
+int included_files_used = 1;
+int include_generation;
+
+void ResetSourceFiles(SourceFile *main_source) {
+  source_files[0] = main_source;
+  // No file has inode 0, so nothing matches until SetMainSourceFile.
+  included_files[0].dev = 0;
+  included_files[0].ino = 0;
+  include_generation++;
+}
+
+void SetMainSourceFile(FILE *fp) {
+  struct stat st;
+  if (!fstat(fileno(fp), &st)) {
+    included_files[0].dev = st.st_dev;
+    included_files[0].ino = st.st_ino;
+  }
+}
+
+int LoadIncludeFile(const char *path) {
+  struct stat st;
+  if (stat(path, &st)) {
+    return -1;
+  }
+  int index = 0;
+  while (index < included_files_used &&
+         (included_files[index].ino != st.st_ino ||
+          included_files[index].dev != st.st_dev)) {
+    index++;
+  }
+  IncludedFile *included = &included_files[index];
+  if (index == 0 || (index < included_files_used &&
+                     included->generation == include_generation)) {
+    // The main source, or checked in this assembly, whose tokens may refer
+    // to it.
+    return index;
+  }
+  if (index < included_files_used && included->size == st.st_size &&
+      included->mtime.tv_sec == st.ST_MTIM.tv_sec &&
+      included->mtime.tv_nsec == st.ST_MTIM.tv_nsec) {
+    included->generation = include_generation;
+    return index;
+  }
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    return -1;
+  }
+  if (index == included_files_used) {
+    if (index >= MAX_SOURCE_FILES) {
+      fclose(fp);
+      ErrorAt(0, "%s: Too many included files", path);
+    }
+    included->dev = st.st_dev;
+    included->ino = st.st_ino;
+    included_files_used++;
+  } else {
+    ArenaFree(&included->arena); // changed: tokenize it again
+  }
+  // The path of the first include which read it names it in diagnostics.
+  snprintf(included->path, sizeof(included->path), "%s", path);
+  included->file.path = included->path;
+  included->file.text = ReadSource(fp, &included->arena);
+  fclose(fp);
+  included->size = -1; // until it is tokenized without errors
+  included->generation = include_generation;
+  source_files[index] = &included->file;
+  int num_of_errors_before = num_of_errors;
+  Tokenize(&included->file, &included->arena);
+  if (num_of_errors == num_of_errors_before) {
+    included->size = st.st_size;
+    included->mtime = st.ST_MTIM;
+  }
+  return index;
+}
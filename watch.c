@@ -0,0 +1,358 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "asmium.h"
+
+//
+// Watch and daemon modes
+//
+// The process stays up between assemblies. ResetAssembly only rewinds the
+// arena, so each assembly reuses the warm chunks of the previous one
+// instead of mapping new memory, and the output replaces the old file
+// atomically (is_atomic_output).
+//
+
+double MillisecondsSince(const struct timespec *begin) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - begin->tv_sec) * 1e3 +
+         (now.tv_nsec - begin->tv_nsec) / 1e6;
+}
+
+// The main source and the files it included in the last assembly, whose
+// changes start the next one.
+typedef struct {
+  const char *path;
+  const char *name; // in path, after the directory
+  int wd;           // inotify watch of the directory
+  struct timespec mtime;
+} WatchedFile;
+
+WatchedFile watched_files[MAX_SOURCE_FILES];
+int watched_files_used;
+
+#ifdef __APPLE__
+#define ST_MTIM st_mtimespec
+#else
+#define ST_MTIM st_mtim
+#endif
+
+#ifdef __linux__
+// retv: inotify fd, or -1.
+int StartWatching() {
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) {
+    perror("inotify");
+  }
+  return fd;
+}
+
+// Editors often write a new file and rename it to the source, so the
+// directory of each file is watched for its name.
+void WatchFile(int fd, WatchedFile *file) {
+  char dir[4096];
+  if (file->name != file->path) {
+    snprintf(dir, sizeof(dir), "%.*s", (int)(file->name - file->path - 1),
+             file->path);
+    if (!dir[0]) {
+      strcpy(dir, "/");
+    }
+  } else {
+    strcpy(dir, ".");
+  }
+  // The directory of several files has one watch (the same wd).
+  file->wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (file->wd < 0) {
+    perror(dir);
+  }
+}
+
+// retv: 0 when one of the files is written or replaced.
+int WaitForChange(int fd) {
+  uint64_t events[512]; // aligned for struct inotify_event
+  for (;;) {
+    ssize_t len = read(fd, events, sizeof(events));
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      perror("inotify");
+      return 1;
+    }
+    const uint8_t *p = (const uint8_t *)events;
+    while (p < (const uint8_t *)events + len) {
+      const struct inotify_event *event = (const struct inotify_event *)p;
+      for (int i = 0; event->len && i < watched_files_used; i++) {
+        if (event->wd == watched_files[i].wd &&
+            strcmp(event->name, watched_files[i].name) == 0) {
+          return 0;
+        }
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+#else
+// Without inotify, the modification times are polled every 10 ms.
+int StartWatching() {
+  return 0;
+}
+
+void WatchFile(int fd, WatchedFile *file) {
+  struct stat st;
+  file->mtime.tv_sec = file->mtime.tv_nsec = 0;
+  if (!stat(file->path, &st)) {
+    file->mtime = st.ST_MTIM;
+  }
+}
+
+int WaitForChange(int fd) {
+  for (;;) {
+    usleep(10000);
+    for (int i = 0; i < watched_files_used; i++) {
+      struct stat st;
+      const struct timespec *mtime = &watched_files[i].mtime;
+      if (!stat(watched_files[i].path, &st) &&
+          (st.ST_MTIM.tv_sec != mtime->tv_sec ||
+           st.ST_MTIM.tv_nsec != mtime->tv_nsec)) {
+        return 0;
+      }
+    }
+  }
+}
+#endif
+
+// Watches the main source and the files included by the last assembly.
+void WatchSourceFiles(int fd) {
+  watched_files_used = 0;
+  for (int i = 0; i < MAX_SOURCE_FILES; i++) {
+    if (!IsSourceFileUsed(i)) {
+      continue;
+    }
+    WatchedFile *file = &watched_files[watched_files_used++];
+    file->path = i ? source_files[i]->path : src_path;
+    const char *slash = strrchr(file->path, '/');
+    file->name = slash ? slash + 1 : file->path;
+    WatchFile(fd, file);
+  }
+}
+
+int WatchAndAssemble() {
+  int fd = StartWatching();
+  if (fd < 0) {
+    return 1;
+  }
+  is_atomic_output = 1;
+  for (;;) {
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    int status = Assemble();
+    double ms = MillisecondsSince(&begin);
+    if (num_of_errors) {
+      PrintDiagnostics(stderr);
+    }
+    WatchSourceFiles(fd);
+    fprintf(stderr,
+            "asmium: %s %s in %.3f ms (status %d), watching %d file%s\n",
+            src_path, num_of_errors ? "failed" : "assembled", ms, status,
+            watched_files_used, watched_files_used == 1 ? "" : "s");
+    fflush(stdout);
+    if (WaitForChange(fd)) {
+      return 1;
+    }
+  }
+}
+
+//
+// A request is the working directory of the client and its arguments, each
+// terminated by NUL, up to the end of the stream (shutdown by the client).
+// The reply is the diagnostics and then the exit status as a byte.
+//
+
+#define MAX_REQUEST_SIZE 65536
+#define MAX_REQUEST_ARGS 256
+
+int OpenSocket(const char *socket_path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "%s: Too long socket path\n", socket_path);
+    return -1;
+  }
+  strcpy(addr->sun_path, socket_path);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
+    perror("socket");
+  }
+  return sock;
+}
+
+int WriteAll(int fd, const void *data, size_t size) {
+  const uint8_t *p = data;
+  while (size) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 1;
+    }
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+void ServeRequest(int conn) {
+  static char request[MAX_REQUEST_SIZE];
+  char *argv[MAX_REQUEST_ARGS + 1];
+  size_t size = 0;
+  ssize_t n;
+  while (size < sizeof(request) &&
+         (n = read(conn, &request[size], sizeof(request) - size)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    size += n;
+  }
+  FILE *fp = fdopen(dup(conn), "w");
+  if (!fp) {
+    return;
+  }
+  int status = EXIT_FAILURE;
+  int argc = 0;
+  argv[argc++] = "asmium";
+  for (size_t i = 0; size && request[size - 1] == 0 && i < size;
+       i += strlen(&request[i]) + 1) {
+    if (argc >= MAX_REQUEST_ARGS) {
+      argc = 0;
+      break;
+    }
+    argv[argc++] = &request[i];
+  }
+  // The paths of the request are relative to the client, and the daemon
+  // returns to its own directory afterwards.
+  int daemon_cwd = open(".", O_RDONLY | O_DIRECTORY);
+  if (argc < 2 || size == sizeof(request)) {
+    fputs("Invalid request\n", fp);
+  } else if (daemon_cwd < 0 || chdir(argv[1])) {
+    fprintf(fp, "%s: %s\n", argv[1], strerror(errno));
+  } else {
+    // argv[1] (the directory) is replaced by the program name
+    argv[1] = argv[0];
+    argv[argc] = NULL;
+    ResetOptions();
+    if (ParseArgs(argc - 1, &argv[1], fp)) {
+      // reported by ParseArgs
+    } else if (NeedsOwnProcess()) {
+      fputs("--run, --bench, --watch and --daemon are not for the daemon\n",
+            fp);
+    } else {
+      status = Assemble();
+      if (num_of_errors) {
+        PrintDiagnostics(fp);
+      }
+    }
+  }
+  if (daemon_cwd >= 0) {
+    if (fchdir(daemon_cwd)) {
+      perror("fchdir");
+    }
+    close(daemon_cwd);
+  }
+  fputc(status, fp);
+  fclose(fp);
+}
+
+int RunDaemon(const char *socket_path) {
+  struct sockaddr_un addr;
+  int sock = OpenSocket(socket_path, &addr);
+  if (sock < 0) {
+    return 1;
+  }
+  unlink(socket_path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(sock, 16)) {
+    perror(socket_path);
+    return 1;
+  }
+  // A client which goes away must not take the daemon with it.
+  signal(SIGPIPE, SIG_IGN);
+  is_atomic_output = 1;
+  fprintf(stderr, "asmium: listening on %s\n", socket_path);
+  for (;;) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("accept");
+      return 1;
+    }
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    ServeRequest(conn);
+    close(conn);
+    fprintf(stderr, "asmium: request done in %.3f ms\n",
+            MillisecondsSince(&begin));
+  }
+}
+
+int RunClient(const char *socket_path, int argc, char *argv[]) {
+  struct sockaddr_un addr;
+  int sock = OpenSocket(socket_path, &addr);
+  if (sock < 0) {
+    return 1;
+  }
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+    perror(socket_path);
+    return 1;
+  }
+  char cwd[4096];
+  if (!getcwd(cwd, sizeof(cwd)) || WriteAll(sock, cwd, strlen(cwd) + 1)) {
+    perror("request");
+    return 1;
+  }
+  for (int i = 0; i < argc; i++) {
+    if (WriteAll(sock, argv[i], strlen(argv[i]) + 1)) {
+      perror("request");
+      return 1;
+    }
+  }
+  shutdown(sock, SHUT_WR);
+  // Everything but the last byte (the exit status) is diagnostics.
+  char reply[4096];
+  int status = -1;
+  ssize_t n;
+  while ((n = read(sock, reply, sizeof(reply))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (status != -1) {
+      fputc(status, stderr);
+    }
+    fwrite(reply, 1, n - 1, stderr);
+    status = (uint8_t)reply[n - 1];
+  }
+  close(sock);
+  return status == -1 ? 1 : status;
+}